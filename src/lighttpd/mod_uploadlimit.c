@@ -0,0 +1,379 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * shape the uploads from this host to the other peers.
+ *
+ * while a host installs, the other hosts fetch the files it already has
+ * from its /install tree. without a limit, a host with popular packages
+ * spends its network and disk on them and its own install slows down.
+ *
+ * an upload is a request for /install/... that doesn't come from this
+ * host (the installer's own requests come from 127.0.0.1 and are rewritten
+ * to tracker-client). the uploads share a token bucket that fills at
+ * uploadlimit.kbytes-per-second and holds up to uploadlimit.burst-kbytes.
+ * once a second, the tokens in the bucket are split evenly over the
+ * uploads that are running and each one is held to its share with
+ * lighttpd's own per-connection limit. while the installer on this host
+ * is reading files, the uploads only get uploadlimit.local-percent of the
+ * tokens. requests from this host are never limited.
+ *
+ * the bucket is refilled once a second, so it has to hold at least a
+ * second's worth of tokens. a smaller uploadlimit.burst-kbytes is raised
+ * to uploadlimit.kbytes-per-second.
+ *
+ * at most uploadlimit.max-uploads uploads run at once. a peer that asks
+ * for one more gets a '503', and tracker-client on that peer gets the
+ * file from someone else.
+ *
+ * this is built against the lighttpd source tree and loaded like any
+ * other module:
+ *
+ *	server.modules += ( "mod_uploadlimit" )
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "base.h"
+#include "log.h"
+#include "buffer.h"
+#include "response.h"
+#include "plugin.h"
+
+typedef struct {
+	unsigned short	kbytes_per_second;	/* 0 means no limit */
+	unsigned short	burst_kbytes;
+	unsigned short	max_uploads;		/* 0 means no limit */
+	unsigned short	local_percent;
+} plugin_config;
+
+typedef struct {
+	PLUGIN_DATA;
+	plugin_config	**config_storage;
+	plugin_config	conf;
+
+	off_t		tokens;		/* bytes */
+} plugin_data;
+
+/*
+ * one for each upload
+ */
+typedef struct {
+	off_t		written;	/* con->bytes_written a second ago */
+} handler_ctx;
+
+INIT_FUNC(mod_uploadlimit_init)
+{
+	plugin_data	*p;
+
+	p = calloc(1, sizeof(*p));
+	return(p);
+}
+
+FREE_FUNC(mod_uploadlimit_free)
+{
+	plugin_data	*p = p_d;
+	size_t		i;
+
+	if (p == NULL) {
+		return(HANDLER_GO_ON);
+	}
+
+	if (p->config_storage != NULL) {
+		for (i = 0 ; i < srv->config_context->used ; ++i) {
+			free(p->config_storage[i]);
+		}
+		free(p->config_storage);
+	}
+
+	free(p);
+	return(HANDLER_GO_ON);
+}
+
+SETDEFAULTS_FUNC(mod_uploadlimit_set_defaults)
+{
+	plugin_data	*p = p_d;
+	plugin_config	*s;
+	size_t		i;
+
+	config_values_t cv[] = {
+		{ "uploadlimit.kbytes-per-second", NULL, T_CONFIG_SHORT,
+			T_CONFIG_SCOPE_SERVER },
+		{ "uploadlimit.burst-kbytes", NULL, T_CONFIG_SHORT,
+			T_CONFIG_SCOPE_SERVER },
+		{ "uploadlimit.max-uploads", NULL, T_CONFIG_SHORT,
+			T_CONFIG_SCOPE_SERVER },
+		{ "uploadlimit.local-percent", NULL, T_CONFIG_SHORT,
+			T_CONFIG_SCOPE_SERVER },
+		{ NULL, NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
+	};
+
+	p->config_storage = calloc(1, srv->config_context->used *
+		sizeof(plugin_config *));
+
+	for (i = 0 ; i < srv->config_context->used ; ++i) {
+		s = calloc(1, sizeof(plugin_config));
+		s->kbytes_per_second = 0;
+		s->burst_kbytes = 0;
+		s->max_uploads = 0;
+		s->local_percent = 100;
+
+		cv[0].destination = &(s->kbytes_per_second);
+		cv[1].destination = &(s->burst_kbytes);
+		cv[2].destination = &(s->max_uploads);
+		cv[3].destination = &(s->local_percent);
+
+		p->config_storage[i] = s;
+
+		if (config_insert_values_global(srv, ((data_config *)
+				srv->config_context->data[i])->value, cv) != 0) {
+			return(HANDLER_ERROR);
+		}
+	}
+
+	/*
+	 * the options only make sense for the whole server
+	 */
+	s = p->config_storage[0];
+	p->conf = *s;
+
+	if (p->conf.burst_kbytes < p->conf.kbytes_per_second) {
+		p->conf.burst_kbytes = p->conf.kbytes_per_second;
+	}
+
+	if (p->conf.local_percent > 100) {
+		p->conf.local_percent = 100;
+	}
+
+	p->tokens = (off_t)p->conf.burst_kbytes * 1024;
+
+	return(HANDLER_GO_ON);
+}
+
+static int
+islocal(connection *con)
+{
+	return((con->dst_addr.plain.sa_family == AF_INET) &&
+		((ntohl(con->dst_addr.ipv4.sin_addr.s_addr) >> 24) == 127));
+}
+
+/*
+ * how many uploads are running, and is the installer on this host reading
+ * a file
+ */
+static size_t
+count(server *srv, plugin_data *p, int *local)
+{
+	connection	*c;
+	size_t		uploads = 0;
+	size_t		i;
+
+	*local = 0;
+
+	for (i = 0 ; i < srv->conns->used ; ++i) {
+		c = srv->conns->ptr[i];
+
+		/*
+		 * a connection that is being torn down doesn't send
+		 * anything anymore, even if done() hasn't run for it yet
+		 */
+		if ((c->state == CON_STATE_CLOSE) ||
+				(c->state == CON_STATE_ERROR)) {
+			continue;
+		}
+
+		if (c->plugin_ctx[p->id] != NULL) {
+			++uploads;
+		} else if (islocal(c) && (c->state > CON_STATE_REQUEST_END)) {
+			*local = 1;
+		}
+	}
+
+	return(uploads);
+}
+
+/*
+ * each upload's share of the tokens, in kbytes a second
+ */
+static unsigned short
+share(plugin_data *p, size_t uploads, int local)
+{
+	off_t	tokens = p->tokens;
+	off_t	kbytes;
+
+	if (tokens < 0) {
+		tokens = 0;
+	}
+
+	if (local) {
+		tokens = (tokens / 100) * p->conf.local_percent;
+	}
+
+	if (uploads == 0) {
+		uploads = 1;
+	}
+
+	kbytes = tokens / (1024 * (off_t)uploads);
+
+	/*
+	 * 0 means 'no limit' to lighttpd
+	 */
+	if (kbytes < 1) {
+		kbytes = 1;
+	} else if (kbytes > 65535) {
+		kbytes = 65535;
+	}
+
+	return((unsigned short)kbytes);
+}
+
+URIHANDLER_FUNC(mod_uploadlimit_uri_handler)
+{
+	plugin_data	*p = p_d;
+	handler_ctx	*hctx;
+	size_t		uploads;
+	int		local;
+
+	if ((con->uri.path->used == 0) || islocal(con) ||
+			(con->plugin_ctx[p->id] != NULL)) {
+		return(HANDLER_GO_ON);
+	}
+
+	if (strncmp(con->uri.path->ptr, "/install/", 9) != 0) {
+		return(HANDLER_GO_ON);
+	}
+
+	uploads = count(srv, p, &local);
+
+	if ((p->conf.max_uploads > 0) && (uploads >= p->conf.max_uploads)) {
+		response_header_overwrite(srv, con,
+			CONST_STR_LEN("Retry-After"), CONST_STR_LEN("1"));
+
+		con->http_status = 503;
+		con->mode = DIRECT;
+		return(HANDLER_FINISHED);
+	}
+
+	if ((hctx = calloc(1, sizeof(*hctx))) == NULL) {
+		return(HANDLER_GO_ON);
+	}
+
+	hctx->written = con->bytes_written;
+	con->plugin_ctx[p->id] = hctx;
+
+	if (p->conf.kbytes_per_second > 0) {
+		con->conf.kbytes_per_second = share(p, uploads + 1, local);
+	}
+
+	return(HANDLER_GO_ON);
+}
+
+/*
+ * once a second: take what the uploads sent out of the bucket, refill
+ * it, and hand out new shares
+ */
+TRIGGER_FUNC(mod_uploadlimit_trigger)
+{
+	plugin_data	*p = p_d;
+	connection	*c;
+	handler_ctx	*hctx;
+	unsigned short	kbytes;
+	size_t		uploads;
+	size_t		i;
+	int		local;
+
+	if (p->conf.kbytes_per_second == 0) {
+		return(HANDLER_GO_ON);
+	}
+
+	for (i = 0 ; i < srv->conns->used ; ++i) {
+		c = srv->conns->ptr[i];
+
+		if ((hctx = c->plugin_ctx[p->id]) != NULL) {
+			p->tokens -= (c->bytes_written - hctx->written);
+			hctx->written = c->bytes_written;
+		}
+	}
+
+	p->tokens += (off_t)p->conf.kbytes_per_second * 1024;
+	if (p->tokens > ((off_t)p->conf.burst_kbytes * 1024)) {
+		p->tokens = (off_t)p->conf.burst_kbytes * 1024;
+	}
+
+	uploads = count(srv, p, &local);
+	kbytes = share(p, uploads, local);
+
+	for (i = 0 ; i < srv->conns->used ; ++i) {
+		c = srv->conns->ptr[i];
+
+		if (c->plugin_ctx[p->id] != NULL) {
+			c->conf.kbytes_per_second = kbytes;
+		}
+	}
+
+	return(HANDLER_GO_ON);
+}
+
+/*
+ * the upload is over. the bytes it sent since the last tick still come
+ * out of the bucket.
+ */
+static handler_t
+done(server *srv, connection *con, plugin_data *p)
+{
+	handler_ctx	*hctx;
+
+	if ((hctx = con->plugin_ctx[p->id]) == NULL) {
+		return(HANDLER_GO_ON);
+	}
+
+	p->tokens -= (con->bytes_written - hctx->written);
+
+	free(hctx);
+	con->plugin_ctx[p->id] = NULL;
+
+	return(HANDLER_GO_ON);
+}
+
+static handler_t
+mod_uploadlimit_reset(server *srv, connection *con, void *p_d)
+{
+	return(done(srv, con, p_d));
+}
+
+static handler_t
+mod_uploadlimit_close(server *srv, connection *con, void *p_d)
+{
+	return(done(srv, con, p_d));
+}
+
+int mod_uploadlimit_plugin_init(plugin *p);
+
+int
+mod_uploadlimit_plugin_init(plugin *p)
+{
+	p->version = LIGHTTPD_VERSION_ID;
+	p->name = buffer_init_string("uploadlimit");
+
+	p->init = mod_uploadlimit_init;
+	p->set_defaults = mod_uploadlimit_set_defaults;
+	p->handle_uri_clean = mod_uploadlimit_uri_handler;
+	p->handle_trigger = mod_uploadlimit_trigger;
+	p->connection_reset = mod_uploadlimit_reset;
+	p->handle_connection_close = mod_uploadlimit_close;
+	p->cleanup = mod_uploadlimit_free;
+
+	p->data = NULL;
+
+	return(0);
+}
@@ -50,6 +50,7 @@ extern int h_errno;
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <netinet/in.h>
@@ -575,6 +576,7 @@ const char *ftpStrerror(int errorNumber, urlprotocol protocol) {
     }
 }
 
+#ifndef ROCKS
 static int read_headers (char **headers, fd_set *readSet, int sock)
 {
     char *nextChar;
@@ -628,6 +630,7 @@ static int read_headers (char **headers, fd_set *readSet, int sock)
 
     return 0;
 }
+#endif /* ROCKS */
 
 static char *find_header (char *headers, char *to_find)
 {
@@ -684,6 +687,520 @@ static char *find_status_code (char *headers)
     return retval;
 }
 
+#ifdef ROCKS
+/*
+ * a small HTTP/1.1 client.
+ *
+ * one persistent connection is kept for each server we talk to, so
+ * consecutive files from the same server (e.g., updates.img, product.img
+ * and stage2.img from the local tracker-client) are fetched over one TCP
+ * connection. response headers are read in big chunks instead of one byte
+ * per read().
+ *
+ * the callers read the body until EOF, so httpGetFileDesc() hands them
+ * the read end of a pipe. a child process copies exactly one body
+ * (Content-Length or chunked) from the connection into the pipe. once the
+ * caller is done, httpFinishFileDesc() reaps the child and, if the whole
+ * body was read, puts the connection back in the pool.
+ */
+#define HTTP_MAX_CONNS		4
+#define HTTP_BUF_SIZE		16384
+
+struct httpConn {
+    char host[256];
+    int port;
+    int sock;			/* -1 if not connected */
+    int keepalive;		/* server will keep the connection open */
+    int pipefd;			/* body handed to the caller, -1 if idle */
+    pid_t pump;			/* process copying the body */
+    char buf[HTTP_BUF_SIZE];
+    int buflen;			/* bytes read from sock but not consumed */
+};
+
+static struct httpConn httpConns[HTTP_MAX_CONNS];
+static int httpConnsInit = 0;
+
+static void httpConnClose(struct httpConn *conn) {
+    if (conn->sock >= 0)
+        close(conn->sock);
+    conn->sock = -1;
+    conn->buflen = 0;
+    conn->keepalive = 0;
+}
+
+static struct httpConn *httpConnGet(char *hostname, int port) {
+    struct httpConn *conn, *freeconn = NULL;
+    int i;
+
+    if (!httpConnsInit) {
+        for (i = 0; i < HTTP_MAX_CONNS; i++) {
+            httpConns[i].sock = -1;
+            httpConns[i].pipefd = -1;
+        }
+        httpConnsInit = 1;
+    }
+
+    for (i = 0; i < HTTP_MAX_CONNS; i++) {
+        conn = &httpConns[i];
+
+        if (conn->pipefd >= 0)
+            continue;
+
+        if ((conn->sock >= 0) && (conn->port == port) &&
+                !strcmp(conn->host, hostname))
+            return conn;
+
+        if (!freeconn || (conn->sock < 0))
+            freeconn = conn;
+    }
+
+    if (freeconn) {
+        httpConnClose(freeconn);
+        snprintf(freeconn->host, sizeof(freeconn->host), "%s", hostname);
+        freeconn->port = port;
+    }
+
+    return freeconn;
+}
+
+static int httpConnOpen(struct httpConn *conn) {
+    int family;
+    int rc;
+    struct in_addr addr;
+    struct in6_addr addr6;
+    struct sockaddr_in destPort;
+    struct sockaddr_in6 destPort6;
+
+    family = AF_INET;
+    rc = getHostAddress(conn->host, &addr, family);
+    if (rc) {
+        family = AF_INET6;
+        rc = getHostAddress(conn->host, &addr6, family);
+        if (rc)
+            return rc;
+    }
+
+    conn->sock = socket(family, SOCK_STREAM, IPPROTO_IP);
+    if (conn->sock < 0) {
+        return FTPERR_FAILED_CONNECT;
+    }
+
+    if (family == AF_INET) {
+        memset(&destPort, 0, sizeof(destPort));
+        destPort.sin_family = family;
+        destPort.sin_port = htons(conn->port);
+        destPort.sin_addr = addr;
+
+        rc = connect(conn->sock, (struct sockaddr *) &destPort,
+            sizeof(destPort));
+    } else {
+        memset(&destPort6, 0, sizeof(destPort6));
+        destPort6.sin6_family = family;
+        destPort6.sin6_port = htons(conn->port);
+        destPort6.sin6_addr = addr6;
+
+        rc = connect(conn->sock, (struct sockaddr *) &destPort6,
+            sizeof(destPort6));
+    }
+
+    if (rc) {
+        httpConnClose(conn);
+        return FTPERR_FAILED_CONNECT;
+    }
+
+    conn->buflen = 0;
+    return 0;
+}
+
+/* read more data from the connection into its buffer */
+static int httpConnFill(struct httpConn *conn) {
+    struct timeval timeout;
+    fd_set readSet;
+    int rc;
+
+    /* always leave room for a terminator */
+    if (conn->buflen >= sizeof(conn->buf) - 1)
+        return FTPERR_BAD_SERVER_RESPONSE;
+
+    do {
+        FD_ZERO(&readSet);
+        FD_SET(conn->sock, &readSet);
+
+        timeout.tv_sec = TIMEOUT_SECS;
+        timeout.tv_usec = 0;
+
+        rc = select(conn->sock + 1, &readSet, NULL, NULL, &timeout);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc == 0)
+        return FTPERR_SERVER_TIMEOUT;
+    else if (rc < 0)
+        return FTPERR_SERVER_IO_ERROR;
+
+    do {
+        rc = read(conn->sock, conn->buf + conn->buflen,
+            sizeof(conn->buf) - conn->buflen - 1);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc <= 0)
+        return FTPERR_SERVER_IO_ERROR;
+
+    conn->buflen += rc;
+    return rc;
+}
+
+/* drop the first 'len' bytes of the connection buffer */
+static void httpConnConsume(struct httpConn *conn, int len) {
+    memmove(conn->buf, conn->buf + len, conn->buflen - len);
+    conn->buflen -= len;
+}
+
+/*
+ * read the response headers. anything after the headers stays in the
+ * connection buffer -- it is the start of the body.
+ */
+static int httpReadHeaders(struct httpConn *conn, char **headers) {
+    char *end;
+    int rc;
+
+    *headers = NULL;
+
+    while (1) {
+        conn->buf[conn->buflen] = '\0';
+        if (conn->buflen && ((end = strstr(conn->buf, "\r\n\r\n")) != NULL))
+            break;
+
+        if ((rc = httpConnFill(conn)) < 0)
+            return rc;
+    }
+
+    end += 4;
+    *headers = strndup(conn->buf, end - conn->buf);
+    httpConnConsume(conn, end - conn->buf);
+
+    return 0;
+}
+
+/* write 'len' bytes of the connection buffer to 'fd' and consume them */
+static int httpPumpOut(struct httpConn *conn, int fd, int len) {
+    int i, rc;
+
+    for (i = 0; i < len; i += rc) {
+        rc = write(fd, conn->buf + i, len - i);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    httpConnConsume(conn, len);
+    return 0;
+}
+
+/* read a CRLF terminated line (e.g., a chunk size) from the connection */
+static int httpPumpLine(struct httpConn *conn, char *line, int size) {
+    char *end;
+    int len;
+
+    while (1) {
+        if ((end = memchr(conn->buf, '\n', conn->buflen)) != NULL)
+            break;
+        if (httpConnFill(conn) < 0)
+            return -1;
+    }
+
+    len = end - conn->buf + 1;
+    if (len >= size)
+        return -1;
+
+    memcpy(line, conn->buf, len);
+    line[len] = '\0';
+    httpConnConsume(conn, len);
+
+    return 0;
+}
+
+/*
+ * the body of the pump process. copy one response body from the
+ * connection to 'fd'. exits with 0 only if the whole body was read, which
+ * means the connection can be used for the next request.
+ */
+static void httpPump(struct httpConn *conn, long long length, int chunked,
+                     int fd) {
+    char line[128];
+    long long chunk;
+    int len;
+
+    if (!chunked) {
+        while (length != 0) {
+            if ((conn->buflen == 0) && (httpConnFill(conn) < 0))
+                _exit(length < 0 ? 0 : 1);
+
+            len = conn->buflen;
+            if ((length > 0) && (len > length))
+                len = length;
+
+            if (httpPumpOut(conn, fd, len) < 0)
+                _exit(1);
+
+            if (length > 0)
+                length -= len;
+        }
+
+        _exit(0);
+    }
+
+    while (1) {
+        if (httpPumpLine(conn, line, sizeof(line)) < 0)
+            _exit(1);
+
+        chunk = strtoll(line, NULL, 16);
+        if (chunk == 0)
+            break;
+
+        while (chunk > 0) {
+            if ((conn->buflen == 0) && (httpConnFill(conn) < 0))
+                _exit(1);
+
+            len = conn->buflen;
+            if (len > chunk)
+                len = chunk;
+
+            if (httpPumpOut(conn, fd, len) < 0)
+                _exit(1);
+
+            chunk -= len;
+        }
+
+        /* the CRLF after the chunk data */
+        if (httpPumpLine(conn, line, sizeof(line)) < 0)
+            _exit(1);
+    }
+
+    /* trailers, up to an empty line */
+    do {
+        if (httpPumpLine(conn, line, sizeof(line)) < 0)
+            _exit(1);
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+
+    _exit(0);
+}
+
+/*
+ * start copying the body of the current response to a pipe and return
+ * the read end of the pipe
+ */
+static int httpStartBody(struct httpConn *conn, char *headers) {
+    char *value;
+    long long length = -1;
+    int chunked = 0;
+    int fds[2];
+
+    if ((value = find_header(headers, "Content-Length")) != NULL) {
+        length = strtoll(value, NULL, 10);
+        free(value);
+    }
+
+    if ((value = find_header(headers, "Transfer-Encoding")) != NULL) {
+        if (!strncasecmp(value, "chunked", 7))
+            chunked = 1;
+        free(value);
+    }
+
+    if ((value = find_header(headers, "Connection")) != NULL) {
+        if (!strncasecmp(value, "close", 5))
+            conn->keepalive = 0;
+        free(value);
+    }
+
+    /* without a length, the body ends when the server closes */
+    if ((length < 0) && !chunked)
+        conn->keepalive = 0;
+
+    if (pipe(fds) < 0)
+        return FTPERR_FILE_IO_ERROR;
+
+    if ((conn->pump = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return FTPERR_FILE_IO_ERROR;
+    }
+
+    if (conn->pump == 0) {
+        close(fds[0]);
+        httpPump(conn, length, chunked, fds[1]);
+    }
+
+    close(fds[1]);
+
+    /* the pump process owns the buffered body now */
+    conn->buflen = 0;
+    conn->pipefd = fds[0];
+
+    return fds[0];
+}
+
+/*
+ * called by the consumer of a file descriptor from httpGetFileDesc()
+ * instead of close()
+ */
+int httpFinishFileDesc(int fd) {
+    struct httpConn *conn;
+    int status = 1;
+    int i;
+
+    for (i = 0; i < HTTP_MAX_CONNS; i++) {
+        conn = &httpConns[i];
+
+        if (!httpConnsInit || (conn->pipefd != fd))
+            continue;
+
+        close(fd);
+        conn->pipefd = -1;
+
+        if (waitpid(conn->pump, &status, 0) < 0)
+            status = 1;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) ||
+                !conn->keepalive) {
+            httpConnClose(conn);
+        }
+
+        return 0;
+    }
+
+    return close(fd);
+}
+
+/* extraHeaders is either NULL or a string with extra headers separated
+ * by '\r\n', ending with '\r\n'.
+ */
+int httpGetFileDesc(char * hostname, int port, char * remotename,
+                    char *extraHeaders) {
+    struct httpConn *conn;
+    char *buf, *headers = NULL;
+    char *status;
+    char *hstr;
+    int bufsize;
+    int reused;
+    int rc;
+
+    if (port < 0)
+        port = 80;
+
+    if ((conn = httpConnGet(hostname, port)) == NULL) {
+        logMessage(ERROR, "ROCKS:httpGetFileDesc:no free connections");
+        return FTPERR_TOO_MANY_CONNECTIONS;
+    }
+
+    if (extraHeaders)
+        hstr = extraHeaders;
+    else
+        hstr = "";
+
+    bufsize = strlen(remotename) + strlen(hostname) + strlen(hstr) + 64;
+
+    if ((buf = malloc(bufsize)) == NULL) {
+        logMessage(ERROR, "ROCKS:httpGetFileDesc:malloc failed");
+        return FTPERR_FAILED_CONNECT;
+    }
+
+    sprintf(buf, "GET %s HTTP/1.1\r\nHost: %s\r\n"
+        "Connection: keep-alive\r\n%s\r\n", remotename, hostname, hstr);
+
+    /*
+     * the server may have closed an idle connection on us. if a
+     * reused connection fails before we see any headers, try once more
+     * on a new one.
+     */
+    do {
+        reused = (conn->sock >= 0);
+
+        if (!reused && ((rc = httpConnOpen(conn)) != 0)) {
+            free(buf);
+            return rc;
+        }
+
+        conn->keepalive = 1;
+
+        if (write(conn->sock, buf, strlen(buf)) != strlen(buf))
+            rc = FTPERR_SERVER_IO_ERROR;
+        else
+            rc = httpReadHeaders(conn, &headers);
+
+        if (rc < 0)
+            httpConnClose(conn);
+    } while ((rc < 0) && reused);
+
+    free(buf);
+
+    if (rc < 0)
+        return rc;
+
+    if (reused)
+        logMessage(DEBUGLVL, "ROCKS:httpGetFileDesc:reused connection to %s",
+            hostname);
+
+    status = find_status_code (headers);
+
+    if (status == NULL) {
+        free(headers);
+        httpConnClose(conn);
+        return FTPERR_SERVER_IO_ERROR;
+    } else if (!strncmp(status, "200", 3)) {
+        rc = httpStartBody(conn, headers);
+        free(headers);
+        if (rc < 0)
+            httpConnClose(conn);
+        return rc;
+    }
+
+    /*
+     * for everything else, don't bother reading the body. just drop
+     * the connection.
+     */
+    httpConnClose(conn);
+
+    if (!strncmp(status, "301", 3) || !strncmp(status, "302", 3) ||
+               !strncmp(status, "303", 3) || !strncmp(status, "307", 3)) {
+        struct iurlinfo ui;
+        char *redir_loc = find_header (headers, "Location");
+        int retval;
+
+        free(headers);
+
+        if (redir_loc == NULL) {
+            logMessage(WARNING, "got a redirect response, but Location header is NULL");
+            return FTPERR_FILE_NOT_FOUND;
+        }
+
+        logMessage(INFO, "redirecting to %s", redir_loc);
+        convertURLToUI(redir_loc, &ui);
+        retval = httpGetFileDesc (ui.address, -1, ui.prefix, extraHeaders);
+        free(redir_loc);
+        return retval;
+    }
+
+    free(headers);
+
+    if (!strncmp(status, "403", 3)) {
+        return FTPERR_PERMISSION_DENIED;
+    } else if (!strncmp(status, "404", 3)) {
+        return FTPERR_FILE_NOT_FOUND;
+    } else if (!strncmp(status, "503", 3)) {
+         /* A server nack - busy */
+         logMessage(WARNING, "ROCKS:server busy");
+         watchdog_reset();
+         return FTPERR_FAILED_DATA_CONNECT;
+    } else {
+        logMessage(ERROR, "bad HTTP response code: %s", status);
+        return FTPERR_BAD_SERVER_RESPONSE;
+    }
+}
+#else
 /* extraHeaders is either NULL or a string with extra headers separated
  * by '\r\n', ending with '\r\n'.
  */
@@ -811,6 +1328,8 @@ int httpGetFileDesc(char * hostname, int port, char * remotename,
     }
 }
 
+#endif /* ROCKS */
+
 #ifdef ROCKS
 
 #include <openssl/ssl.h>
@@ -947,51 +1466,83 @@ show_cert (X509 *cert)
 }
 
 
-/* 
- * We have torn up this file. This function uses the OpenSSL
- * library to initiate an HTTPS connection. Used to retrieve
- * a Rocks kickstart file.
+/*
+ * TLS sessions, one per server. reconnecting to a server we already did a
+ * full handshake with (e.g., the kickstart retry loop) resumes the old
+ * session and skips the expensive key exchange.
  */
+#define SSL_MAX_SESSIONS	4
 
-BIO *
-httpsGetFileDesc(char * hostname, int port, char * remotename,
-	char *extraHeaders, int *errorcode, char **returnedHeaders) 
+struct sslSessionCache {
+	char		host[256];
+	SSL_SESSION	*session;
+};
+
+static struct sslSessionCache sslSessions[SSL_MAX_SESSIONS];
+static int sslSessionNext = 0;
+static SSL_CTX *ssl_context = NULL;
+
+static SSL_SESSION *
+get_ssl_session(char *hostname)
 {
-	char *buf;
-	char headers[4096];
-	char *nextChar = headers;
-	char *hstr;
-	int sock;
-	int rc;
-	int checkedCode;
-	int headerslen;
+	int i;
 
-	int bufsize;
-	int byteswritten;
-	struct loaderData_s * loaderData;
-	SSL_CTX *ssl_context;
-	SSL *ssl;
-	BIO *sbio = 0;
-	X509 *server_cert;
+	for (i=0; i<SSL_MAX_SESSIONS; i++) {
+		if (sslSessions[i].session &&
+				!strcmp(sslSessions[i].host, hostname))
+			return sslSessions[i].session;
+	}
+	return NULL;
+}
 
-	*errorcode = 0;
+static void
+save_ssl_session(char *hostname, SSL *ssl)
+{
+	struct sslSessionCache *cache = NULL;
+	int i;
+
+	for (i=0; i<SSL_MAX_SESSIONS; i++) {
+		if (sslSessions[i].session &&
+				!strcmp(sslSessions[i].host, hostname)) {
+			cache = &sslSessions[i];
+			break;
+		}
+	}
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	if (sock < 0) {
-		logMessage(ERROR,
-			"ROCKS:httpsGetFileDesc:Could not get a socket");
-		*errorcode = FTPERR_FAILED_CONNECT;
-		return NULL;
+	if (!cache) {
+		cache = &sslSessions[sslSessionNext];
+		sslSessionNext = (sslSessionNext + 1) % SSL_MAX_SESSIONS;
 	}
 
+	if (cache->session)
+		SSL_SESSION_free(cache->session);
+
+	snprintf(cache->host, sizeof(cache->host), "%s", hostname);
+	cache->session = SSL_get1_session(ssl);
+}
+
+/*
+ * the SSL context is the same for every connection, so only build it
+ * (and read the certificates) once.
+ */
+static SSL_CTX *
+get_ssl_context(int *errorcode)
+{
+	struct loaderData_s * loaderData;
+	SSL_CTX *ctx;
+	int rc;
+
+	if (ssl_context)
+		return ssl_context;
+
 	/* OpenSSL_add_all_algorithms(); */
 	SSLeay_add_ssl_algorithms();
 
-	ssl_context = SSL_CTX_new(SSLv23_client_method());
-	if (!ssl_context) {
+	ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!ctx) {
 		logMessage(ERROR, "Could not create SSLv2,3 context");
 		*errorcode = FTPERR_FAILED_CONNECT;
-		goto error;
+		return NULL;
 	}
 
 	/* Pull in the Global Loader Data structure. */
@@ -999,7 +1550,7 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 
 	/* I have a Certificate */
 	if (loaderData->cert_filename) {
-		rc = SSL_CTX_use_certificate_file(ssl_context, 
+		rc = SSL_CTX_use_certificate_file(ctx, 
 			loaderData->cert_filename,
 			SSL_FILETYPE_PEM);
 		if (!rc) {
@@ -1008,7 +1559,7 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 			goto error;
 		}
 
-		rc = SSL_CTX_use_PrivateKey_file(ssl_context, 
+		rc = SSL_CTX_use_PrivateKey_file(ctx, 
 			loaderData->priv_filename,
 			SSL_FILETYPE_PEM);
 		if (!rc) {
@@ -1021,7 +1572,7 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 		/* Only connect to servers that have certs signed by
 		 * our trusted CA. */
 		if (loaderData->authParent) {
-			rc = SSL_CTX_load_verify_locations(ssl_context,
+			rc = SSL_CTX_load_verify_locations(ctx,
 				loaderData->ca_filename, 0);
 			if (!rc) {
 				logMessage(ERROR,
@@ -1029,12 +1580,61 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 				*errorcode = FTPERR_CLIENT_SECURITY;
 				goto error;
 			}
-			SSL_CTX_set_verify(ssl_context, SSL_VERIFY_PEER, 0);
-			SSL_CTX_set_verify_depth(ssl_context, 1);
+			SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+			SSL_CTX_set_verify_depth(ctx, 1);
 		}
 	}
 
-	sbio = BIO_new_ssl_connect(ssl_context);
+	ssl_context = ctx;
+	return ssl_context;
+
+error:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+
+/* 
+ * We have torn up this file. This function uses the OpenSSL
+ * library to initiate an HTTPS connection. Used to retrieve
+ * a Rocks kickstart file.
+ *
+ * The returned BIO is a buffering BIO on top of the SSL BIO, so the
+ * headers are read a line at a time rather than a byte at a time.
+ */
+
+BIO *
+httpsGetFileDesc(char * hostname, int port, char * remotename,
+	char *extraHeaders, int *errorcode, char **returnedHeaders) 
+{
+	char *buf;
+	char headers[4096];
+	char *nextChar = headers;
+	char *hstr;
+	int rc;
+	int checkedCode;
+	int headerslen;
+
+	int bufsize;
+	int byteswritten;
+	struct loaderData_s * loaderData;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	SSL_SESSION *session;
+	BIO *sbio = 0;
+	BIO *bbio = 0;
+	X509 *server_cert;
+
+	*errorcode = 0;
+
+	/* Pull in the Global Loader Data structure. */
+	loaderData = rocks_global_loaderData;
+
+	if ((ctx = get_ssl_context(errorcode)) == NULL) {
+		goto error;
+	}
+
+	sbio = BIO_new_ssl_connect(ctx);
 	if (!sbio) {
 		logMessage(ERROR, "Could not create SSL object");
 		*errorcode = FTPERR_CLIENT_SECURITY;
@@ -1050,6 +1650,10 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 
 	SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
 
+	if ((session = get_ssl_session(hostname)) != NULL) {
+		SSL_set_session(ssl, session);
+	}
+
 	BIO_set_conn_hostname(sbio, hostname);
 	BIO_set_conn_port(sbio, "https");
 
@@ -1076,6 +1680,14 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 		goto error;
 	}
 
+	if (SSL_session_reused(ssl)) {
+		logMessage(INFO,
+			"ROCKS:httpsGetFileDesc:resumed session with %s",
+			hostname);
+	} else {
+		save_ssl_session(hostname, ssl);
+	}
+
 	server_cert = SSL_get_peer_certificate(ssl);
 
 	/* Show credentials if appropriate. */
@@ -1091,6 +1703,17 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 		}
 	}
 
+	if (server_cert)
+		X509_free(server_cert);
+
+	bbio = BIO_new(BIO_f_buffer());
+	if (!bbio) {
+		logMessage(ERROR, "Could not create buffer BIO");
+		*errorcode = FTPERR_FAILED_CONNECT;
+		goto error;
+	}
+	sbio = BIO_push(bbio, sbio);
+
 	if (extraHeaders)
 		hstr = extraHeaders;
 	else
@@ -1109,6 +1732,7 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 		hostname, hstr);
 
 	byteswritten = BIO_puts(sbio, buf);
+	(void)BIO_flush(sbio);
 
 	logMessage(INFO,
 		"ROCKS:httpsGetFileDesc:byteswritten(%d)", byteswritten);
@@ -1117,7 +1741,7 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 
 	free(buf);
 
-	/* This is fun; read the response a character at a time until we:
+	/* read the response a line at a time until we:
 	1) Get our first \r\n; which lets us check the return code
 	2) Get a \r\n\r\n, which means we're done */
 
@@ -1126,19 +1750,19 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 	headerslen = 0;
 	while (!strstr(headers, "\r\n\r\n")) {
 
-		if (BIO_read(sbio, nextChar, 1) != 1) {
-			*errorcode = FTPERR_SERVER_SECURITY;
+		if (sizeof(headers) - headerslen <= 1) {
 			goto error;
 		}
 
-		nextChar++;
-		*nextChar = '\0';
-		++headerslen;
-
-		if (nextChar - headers == sizeof(headers)) {
+		rc = BIO_gets(sbio, nextChar, sizeof(headers) - headerslen);
+		if (rc <= 0) {
+			*errorcode = FTPERR_SERVER_SECURITY;
 			goto error;
 		}
 
+		nextChar += rc;
+		headerslen += rc;
+
 		if (!checkedCode && strstr(headers, "\r\n")) {
 			char * start, * end;
 
@@ -1190,7 +1814,6 @@ httpsGetFileDesc(char * hostname, int port, char * remotename,
 	return sbio;
 
 error:
-	close(sock);
 	if (sbio)
 		BIO_free_all(sbio);
 	if (!*errorcode)
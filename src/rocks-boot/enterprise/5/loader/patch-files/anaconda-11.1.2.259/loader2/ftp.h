@@ -38,6 +38,8 @@ int httpGetFileDesc(char * hostname, int port, char * remotename, char *extraHea
 #define FTPERR_CLIENT_SECURITY  -92
 #define FTPERR_SERVER_SECURITY  -93
 
+int httpFinishFileDesc(int fd);
+
 BIO* httpsGetFileDesc(char * hostname, int port, char * remotename,
 	char *extraHeaders, int *errorcode, char **returnedHeaders);
 #endif /* ROCKS */
@@ -281,7 +281,14 @@ int urlinstStartTransfer(struct iurlinfo * ui, char * filename,
 int urlinstFinishTransfer(struct iurlinfo * ui, int fd) {
     if (ui->protocol == URL_METHOD_FTP)
         close(ui->ftpPort);
+#ifdef ROCKS
+    if (ui->protocol == URL_METHOD_HTTP)
+        httpFinishFileDesc(fd);
+    else
+        close(fd);
+#else
     close(fd);
+#endif /* ROCKS */
 
     if (!FL_CMDLINE(flags))
         newtPopWindow();
@@ -583,6 +590,10 @@ struct loaderData_s * rocks_global_loaderData;
 #include "../isys/imount.h"
 
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/wait.h>
 
 /*
  * From make-bootable-disks.c by Bruno.
@@ -672,17 +683,18 @@ ignoreCert()
  * From make-bootable-disks.c by Bruno.
  * Checks if a partition is a rocks root partition.  If so, the partition is
  * mounted to a well-known dir. Returns 0 on success, 1 on failure.
+ *
+ * 'fstype' comes from probeDevices(), so only one mount is tried.
  */
 
 static int
-mountRocksDevice (char *device, int major, int minor, char *marker)
+mountRocksDevice (char *device, int major, int minor, char *fstype,
+	char *marker)
 {
 	mode_t	mode;
 	char	devicepath[128];
 	char	markerpath[128];
-	char 	*fstype[10];
 	char	*mountpoint = "/mnt/rocks-disk";
-	int 	rc, i=0;
 
 	if (ignoreCert())
 		return 1;
@@ -699,32 +711,19 @@ mountRocksDevice (char *device, int major, int minor, char *marker)
 
 	mkdirChain(mountpoint);
 
-	/* Mount the partition. I dont like this exhaustive search. */
-
-	fstype[i++] = "ext3";
-	fstype[i++] = "ext2";
-	fstype[i++] = "vfat";
-	fstype[i++] = "xfs";
-	fstype[i++] = 0;
-
-	for (i=0; fstype[i]; i++) {
-		rc = doPwMount(devicepath, mountpoint, fstype[i], 0, NULL);
-		if (!rc)
-			break;
+	if (doPwMount(devicepath, mountpoint, fstype, 0, NULL)) {
+		unlink(devicepath);
+		return 1;
 	}
-	if (!fstype[i])
-		goto error;
-
 
 	snprintf(markerpath, 128, "%s/%s", mountpoint, marker);
 	if (!access(markerpath, F_OK)) {
 		logMessage(INFO, "mountRocksDevice: found rocks device "
-			"at %s, mounted on %s", 
-			devicepath, mountpoint);
+			"at %s (%s), mounted on %s", 
+			devicepath, fstype, mountpoint);
 		return 0;
 	}
 
-error:
 	unlink(devicepath);
 	umount(mountpoint);
 	return 1;
@@ -732,17 +731,17 @@ error:
 
 
 static int
-mountRocksDisk (char *device, int major, int minor)
+mountRocksDisk (char *device, int major, int minor, char *fstype)
 {
-	return mountRocksDevice(device, major, minor, 
+	return mountRocksDevice(device, major, minor, fstype,
 		"/.rocks-release");
 }
 
 
 static int 
-mountRocksUSB (char *device, int major, int minor)
+mountRocksUSB (char *device, int major, int minor, char *fstype)
 {
-	return mountRocksDevice(device, major, minor, 
+	return mountRocksDevice(device, major, minor, fstype,
 		"/rocks-usbkey");
 }
 
@@ -805,22 +804,213 @@ getPartitions()
 
 
 /*
- * Finds and mounts an existing Rocks Partition, if one exists.
- * Returns 0 on success, 1 otherwise. Mounts to a well-known dir.
+ * What we know about a device in /proc/partitions. The filesystem type
+ * is read straight from the superblock by probeDevices(), so we only
+ * mount devices that can hold a Rocks marker, and only with the right
+ * filesystem type.
+ */
+#define	PROBE_NONE	0
+#define	PROBE_EXT2	1
+#define	PROBE_EXT3	2
+#define	PROBE_VFAT	3
+#define	PROBE_XFS	4
+#define	PROBE_ROOT	0x80	/* ext2/3 labelled or last mounted on '/' */
+
+#define	PROBE_SECS	10
+
+static char *probeFsTypes[] = { NULL, "ext2", "ext3", "vfat", "xfs" };
+
+struct rocksDevice {
+	char	dev[32];
+	int	major;
+	int	minor;
+	int	disk;		/* a whole disk, like hda */
+	int	probe;		/* PROBE_* */
+};
+
+/*
+ * Reads the superblocks on one device. Returns one of the PROBE_* values.
  */
 static int
-getRocksPartition()
+probeSuperblock(char *devicepath)
 {
-	int	rc=1;
+	unsigned char	buf[2048];
+	unsigned int	compat;
+	int		fd;
+	int		rc = PROBE_NONE;
+
+	if ((fd = open(devicepath, O_RDONLY)) < 0)
+		return PROBE_NONE;
+
+	memset(buf, 0, sizeof(buf));
+	if (read(fd, buf, sizeof(buf)) < 1024) {
+		close(fd);
+		return PROBE_NONE;
+	}
+	close(fd);
+
+	if (!memcmp(buf, "XFSB", 4))
+		return PROBE_XFS;
+
+	/*
+	 * ext2/3: the superblock starts at byte 1024 and the magic
+	 * 0xef53 is at byte 56 of it
+	 */
+	if (buf[1024 + 56] == 0x53 && buf[1024 + 57] == 0xef) {
+		compat = buf[1024 + 92] | (buf[1024 + 93] << 8);
+
+		/* EXT3_FEATURE_COMPAT_HAS_JOURNAL */
+		rc = (compat & 0x4) ? PROBE_EXT3 : PROBE_EXT2;
+
+		/* the volume label and the last mount point */
+		if (!strncmp((char *)&buf[1024 + 120], "/", 16) ||
+			!strncmp((char *)&buf[1024 + 136], "/", 64))
+			rc |= PROBE_ROOT;
+
+		return rc;
+	}
+
+	if (buf[510] == 0x55 && buf[511] == 0xaa &&
+		(!memcmp(&buf[54], "FAT", 3) || !memcmp(&buf[82], "FAT32", 5)))
+		return PROBE_VFAT;
+
+	return PROBE_NONE;
+}
+
+/*
+ * Reads the superblocks on all the devices at once, one child per
+ * device. A device that doesn't answer in PROBE_SECS seconds is
+ * skipped.
+ */
+static void
+probeDevices(struct rocksDevice *devs, int count)
+{
+	mode_t	mode;
+	char	devicepath[128];
+	pid_t	*pids;
+	int	*fds;
+	int	pipefd[2];
+	time_t	deadline;
+	struct timeval	timeout;
+	fd_set	readfds;
+	unsigned char	c;
+	int	i, n;
+
+	pids = (pid_t *) malloc(count * sizeof(pid_t));
+	fds = (int *) malloc(count * sizeof(int));
+	if (!pids || !fds) {
+		free(pids);
+		free(fds);
+		return;
+	}
+
+	mode = S_IFBLK | S_IRUSR | S_IWUSR;
+
+	for (i = 0; i < count; i++) {
+		pids[i] = -1;
+		fds[i] = -1;
+		devs[i].probe = PROBE_NONE;
+
+		sprintf(devicepath, "/tmp/rocks-probe-%s", devs[i].dev);
+		unlink(devicepath);
+
+		if (mknod(devicepath, mode,
+			makedev(devs[i].major, devs[i].minor)) < 0) {
+			logMessage(ERROR, "probeDevices:mknod failed: %s",
+				strerror(errno));
+			continue;
+		}
+
+		if (pipe(pipefd) < 0) {
+			logMessage(ERROR, "probeDevices:pipe failed: %s",
+				strerror(errno));
+			unlink(devicepath);
+			continue;
+		}
+
+		if (!(pids[i] = fork())) {
+			close(pipefd[0]);
+			c = probeSuperblock(devicepath);
+			write(pipefd[1], &c, 1);
+			_exit(0);
+		}
+
+		close(pipefd[1]);
+
+		if (pids[i] < 0) {
+			logMessage(ERROR, "probeDevices:fork failed: %s",
+				strerror(errno));
+			close(pipefd[0]);
+			unlink(devicepath);
+			continue;
+		}
+
+		fds[i] = pipefd[0];
+	}
+
+	deadline = time(NULL) + PROBE_SECS;
+
+	for (i = 0; i < count; i++) {
+		if (fds[i] < 0)
+			continue;
+
+		do {
+			FD_ZERO(&readfds);
+			FD_SET(fds[i], &readfds);
+
+			timeout.tv_sec = deadline - time(NULL);
+			if (timeout.tv_sec < 0)
+				timeout.tv_sec = 0;
+			timeout.tv_usec = 0;
+
+			n = select(fds[i] + 1, &readfds, NULL, NULL, &timeout);
+		} while (n < 0 && errno == EINTR);
+
+		if (n > 0 && read(fds[i], &c, 1) == 1) {
+			devs[i].probe = c;
+		} else {
+			logMessage(ERROR, "probeDevices:no answer from %s",
+				devs[i].dev);
+			kill(pids[i], SIGKILL);
+		}
+
+		close(fds[i]);
+		waitpid(pids[i], NULL, 0);
+
+		sprintf(devicepath, "/tmp/rocks-probe-%s", devs[i].dev);
+		unlink(devicepath);
+
+		if (devs[i].probe != PROBE_NONE)
+			logMessage(INFO, "ROCKS:%s holds %s%s", devs[i].dev,
+				probeFsTypes[devs[i].probe & ~PROBE_ROOT],
+				(devs[i].probe & PROBE_ROOT) ? " (root)" : "");
+	}
+
+	free(pids);
+	free(fds);
+}
+
+/*
+ * Parses /proc/partitions. Returns the number of devices, or -1 on
+ * error. Caller must free *devs.
+ */
+static int
+readDevices(struct rocksDevice **devs)
+{
+	struct rocksDevice	*d;
+	int	count = 0, size = 0;
 	int	major, minor, blocks;
 	char	dev[32];
-	char	*diskdevice;
+	char	diskdevice[32];
 	char	*line;
 	char	*contents;
 
-	contents = getPartitions();
+	*devs = NULL;
 
-	diskdevice = NULL;
+	if (!(contents = getPartitions()))
+		return -1;
+
+	diskdevice[0] = '\0';
 
 	/*
 	 * eat the first two lines
@@ -840,79 +1030,179 @@ getRocksPartition()
 		if (!strlen(line))
 			continue;
 
-		sscanf(line, "%d %d %d %32s", &major, &minor, &blocks, dev);
+		if (sscanf(line, "%d %d %d %31s", &major, &minor, &blocks,
+			dev) != 4)
+			continue;
 
-		if (!diskdevice || 
-			strncmp(dev, diskdevice, strlen(diskdevice))) {
-			/* A disk device name, like hda */
-			diskdevice = dev;
-			logMessage(INFO, "ROCKS:found disk device %s", dev);
-			rc = bootable(diskdevice, major, minor);
-			if (!rc) {
-				/* Restart the parse */
-				free(contents);
-				return getRocksPartition();
+		if (count == size) {
+			size += 32;
+			d = (struct rocksDevice *) realloc(*devs,
+				size * sizeof(struct rocksDevice));
+			if (!d) {
+				logMessage(ERROR, "readDevices:realloc error");
+				break;
 			}
+			*devs = d;
 		}
 
-		else if (!strncmp(dev, diskdevice, strlen(diskdevice))) {
+		d = &(*devs)[count++];
+		strcpy(d->dev, dev);
+		d->major = major;
+		d->minor = minor;
+		d->probe = PROBE_NONE;
+
+		if (!diskdevice[0] || 
+			strncmp(dev, diskdevice, strlen(diskdevice))) {
+			/* A disk device name, like hda */
+			d->disk = 1;
+			strcpy(diskdevice, dev);
+		} else {
 			/* A disk partition name, like hda1 */
-			logMessage(INFO, "ROCKS:found partition %s", dev);
-			rc = mountRocksDisk(dev, major, minor);
-			if (!rc)
-				break;		/* Success */
+			d->disk = 0;
 		}
 	}
+
 	free(contents);
-	return rc;
+	return count;
 }
 
+/*
+ * The order to try the partitions in, or -1 to skip one. The Rocks root
+ * partition is ext2/3 and is usually labelled '/'.
+ */
+static int
+diskRank(struct rocksDevice *d)
+{
+	if (d->disk)
+		return -1;
+
+	switch (d->probe & ~PROBE_ROOT) {
+	case PROBE_EXT2:
+	case PROBE_EXT3:
+		return (d->probe & PROBE_ROOT) ? 0 : 1;
+	case PROBE_VFAT:
+	case PROBE_XFS:
+		return 2;
+	}
+
+	return -1;
+}
 
 /*
- * Like getRocksPartition() but for USB disks.
+ * USB keys are usually vfat, and may not have a partition table.
+ */
+static int
+usbRank(struct rocksDevice *d)
+{
+	switch (d->probe & ~PROBE_ROOT) {
+	case PROBE_VFAT:
+		return 0;
+	case PROBE_EXT2:
+	case PROBE_EXT3:
+		return 1;
+	case PROBE_XFS:
+		return 2;
+	}
+
+	return -1;
+}
+
+/*
+ * Mounts the devices in rank order until one has the marker. Returns 0
+ * on success, 1 otherwise.
+ */
+static int
+mountRocksCandidates(struct rocksDevice *devs, int count,
+	int (*rank)(struct rocksDevice *),
+	int (*mountfn)(char *, int, int, char *))
+{
+	int	i, r;
+
+	for (r = 0; r < 3; r++) {
+		for (i = 0; i < count; i++) {
+			if (rank(&devs[i]) != r)
+				continue;
+
+			logMessage(INFO, "ROCKS:trying %s", devs[i].dev);
+			if (!mountfn(devs[i].dev, devs[i].major, devs[i].minor,
+				probeFsTypes[devs[i].probe & ~PROBE_ROOT]))
+				return 0;	/* Success */
+		}
+	}
+
+	return 1;
+}
+
+
+/*
+ * Finds and mounts an existing Rocks Partition, if one exists.
  * Returns 0 on success, 1 otherwise. Mounts to a well-known dir.
  */
 static int
-getRocksUSB()
+getRocksPartition()
 {
 	int	rc=1;
-	int	major, minor, blocks;
-	char	dev[32];
-	char	*diskdevice;
-	char	*line;
-	char	*contents;
+	int	i, count;
+	int	changed = 0;
+	struct rocksDevice	*devs;
 
-	contents = getPartitions();
+	if ((count = readDevices(&devs)) < 0)
+		return 1;
 
-	diskdevice = NULL;
+	for (i = 0; i < count; i++) {
+		if (!devs[i].disk)
+			continue;
+
+		logMessage(INFO, "ROCKS:found disk device %s", devs[i].dev);
+		if (!bootable(devs[i].dev, devs[i].major, devs[i].minor))
+			changed = 1;
+	}
 
 	/*
-	 * eat the first two lines
-	 *
-	 * there is a two line header on the output of
-	 * /proc/partitions -- toss those lines, then do
-	 * the work
+	 * the kernel re-read the partition tables of the disks we just
+	 * made bootable. read the list again, once.
 	 */
-	line = contents;
-	line = strstr(line, "\n") + 1;
+	if (changed) {
+		free(devs);
+		if ((count = readDevices(&devs)) < 0)
+			return 1;
+	}
 
-	while (1) {
-		line = strstr(line, "\n");
-		if (!line)
-			break;
-		line += 1;
-		if (!strlen(line))
-			continue;
+	if (!ignoreCert()) {
+		probeDevices(devs, count);
+		rc = mountRocksCandidates(devs, count, diskRank,
+			mountRocksDisk);
+	}
+
+	free(devs);
+	return rc;
+}
 
-		sscanf(line, "%d %d %d %32s", &major, &minor, &blocks, dev);
 
-		logMessage(INFO,
-			"ROCKS:searching for USB keys on device %s", dev);
-		rc = mountRocksUSB(dev, major, minor);
-		if (!rc)
-			break;		/* Success */
-	}
-	free(contents);
+/*
+ * Like getRocksPartition() but for USB disks.
+ * Returns 0 on success, 1 otherwise. Mounts to a well-known dir.
+ */
+static int
+getRocksUSB()
+{
+	int	rc;
+	int	count;
+	struct rocksDevice	*devs;
+
+	if (ignoreCert())
+		return 1;
+
+	if ((count = readDevices(&devs)) < 0)
+		return 1;
+
+	logMessage(INFO, "ROCKS:searching for USB keys on %d devices",
+		count);
+
+	probeDevices(devs, count);
+	rc = mountRocksCandidates(devs, count, usbRank, mountRocksUSB);
+
+	free(devs);
 	return rc;
 }
 
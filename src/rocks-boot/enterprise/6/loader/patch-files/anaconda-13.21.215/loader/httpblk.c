@@ -0,0 +1,605 @@
+/*
+ * httpblk.c - a read-only block device backed by HTTP range requests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Instead of downloading all of install.img into the ramdisk before it
+ * can be mounted, the image is read on demand. The image is split into
+ * fixed size chunks; a chunk is fetched with an HTTP Range request the
+ * first time a block in it is read and is kept in a small LRU cache.
+ * Sequential misses grow a readahead window so that a linear scan turns
+ * into a few large requests instead of many small ones.
+ *
+ * httpblkAttach() exposes the image as a network block device: the nbd
+ * driver is handed one end of a socketpair and a child process answers
+ * its read requests from the chunk cache.
+ *
+ * Built with -DSTANDALONE, this file is a small program that reads an
+ * image through the same code and writes it to stdout, so the block
+ * reader can be checked against any web server with cmp(1).
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <linux/nbd.h>
+#include <curl/curl.h>
+
+#include "httpblk.h"
+
+#ifdef STANDALONE
+#define DEBUGLVL    0
+#define INFO        1
+#define WARNING     2
+#define ERROR       3
+#define logMessage(level, ...) \
+    do { if (level > DEBUGLVL) { fprintf(stderr, __VA_ARGS__); \
+         fprintf(stderr, "\n"); } } while (0)
+#else
+#include "log.h"
+#endif
+
+#define HTTPBLK_RETRIES         3
+#define NBD_MAJOR_NUMBER        43
+
+struct hbChunk {
+    off_t index;                /* chunk number, -1 if the slot is empty */
+    unsigned long used;         /* clock value of the last access */
+    size_t len;                 /* valid bytes; the last chunk is short */
+    char *data;
+};
+
+struct httpblk {
+    char *url;
+    CURL *curl;
+    off_t size;
+    size_t chunkSize;
+    off_t numChunks;
+
+    struct hbChunk *cache;
+    struct hbChunk **slots;     /* the chunks being fetched */
+    int cacheChunks;
+    unsigned long clock;
+
+    off_t nextChunk;            /* the chunk after the last fetch */
+    int window;                 /* current readahead, in chunks */
+    int maxWindow;
+
+    unsigned long hits, misses, requests;
+    unsigned long long fetched;
+};
+
+/* state of one range request */
+struct hbFetch {
+    struct httpblk *hb;
+    struct hbChunk **slots;
+    int count;
+    size_t received;
+};
+
+static size_t hbHeader(void *ptr, size_t size, size_t nmemb, void *data) {
+    struct httpblk *hb = data;
+    long long total;
+    char *slash;
+
+    if (!strncasecmp(ptr, "Content-Range:", 14) && (hb->size < 0)) {
+        if ((slash = memchr(ptr, '/', size * nmemb)) != NULL &&
+                sscanf(slash + 1, "%lld", &total) == 1) {
+            hb->size = total;
+        }
+    }
+
+    return size * nmemb;
+}
+
+static size_t hbWrite(void *ptr, size_t size, size_t nmemb, void *data) {
+    struct hbFetch *fetch = data;
+    size_t chunkSize = fetch->hb->chunkSize;
+    size_t total = size * nmemb;
+    size_t done = 0, n, off;
+    int slot;
+
+    while (done < total) {
+        slot = fetch->received / chunkSize;
+        off = fetch->received % chunkSize;
+
+        /* more data than we asked for. the server ignored the range. */
+        if (slot >= fetch->count)
+            return 0;
+
+        n = chunkSize - off;
+        if (n > total - done)
+            n = total - done;
+
+        memcpy(fetch->slots[slot]->data + off, (char *) ptr + done, n);
+        done += n;
+        fetch->received += n;
+    }
+
+    return total;
+}
+
+static struct hbChunk *hbFind(struct httpblk *hb, off_t index) {
+    int i;
+
+    for (i = 0; i < hb->cacheChunks; i++) {
+        if (hb->cache[i].index == index) {
+            hb->cache[i].used = ++hb->clock;
+            return &hb->cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* the least recently used slot that is not part of the current fetch */
+static struct hbChunk *hbVictim(struct httpblk *hb, unsigned long fetchStart) {
+    struct hbChunk *victim = NULL;
+    int i;
+
+    for (i = 0; i < hb->cacheChunks; i++) {
+        if (hb->cache[i].used > fetchStart)
+            continue;
+        if (!victim || hb->cache[i].used < victim->used)
+            victim = &hb->cache[i];
+    }
+
+    return victim;
+}
+
+/* fetch 'count' chunks starting at chunk 'first' with one range request */
+static int hbFetchChunks(struct httpblk *hb, off_t first, int count) {
+    struct hbChunk **slots = hb->slots;
+    struct hbFetch fetch;
+    unsigned long fetchStart = hb->clock;
+    char range[64];
+    off_t start, end;
+    long code;
+    CURLcode rc;
+    int i, try;
+
+    start = first * hb->chunkSize;
+    end = start + (off_t) count * hb->chunkSize - 1;
+    if ((hb->size >= 0) && (end >= hb->size))
+        end = hb->size - 1;
+
+    for (i = 0; i < count; i++) {
+        slots[i] = hbVictim(hb, fetchStart);
+        slots[i]->index = -1;
+        slots[i]->used = ++hb->clock;
+    }
+
+    snprintf(range, sizeof(range), "%lld-%lld", (long long) start,
+             (long long) end);
+
+    for (try = 0; try < HTTPBLK_RETRIES; try++) {
+        fetch.hb = hb;
+        fetch.slots = slots;
+        fetch.count = count;
+        fetch.received = 0;
+
+        curl_easy_setopt(hb->curl, CURLOPT_RANGE, range);
+        curl_easy_setopt(hb->curl, CURLOPT_WRITEDATA, &fetch);
+
+        hb->requests++;
+        rc = curl_easy_perform(hb->curl);
+        curl_easy_getinfo(hb->curl, CURLINFO_RESPONSE_CODE, &code);
+
+        /* the size is only known after the first response */
+        if ((hb->size >= 0) && (end >= hb->size))
+            end = hb->size - 1;
+
+        if ((rc == CURLE_OK) && (code == 206) &&
+                (fetch.received == end - start + 1))
+            break;
+
+        logMessage(WARNING, "httpblk: range %s of %s failed: %s (%ld)",
+                   range, hb->url, curl_easy_strerror(rc), code);
+    }
+
+    hb->fetched += fetch.received;
+
+    if (try == HTTPBLK_RETRIES)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (fetch.received <= (size_t) i * hb->chunkSize)
+            break;
+
+        slots[i]->index = first + i;
+        slots[i]->len = fetch.received - (size_t) i * hb->chunkSize;
+        if (slots[i]->len > hb->chunkSize)
+            slots[i]->len = hb->chunkSize;
+    }
+
+    return 0;
+}
+
+/*
+ * get chunk 'index' into the cache. a miss right after the previous fetch
+ * means the image is being read sequentially, so the readahead window is
+ * doubled; any other miss resets it.
+ */
+static struct hbChunk *hbGetChunk(struct httpblk *hb, off_t index) {
+    struct hbChunk *chunk;
+    int count;
+
+    if ((chunk = hbFind(hb, index)) != NULL) {
+        hb->hits++;
+        return chunk;
+    }
+
+    hb->misses++;
+
+    if (index == hb->nextChunk) {
+        hb->window *= 2;
+        if (hb->window > hb->maxWindow)
+            hb->window = hb->maxWindow;
+    } else {
+        hb->window = 1;
+    }
+
+    for (count = 1; count < hb->window; count++) {
+        if ((index + count >= hb->numChunks) || hbFind(hb, index + count))
+            break;
+    }
+
+    if (hbFetchChunks(hb, index, count))
+        return NULL;
+
+    hb->nextChunk = index + count;
+
+    return hbFind(hb, index);
+}
+
+struct httpblk *httpblkOpen(char *url, size_t chunkSize, int cacheChunks,
+                            int readahead) {
+    struct httpblk *hb;
+    int i;
+
+    if ((hb = calloc(1, sizeof(*hb))) == NULL)
+        return NULL;
+
+    /* a fetch never takes more than half the cache */
+    if (readahead > cacheChunks / 2)
+        readahead = cacheChunks / 2;
+    if (readahead < 1)
+        readahead = 1;
+
+    hb->url = strdup(url);
+    hb->size = -1;
+    hb->chunkSize = chunkSize;
+    hb->cacheChunks = cacheChunks;
+    hb->maxWindow = readahead;
+    hb->window = 1;
+    hb->nextChunk = -1;
+
+    if ((hb->cache = calloc(cacheChunks, sizeof(*hb->cache))) == NULL ||
+            (hb->slots = calloc(cacheChunks, sizeof(*hb->slots))) == NULL)
+        goto error;
+
+    for (i = 0; i < cacheChunks; i++) {
+        hb->cache[i].index = -1;
+        if ((hb->cache[i].data = malloc(chunkSize)) == NULL)
+            goto error;
+    }
+
+    if ((hb->curl = curl_easy_init()) == NULL)
+        goto error;
+
+    curl_easy_setopt(hb->curl, CURLOPT_URL, hb->url);
+    curl_easy_setopt(hb->curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(hb->curl, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(hb->curl, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(hb->curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(hb->curl, CURLOPT_CONNECTTIMEOUT, 10);
+    curl_easy_setopt(hb->curl, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt(hb->curl, CURLOPT_LOW_SPEED_TIME, 60);
+    curl_easy_setopt(hb->curl, CURLOPT_HEADERFUNCTION, hbHeader);
+    curl_easy_setopt(hb->curl, CURLOPT_HEADERDATA, hb);
+    curl_easy_setopt(hb->curl, CURLOPT_WRITEFUNCTION, hbWrite);
+
+    /* the first chunk also tells us how big the image is */
+    if (hbFetchChunks(hb, 0, 1) || (hb->size <= 0)) {
+        logMessage(ERROR, "httpblk: %s does not support range requests",
+                   url);
+        goto error;
+    }
+
+    hb->numChunks = (hb->size + chunkSize - 1) / chunkSize;
+    hb->nextChunk = 1;
+
+    logMessage(INFO, "httpblk: %s is %lld bytes", url, (long long) hb->size);
+
+    return hb;
+
+error:
+    httpblkClose(hb);
+    return NULL;
+}
+
+int httpblkRead(struct httpblk *hb, void *buf, off_t offset, size_t len) {
+    struct hbChunk *chunk;
+    size_t off, n;
+
+    if ((offset < 0) || (offset + (off_t) len > hb->size))
+        return -1;
+
+    while (len > 0) {
+        if ((chunk = hbGetChunk(hb, offset / hb->chunkSize)) == NULL)
+            return -1;
+
+        off = offset % hb->chunkSize;
+        if (off >= chunk->len)
+            return -1;
+
+        n = chunk->len - off;
+        if (n > len)
+            n = len;
+
+        memcpy(buf, chunk->data + off, n);
+
+        buf = (char *) buf + n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+off_t httpblkSize(struct httpblk *hb) {
+    return hb->size;
+}
+
+void httpblkStats(struct httpblk *hb) {
+    logMessage(INFO, "httpblk: %s: %lu hits, %lu misses, %lu requests, "
+               "%llu of %lld bytes fetched", hb->url, hb->hits, hb->misses,
+               hb->requests, hb->fetched, (long long) hb->size);
+}
+
+void httpblkClose(struct httpblk *hb) {
+    int i;
+
+    if (!hb)
+        return;
+
+    if (hb->curl)
+        curl_easy_cleanup(hb->curl);
+
+    if (hb->cache) {
+        for (i = 0; i < hb->cacheChunks; i++)
+            free(hb->cache[i].data);
+        free(hb->cache);
+    }
+
+    free(hb->slots);
+    free(hb->url);
+    free(hb);
+}
+
+static int readFully(int fd, void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) <= 0) {
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            return -1;
+        }
+        buf = (char *) buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int writeFully(int fd, void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (char *) buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* answer the nbd driver's requests until it disconnects */
+static void hbServe(struct httpblk *hb, int sock) {
+    struct nbd_request req;
+    struct nbd_reply reply;
+    char *buf = NULL;
+    size_t bufSize = 0;
+    uint64_t from;
+    uint32_t len;
+
+    while (readFully(sock, &req, sizeof(req)) == 0) {
+        if (ntohl(req.magic) != NBD_REQUEST_MAGIC)
+            break;
+
+        from = be64toh(req.from);
+        len = ntohl(req.len);
+
+        reply.magic = htonl(NBD_REPLY_MAGIC);
+        reply.error = 0;
+        memcpy(reply.handle, req.handle, sizeof(reply.handle));
+
+        if (len > bufSize) {
+            free(buf);
+            bufSize = len;
+            if ((buf = malloc(bufSize)) == NULL)
+                break;
+        }
+
+        switch (ntohl(req.type)) {
+        case NBD_CMD_READ:
+            if (httpblkRead(hb, buf, from, len)) {
+                reply.error = htonl(EIO);
+                writeFully(sock, &reply, sizeof(reply));
+            } else if (writeFully(sock, &reply, sizeof(reply)) ||
+                       writeFully(sock, buf, len)) {
+                goto out;
+            }
+            break;
+
+        case NBD_CMD_DISC:
+            goto out;
+
+        default:
+            /* read-only. a write still carries its data. */
+            if (readFully(sock, buf, len))
+                goto out;
+            reply.error = htonl(EPERM);
+            writeFully(sock, &reply, sizeof(reply));
+            break;
+        }
+    }
+
+out:
+    httpblkStats(hb);
+    free(buf);
+}
+
+/*
+ * connect the image to the nbd device 'device' (e.g., /dev/nbd0). returns
+ * the pid of the process serving the device or -1. the caller must not
+ * use 'hb' afterwards.
+ */
+pid_t httpblkAttach(struct httpblk *hb, char *device) {
+    struct stat sb;
+    pid_t server, client = 0;
+    int fd, sv[2];
+
+    if (stat(device, &sb) && (errno == ENOENT))
+        mknod(device, S_IFBLK | 0600, makedev(NBD_MAJOR_NUMBER, 0));
+
+    if ((fd = open(device, O_RDWR)) < 0) {
+        logMessage(ERROR, "httpblk: can't open %s: %m", device);
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        logMessage(ERROR, "httpblk: socketpair failed: %m");
+        close(fd);
+        return -1;
+    }
+
+    ioctl(fd, NBD_CLEAR_SOCK);
+
+    if (ioctl(fd, NBD_SET_BLKSIZE, 4096) ||
+            ioctl(fd, NBD_SET_SIZE, (unsigned long) hb->size) ||
+            ioctl(fd, NBD_SET_SOCK, sv[0])) {
+        logMessage(ERROR, "httpblk: can't set up %s: %m", device);
+        close(sv[0]);
+        close(sv[1]);
+        close(fd);
+        return -1;
+    }
+
+    if ((server = fork()) == 0) {
+        close(sv[0]);
+        close(fd);
+        hbServe(hb, sv[1]);
+        _exit(0);
+    }
+
+    /* NBD_DO_IT doesn't return until the device is disconnected */
+    if ((server > 0) && ((client = fork()) == 0)) {
+        close(sv[1]);
+        ioctl(fd, NBD_DO_IT);
+        ioctl(fd, NBD_CLEAR_QUE);
+        ioctl(fd, NBD_CLEAR_SOCK);
+        _exit(0);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    close(fd);
+
+    if ((server < 0) || (client < 0)) {
+        logMessage(ERROR, "httpblk: fork failed: %m");
+        return -1;
+    }
+
+    httpblkClose(hb);
+
+    return server;
+}
+
+#ifdef STANDALONE
+int main(int argc, char **argv) {
+    struct httpblk *hb;
+    char buf[65536];
+    off_t offset, end;
+    size_t n;
+
+    if ((argc != 2) && (argc != 4)) {
+        fprintf(stderr, "usage: %s <url> [offset length]\n", argv[0]);
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    if ((hb = httpblkOpen(argv[1], HTTPBLK_CHUNK_SIZE, HTTPBLK_CACHE_CHUNKS,
+                          HTTPBLK_READAHEAD)) == NULL)
+        return 1;
+
+    offset = 0;
+    end = httpblkSize(hb);
+
+    if (argc == 4) {
+        offset = strtoll(argv[2], NULL, 0);
+        end = offset + strtoll(argv[3], NULL, 0);
+    }
+
+    /* odd sized reads, so they straddle the chunk boundaries */
+    while (offset < end) {
+        n = sizeof(buf) - 1;
+        if (n > end - offset)
+            n = end - offset;
+
+        if (httpblkRead(hb, buf, offset, n)) {
+            fprintf(stderr, "%s: read of %zu bytes at %lld failed\n",
+                    argv[0], n, (long long) offset);
+            return 1;
+        }
+
+        fwrite(buf, 1, n, stdout);
+        offset += n;
+    }
+
+    fflush(stdout);
+    httpblkStats(hb);
+    httpblkClose(hb);
+
+    return 0;
+}
+#endif
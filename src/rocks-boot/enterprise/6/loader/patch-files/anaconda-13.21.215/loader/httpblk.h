@@ -0,0 +1,38 @@
+/*
+ * httpblk.h - a read-only block device backed by HTTP range requests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_HTTPBLK
+#define H_HTTPBLK
+
+#include <sys/types.h>
+
+#define HTTPBLK_CHUNK_SIZE      (256 * 1024)
+#define HTTPBLK_CACHE_CHUNKS    64
+#define HTTPBLK_READAHEAD       16
+
+struct httpblk;
+
+struct httpblk *httpblkOpen(char *url, size_t chunkSize, int cacheChunks,
+                            int readahead);
+int httpblkRead(struct httpblk *hb, void *buf, off_t offset, size_t len);
+off_t httpblkSize(struct httpblk *hb);
+void httpblkStats(struct httpblk *hb);
+void httpblkClose(struct httpblk *hb);
+
+pid_t httpblkAttach(struct httpblk *hb, char *device);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * kscache.c - keep the last kickstart file on a partition that survives
+ *             a reinstall
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When a whole cluster reinstalls, every node asks kickstart.cgi on the
+ * frontend for a new kickstart file at the same time, and generating them
+ * is the first place the nodes queue up. Most of the time the file a node
+ * gets is the same one it got last time.
+ *
+ * So the loader keeps the last kickstart file in a KSCACHE_DIR directory
+ * on a partition that isn't formatted by a reinstall (the node's kickstart
+ * creates the directory on /state/partition1). Next time, the partitions
+ * in /proc/partitions are searched for that directory, and the request
+ * for the kickstart file carries the ETag and Last-Modified values of the
+ * cached copy. A '304 Not Modified' reply means the cached copy is used
+ * as is. A new file is written back to the cache.
+ *
+ * The cache directory holds:
+ *
+ *     ks.cfg   - the kickstart file
+ *     info     - "<name> <value>" lines: etag, last-modified, and the
+ *                X-Avalanche-* values that came with the file
+ *
+ * The kickstart file has the root password hash and the 411 key in it, so
+ * the directory is 0700 and the files are 0600.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../isys/imount.h"
+
+#include "kscache.h"
+#include "loader.h"
+#include "log.h"
+
+static int copyKickstart(char *from, char *to) {
+    char buf[4096];
+    int in, out, n;
+
+    if ((in = open(from, O_RDONLY)) < 0)
+        return 1;
+
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        close(in);
+        return 1;
+    }
+
+    /* an older copy may have been readable by everyone */
+    if (fchmod(out, 0600)) {
+        close(in);
+        close(out);
+        return 1;
+    }
+
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+
+    close(in);
+    if (close(out) || n < 0) {
+        unlink(to);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void readInfo(struct kscache *kc, char *path) {
+    FILE *f;
+    char line[1024], *value, *end;
+
+    if ((f = fopen(path, "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), f)) {
+        if ((value = strchr(line, ' ')) == NULL)
+            continue;
+        *value++ = '\0';
+
+        end = value + strlen(value);
+        while (end > value && isspace(end[-1]))
+            *--end = '\0';
+
+        if (!*value)
+            continue;
+
+        if (!strcmp(line, "etag"))
+            kc->etag = strdup(value);
+        else if (!strcmp(line, "last-modified"))
+            kc->lastModified = strdup(value);
+        else if (!strcmp(line, "trackers"))
+            kc->trackers = strdup(value);
+        else if (!strcmp(line, "pkgservers"))
+            kc->pkgservers = strdup(value);
+        else if (!strcmp(line, "trackermode"))
+            kc->trackermode = strdup(value);
+    }
+
+    fclose(f);
+}
+
+/* Returns 1 for the names in /proc/partitions that can't hold the cache. */
+static int skipDevice(char *name, unsigned long long blocks) {
+    char *skip[] = { "loop", "ram", "nbd", "sr", "fd", "zram", NULL };
+    int i;
+
+    /* an extended partition */
+    if (blocks < 2)
+        return 1;
+
+    for (i = 0; skip[i]; i++) {
+        if (!strncmp(name, skip[i], strlen(skip[i])))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Look for the cache on the partitions of this node. On success,
+ * kc->device is the partition the cache is on, and if the cache has a
+ * kickstart file it is copied to KSCACHE_COPY. Returns 0 if a cache was
+ * found.
+ */
+int kscacheFind(struct kscache *kc) {
+    FILE *f;
+    char line[256], name[64], device[80], path[256];
+    unsigned long long blocks;
+    struct stat sb;
+    int major, minor;
+
+    memset(kc, 0, sizeof(*kc));
+
+    if ((f = fopen("/proc/partitions", "r")) == NULL) {
+        logMessage(ERROR, "ROCKS:kscacheFind:can't open /proc/partitions");
+        return 1;
+    }
+
+    mkdir(KSCACHE_MNT, 0755);
+
+    while (kc->device == NULL && fgets(line, sizeof(line), f)) {
+        /* the header lines don't parse */
+        if (sscanf(line, "%d %d %llu %63s", &major, &minor, &blocks,
+                   name) != 4)
+            continue;
+
+        if (skipDevice(name, blocks))
+            continue;
+
+        snprintf(device, sizeof(device), "/dev/%s", name);
+
+        if (doPwMount(device, KSCACHE_MNT, "auto", "ro", NULL))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", KSCACHE_MNT, KSCACHE_DIR);
+        if (!stat(path, &sb) && S_ISDIR(sb.st_mode)) {
+            kc->device = strdup(device);
+            logMessage(INFO, "ROCKS:kscacheFind:kickstart cache on %s",
+                       device);
+
+            snprintf(path, sizeof(path), "%s/%s/ks.cfg", KSCACHE_MNT,
+                     KSCACHE_DIR);
+            if (!copyKickstart(path, KSCACHE_COPY)) {
+                snprintf(path, sizeof(path), "%s/%s/info", KSCACHE_MNT,
+                         KSCACHE_DIR);
+                readInfo(kc, path);
+
+                /* no validators, nothing to revalidate */
+                kc->valid = (kc->etag || kc->lastModified);
+            }
+        }
+
+        umount(KSCACHE_MNT);
+    }
+
+    fclose(f);
+
+    return (kc->device == NULL);
+}
+
+/* Returns a copy of extraHeaders with the conditional headers for the
+ * cached kickstart file added.
+ */
+char **kscacheHeaders(struct kscache *kc, char **extraHeaders) {
+    char **hdrs;
+    int i, len = 0;
+
+    while (extraHeaders && extraHeaders[len])
+        len++;
+
+    if ((hdrs = calloc(len + 3, sizeof(char *))) == NULL)
+        return extraHeaders;
+
+    for (i = 0; i < len; i++)
+        hdrs[i] = extraHeaders[i];
+
+    if (kc->valid) {
+        if (kc->etag)
+            checked_asprintf(&hdrs[i++], "If-None-Match: %s", kc->etag);
+        if (kc->lastModified)
+            checked_asprintf(&hdrs[i++], "If-Modified-Since: %s",
+                             kc->lastModified);
+    }
+
+    hdrs[i] = NULL;
+    return hdrs;
+}
+
+/* The frontend said the cached kickstart file is still good. */
+int kscacheRestore(struct kscache *kc, char *dest) {
+    if (!kc->valid || copyKickstart(KSCACHE_COPY, dest)) {
+        logMessage(ERROR, "ROCKS:kscacheRestore:lost the cached kickstart file");
+        return 1;
+    }
+
+    logMessage(INFO, "ROCKS:kscacheRestore:using the cached kickstart file");
+    return 0;
+}
+
+static void writeInfo(FILE *f, char *name, char *value) {
+    if (value)
+        fprintf(f, "%s %s\n", name, value);
+}
+
+/* Put a new kickstart file in the cache. */
+int kscacheSave(struct kscache *kc, char *src, char *etag, char *lastModified,
+                char *trackers, char *pkgservers, char *trackermode) {
+    FILE *f;
+    char path[256], tmp[256];
+    int fd, rc = 1;
+
+    if (kc->device == NULL)
+        return 1;
+
+    if (doPwMount(kc->device, KSCACHE_MNT, "auto", "rw", NULL)) {
+        logMessage(ERROR, "ROCKS:kscacheSave:can't mount %s", kc->device);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", KSCACHE_MNT, KSCACHE_DIR);
+    if (chmod(path, 0700))
+        goto out;
+
+    /* drop the old info first, so a half written cache is never used */
+    snprintf(path, sizeof(path), "%s/%s/info", KSCACHE_MNT, KSCACHE_DIR);
+    unlink(path);
+
+    if (!etag && !lastModified)
+        goto out;
+
+    snprintf(path, sizeof(path), "%s/%s/ks.cfg", KSCACHE_MNT, KSCACHE_DIR);
+    if (copyKickstart(src, path))
+        goto out;
+
+    snprintf(tmp, sizeof(tmp), "%s/%s/info.new", KSCACHE_MNT, KSCACHE_DIR);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto out;
+    if ((f = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+
+    writeInfo(f, "etag", etag);
+    writeInfo(f, "last-modified", lastModified);
+    writeInfo(f, "trackers", trackers);
+    writeInfo(f, "pkgservers", pkgservers);
+    writeInfo(f, "trackermode", trackermode);
+
+    snprintf(path, sizeof(path), "%s/%s/info", KSCACHE_MNT, KSCACHE_DIR);
+    if (fclose(f) || rename(tmp, path))
+        unlink(tmp);
+    else
+        rc = 0;
+
+out:
+    umount(KSCACHE_MNT);
+    if (!rc)
+        logMessage(INFO, "ROCKS:kscacheSave:kickstart file cached on %s",
+                   kc->device);
+    return rc;
+}
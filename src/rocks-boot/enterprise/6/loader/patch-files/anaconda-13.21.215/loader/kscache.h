@@ -0,0 +1,42 @@
+/*
+ * kscache.h - keep the last kickstart file on a partition that survives
+ *             a reinstall
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_KSCACHE
+#define H_KSCACHE
+
+#define KSCACHE_DIR             ".rocks-kickstart"
+#define KSCACHE_MNT             "/mnt/rocks-kscache"
+#define KSCACHE_COPY            "/tmp/ks-cache.cfg"
+
+struct kscache {
+    char *device;               /* NULL if no partition has a cache */
+    int valid;                  /* a kickstart file is in KSCACHE_COPY */
+    char *etag;
+    char *lastModified;
+    char *trackers;
+    char *pkgservers;
+    char *trackermode;
+};
+
+int kscacheFind(struct kscache *kc);
+char **kscacheHeaders(struct kscache *kc, char **extraHeaders);
+int kscacheRestore(struct kscache *kc, char *dest);
+int kscacheSave(struct kscache *kc, char *src, char *etag, char *lastModified,
+                char *trackers, char *pkgservers, char *trackermode);
+
+#endif
@@ -1086,6 +1086,9 @@ static void parseCmdLineFlags(struct loaderData_s * loaderData,
         else if (!strncasecmp(argv[i], "nowatchdog", 10)) {
             loaderData->nowatchdog = 1;
         }
+        else if (!strncasecmp(argv[i], "lazystage2", 10)) {
+            loaderData->lazyStage2 = 1;
+        }
         else if (!strncasecmp(argv[i], "mac=", 4)) {
             loaderData->mac = strdup(argv[i]+4);
         }
@@ -156,6 +156,7 @@ struct loaderData_s {
     short int ekv;
     short int server;
     short int nowatchdog;
+    short int lazyStage2;
     char * mac;
     char * nextServer;
 #endif
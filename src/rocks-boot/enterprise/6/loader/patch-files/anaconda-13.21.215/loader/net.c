@@ -55,6 +55,9 @@
 #include "net.h"
 #include "windows.h"
 #include "ibft.h"
+#ifdef ROCKS
+#include "timeline.h"
+#endif
 
 /* boot flags */
 extern uint64_t flags;
@@ -2293,7 +2296,21 @@ int chooseNetworkInterface(struct loaderData_s * loaderData) {
     }
 
 #ifdef	ROCKS
-    deviceNum = -1;
+{
+    char **probe;
+    int nprobe = 0;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+
+    /*
+     * bring up all the network devices at the same time. the first one
+     * that gets a DHCP answer from a frontend is the one we'll use --
+     * that way a node with several NICs doesn't wait for a full DHCP
+     * timeout on every NIC that isn't connected to the private network.
+     */
+    probe = alloca((deviceNums + 1) * sizeof(*probe));
+
     for (i = 0; devs[i]; i++) {
 	int	err;
 	iface_t	iface;
@@ -2314,23 +2331,46 @@ int chooseNetworkInterface(struct loaderData_s * loaderData) {
 		continue;
         }
 
-	if (wait_for_iface_activation(devs[i]->device, 
-			loaderData->dhcpTimeout) == 0) {
+	probe[nprobe++] = devs[i]->device;
+    }
 
-		logMessage(INFO,
-			"ROCKS:chooseNetworkInterface:using:device (%s)",
-			devs[i]->device);
+    deviceNum = wait_for_any_iface_activation(probe, nprobe,
+	loaderData->dhcpTimeout);
 
-		deviceNum = i;
-		break;
+    /*
+     * tear down all the other devices we brought up
+     */
+    for (i = 0; i < nprobe; i++) {
+	if (i != deviceNum) {
+		removeDhclientConfFile(probe[i]);
+		removeIfcfgFile(probe[i]);
+	}
+    }
+
+    for (i = 0; i < nprobe; i++) {
+	if (i != deviceNum) {
+		wait_for_iface_disconnection(probe[i]);
+		writeDisabledIfcfgFile(probe[i]);
 	}
     }
 
-    if (deviceNum == -1) {
+    if (deviceNum < 0) {
 	logMessage(CRITICAL, "ROCKS:chooseNetworkInterface:couldn't find a network device that is connected to a frontend");
 	/* return LOADER_ERROR; */
-	deviceNum = 0;
+	loaderData->netDev = devices[0];
+	timelineSpan("netup", &start, "devices=%d dev=- result=failed",
+	    nprobe);
+	return LOADER_OK;
     }
+
+    logMessage(INFO, "ROCKS:chooseNetworkInterface:using:device (%s)",
+	probe[deviceNum]);
+    timelineSpan("netup", &start, "devices=%d dev=%s result=ok", nprobe,
+	probe[deviceNum]);
+
+    loaderData->netDev = probe[deviceNum];
+    return LOADER_OK;
+}
 #endif
     loaderData->netDev = devices[deviceNum];
     return LOADER_OK;
@@ -2682,6 +2722,122 @@ int wait_for_iface_activation(char *ifname, int timeout) {
     return 3;
 }
 
+#ifdef	ROCKS
+/*
+ * Wait for NetworkManager to activate any one of the devices in 'ifnames'.
+ * A device whose DHCP lease carries a server-name (sname) wins right away,
+ * that's a Rocks frontend. A frontend doesn't have to set server-name
+ * (urlinstall.c falls back to the gateway), so if the only leases are
+ * without one, the first device that got a lease wins once the others
+ * have had ANY_LEASE_GRACE more seconds to do better. Returns the index of
+ * the winner in 'ifnames', or -1 if no device was activated within
+ * 'timeout' seconds.
+ */
+#define ANY_LEASE_GRACE 5
+
+int wait_for_any_iface_activation(char **ifnames, int count, int timeout) {
+    int loops = 0, i, j;
+    int fallback = -1, fallbackloop = 0;
+    NMClient *client = NULL;
+    GMainLoop *loop;
+    GMainContext *ctx;
+    const GPtrArray *devices;
+
+    if (count == 0) {
+        return -1;
+    }
+
+    if (FL_CMDLINE(flags)) {
+        printf(_("Waiting for NetworkManager to configure %d network "
+                 "devices.\n"), count);
+    } else {
+        winStatus(55, 3, NULL,
+                  _("Waiting for NetworkManager to configure %d network "
+                    "devices.\n"), count, 0);
+    }
+
+    g_type_init();
+
+    client = nm_client_new();
+    if (!client) {
+        logMessage(ERROR, "%s (%d): could not connect to system bus",
+                   __func__, __LINE__);
+        newtPopWindow();
+        return -1;
+    }
+
+    loop = g_main_loop_new(NULL, FALSE);
+    ctx = g_main_loop_get_context(loop);
+
+    while (loops < timeout) {
+        while (g_main_context_pending (ctx)) {
+            g_main_context_iteration (ctx, FALSE);
+        }
+
+        devices = nm_client_get_devices(client);
+        for (i = 0; i < devices->len; i++) {
+            NMDevice *candidate = g_ptr_array_index(devices, i);
+            const char *name = nm_device_get_iface(candidate);
+            NMDHCP4Config *dhcp;
+
+            if (nm_device_get_state(candidate) != NM_DEVICE_STATE_ACTIVATED)
+                continue;
+
+            for (j = 0; j < count; j++) {
+                if (!strcmp(name, ifnames[j]))
+                    break;
+            }
+
+            if (j == count)
+                continue;
+
+            /*
+             * a lease from some other DHCP server (e.g., on the public
+             * network) most likely doesn't carry a server-name. keep it
+             * in case nothing better shows up.
+             */
+            dhcp = nm_device_get_dhcp4_config(candidate);
+            if (!dhcp ||
+                !nm_dhcp4_config_get_one_option(dhcp, "server_name")) {
+                if (fallback < 0) {
+                    logMessage(INFO, "%s (%d): device %s activated "
+                               "without a server-name", __func__, __LINE__,
+                               name);
+                    fallback = j;
+                    fallbackloop = loops;
+                }
+                continue;
+            }
+
+            logMessage(INFO, "%s (%d): device %s activated by a frontend",
+                       __func__, __LINE__, name);
+            res_init();
+            g_main_loop_unref(loop);
+            g_object_unref(client);
+            newtPopWindow();
+            return j;
+        }
+
+        if (fallback >= 0 && loops - fallbackloop >= ANY_LEASE_GRACE)
+            break;
+
+        sleep(1);
+        loops++;
+    }
+
+    if (fallback >= 0) {
+        logMessage(INFO, "%s (%d): no lease with a server-name, using "
+                   "device %s", __func__, __LINE__, ifnames[fallback]);
+        res_init();
+    }
+
+    g_main_loop_unref(loop);
+    g_object_unref(client);
+    newtPopWindow();
+    return fallback;
+}
+#endif
+
 /*
  * Wait for disconnection of iface by NetworkManager, return non-zero on error.
  */
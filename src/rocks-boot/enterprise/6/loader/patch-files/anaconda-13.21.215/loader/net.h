@@ -90,6 +90,9 @@ int disconnectDevice(char *device);
 void splitHostname (char *str, char **host, char **port);
 int wait_for_iface_activation(char * ifname, int timeout);
 int wait_for_iface_disconnection(char *ifname);
+#ifdef ROCKS
+int wait_for_any_iface_activation(char **ifnames, int count, int timeout);
+#endif
 int isURLRemote(char *url);
 int split_ipv6addr_prefix_length(char *str, char **address, char **prefix);
 int enable_NM_BOND_VLAN(void);
@@ -0,0 +1,65 @@
+/*
+ * timeline.c - record how long the steps of an install take
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each step the loader times (bringing up the network, fetching the
+ * kickstart file, fetching and mounting the images) is written to
+ * TIMELINE_FILE as one line:
+ *
+ *     <name> <start usec> <end usec> [<key>=<value> ...]
+ *
+ * tracker-client writes a line to the same file for every file it
+ * fetches, and ships the lines to the frontend once lighttpd is up, where
+ * the lines from all the nodes are merged into one timeline.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "timeline.h"
+
+void timelineSpan(char *name, struct timeval *start, const char *fmt, ...) {
+    struct timeval end;
+    va_list ap;
+    char line[512];
+    int len, fd;
+
+    gettimeofday(&end, NULL);
+
+    len = snprintf(line, sizeof(line), "%s %llu %llu ", name,
+                   (unsigned long long) start->tv_sec * 1000000 +
+                   start->tv_usec,
+                   (unsigned long long) end.tv_sec * 1000000 + end.tv_usec);
+
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+    va_end(ap);
+
+    if (len > (int) sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+
+    /* one write, so lines from tracker-client never get mixed in */
+    if ((fd = open(TIMELINE_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+        return;
+
+    write(fd, line, len);
+    close(fd);
+}
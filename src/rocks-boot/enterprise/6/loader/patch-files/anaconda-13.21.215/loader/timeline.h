@@ -0,0 +1,29 @@
+/*
+ * timeline.h - record how long the steps of an install take
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_TIMELINE
+#define H_TIMELINE
+
+#include <sys/time.h>
+
+/* the same file as TIMELINE_FILE in the tracker's tracker.h */
+#define TIMELINE_FILE           "/tmp/tracker-timeline"
+
+void timelineSpan(char *name, struct timeval *start, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+#endif
@@ -37,11 +37,20 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <curl/curl.h>
 #include "../isys/isys.h"
 #include "../isys/imount.h"
 
 #include <NetworkManager.h>
 #include <nm-client.h>
+
+#include "modules.h"
+#include "httpblk.h"
+#include "kscache.h"
+#include "timeline.h"
 #endif
 
 #include "../isys/iface.h"
@@ -65,6 +74,10 @@ extern uint64_t flags;
 
 char **extraHeaders = NULL;
 
+#ifdef	ROCKS
+static int httpd_ready = 0;	/* see start_httpd() */
+#endif
+
 #ifdef	ROCKS
 static void writeAvalancheInfo(char *, char *);
 static int num_cpus();
@@ -194,12 +207,14 @@ static int loadSingleUrlImage(struct loaderData_s *loaderData, struct iurlinfo *
 #ifdef	ROCKS
 	/*
 	 * try harder to get the images. since we start lighttpd right before
-	 * we call this function, lighttpd may not be ready yet.
+	 * we call this function, lighttpd may not be ready yet. if the
+	 * supervisor said it is ready, a few tries are enough to get past a
+	 * transient error.
 	 */
 	{
 		int	i;
 
-		for (i = 0 ; i < 10 ; ++i) {
+		for (i = 0 ; i < (httpd_ready ? 3 : 10) ; ++i) {
 			status = urlinstTransfer(loaderData, ui, ehdrs, dest);
 
 			if (status == 0) {
@@ -239,28 +254,56 @@ static void copyErrorFn (char *msg) {
    newtWinMessage(_("Error"), _("OK"), _(msg));
 }
 
-static int loadUrlImages(struct loaderData_s *loaderData, struct iurlinfo *ui) {
-    char *oldUrl, *path, *dest, *slash;
-    int rc;
+#ifdef	ROCKS
+/*
+ * mount install.img straight off the web server. the image is attached to
+ * an nbd device whose blocks are fetched with range requests as they are
+ * read, so stage2 can start without the whole image in the ramdisk.
+ */
+static int loadLazyUrlImage(struct iurlinfo *ui, char *mntpoint) {
+	struct httpblk	*hb;
 
-    oldUrl = strdup(ui->url);
-    free(ui->url);
+	if (strncmp(ui->url, "http", 4))
+		return 1;
 
-    /* Figure out the path where updates.img and product.img files are
-     * kept.  Since ui->url points to a stage2 image file, we just need
-     * to trim off the file name and look in the same directory.
-     */
-    if ((slash = strrchr(oldUrl, '/')) == NULL)
-        return 0;
+	mlLoadModule("nbd", NULL);
 
-    if ((path = strndup(oldUrl, slash-oldUrl)) == NULL)
-        path = oldUrl;
+	hb = httpblkOpen(ui->url, HTTPBLK_CHUNK_SIZE, HTTPBLK_CACHE_CHUNKS,
+		HTTPBLK_READAHEAD);
+	if (hb == NULL) {
+		logMessage(WARNING, "ROCKS:loadLazyUrlImage:can't open %s",
+			ui->url);
+		return 1;
+	}
+
+	if (httpblkAttach(hb, "/dev/nbd0") < 0) {
+		logMessage(WARNING, "ROCKS:loadLazyUrlImage:can't attach %s",
+			ui->url);
+		httpblkClose(hb);
+		return 1;
+	}
+
+	if (doPwMount("/dev/nbd0", mntpoint, "squashfs", "ro", NULL)) {
+		logMessage(WARNING, "ROCKS:loadLazyUrlImage:can't mount %s",
+			ui->url);
+		return 1;
+	}
+
+	logMessage(INFO, "ROCKS:loadLazyUrlImage:%s mounted on %s",
+		ui->url, mntpoint);
+	return 0;
+}
+#endif
+
+/* grab the updates.img before install.img so that we minimize our
+ * ramdisk usage */
+static void loadUpdatesImage(struct loaderData_s *loaderData,
+                             struct iurlinfo *ui, char *path) {
+    struct iurlinfo img = *ui;
 
-    /* grab the updates.img before install.img so that we minimize our
-     * ramdisk usage */
-    checked_asprintf(&ui->url, "%s/%s", path, "updates.img");
+    checked_asprintf(&img.url, "%s/%s", path, "updates.img");
 
-    if (!loadSingleUrlImage(loaderData, ui, "/tmp/updates-disk.img", "/tmp/update-disk",
+    if (!loadSingleUrlImage(loaderData, &img, "/tmp/updates-disk.img", "/tmp/update-disk",
                             "/dev/loop7", 1)) {
         copyDirectory("/tmp/update-disk", "/tmp/updates", copyWarnFn,
                       copyErrorFn);
@@ -272,13 +315,18 @@ static int loadUrlImages(struct loaderData_s *loaderData, struct iurlinfo *ui) {
         unlink("/tmp/updates-disk.img");
     }
 
-    free(ui->url);
+    free(img.url);
+}
+
+/* grab the product.img before install.img so that we minimize our
+ * ramdisk usage */
+static void loadProductImage(struct loaderData_s *loaderData,
+                             struct iurlinfo *ui, char *path) {
+    struct iurlinfo img = *ui;
 
-    /* grab the product.img before install.img so that we minimize our
-     * ramdisk usage */
-    checked_asprintf(&ui->url, "%s/%s", path, "product.img");
+    checked_asprintf(&img.url, "%s/%s", path, "product.img");
 
-    if (!loadSingleUrlImage(loaderData, ui, "/tmp/product-disk.img", "/tmp/product-disk",
+    if (!loadSingleUrlImage(loaderData, &img, "/tmp/product-disk.img", "/tmp/product-disk",
                             "/dev/loop7", 1)) {
         copyDirectory("/tmp/product-disk", "/tmp/product", copyWarnFn,
                       copyErrorFn);
@@ -287,13 +335,397 @@ static int loadUrlImages(struct loaderData_s *loaderData, struct iurlinfo *ui) {
         unlink("/tmp/product-disk");
     }
 
+    free(img.url);
+}
+
+#ifdef	ROCKS
+/*
+ * updates.img and product.img are unpacked straight off the web server
+ * while install.img is being fetched (see loadUrlImages()), instead of
+ * being stored in the ramdisk, loop mounted and copied one after another.
+ *
+ * each image gets a worker process that unpacks the cpio archive coming
+ * out of a fifo with unpackCpioBall(), and the worker's child fetches the
+ * image into the fifo. the fetcher writes one byte down a pipe once it
+ * has seen the image is a (gzipped) cpio archive. an image that isn't one
+ * is left to the old way, and the loader learns that before it starts on
+ * install.img.
+ *
+ * this is only done when the supervisor said lighttpd is ready (see
+ * start_httpd()), so a single request is enough.
+ */
+#define	STREAM_OK		0
+#define	STREAM_MISSING		1	/* no such image on the server */
+#define	STREAM_FALLBACK		2	/* store, mount and copy it instead */
+
+typedef struct {
+	int	fd;		/* the fifo */
+	int	verdictfd;	/* told once we know it is a cpio archive */
+	int	checked;	/* set once we know it is a cpio archive */
+	char	magic[6];
+	int	magiclen;
+} streamdata_t;
+
+static int
+streamout(int fd, char *buf, size_t len)
+{
+	ssize_t	n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static size_t
+streamwrite(void *ptr, size_t size, size_t nmemb, void *arg)
+{
+	streamdata_t	*sd = (streamdata_t *)arg;
+	size_t		len = size * nmemb;
+	size_t		n;
+	char		*buf = ptr;
+
+	if (!sd->checked) {
+		/*
+		 * gzip, or a 'newc' cpio header
+		 */
+		n = sizeof(sd->magic) - sd->magiclen;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(&sd->magic[sd->magiclen], buf, n);
+		sd->magiclen += n;
+
+		if (sd->magiclen < sizeof(sd->magic)) {
+			return len;
+		}
+
+		if (((unsigned char)sd->magic[0] != 0x1f ||
+				(unsigned char)sd->magic[1] != 0x8b) &&
+				memcmp(sd->magic, "0707", 4)) {
+			/*
+			 * stop the transfer
+			 */
+			return 0;
+		}
+
+		sd->checked = 1;
+
+		if (write(sd->verdictfd, "1", 1) != 1) {
+			return 0;
+		}
+		close(sd->verdictfd);
+		sd->verdictfd = -1;
+
+		if (streamout(sd->fd, sd->magic, sd->magiclen) != 0) {
+			return 0;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	if (streamout(sd->fd, buf, len) != 0) {
+		return 0;
+	}
+
+	return size * nmemb;
+}
+
+static int
+streamFetch(struct loaderData_s *loaderData, char *url, char *fifo,
+	int verdictfd)
+{
+	CURL			*curl;
+	CURLcode		status = CURLE_FAILED_INIT;
+	struct curl_slist	*hdrs = NULL;
+	streamdata_t		sd;
+	char			**ehdrs;
+	long			code = 0;
+
+	memset(&sd, 0, sizeof(sd));
+	sd.verdictfd = verdictfd;
+
+	/*
+	 * blocks until the worker starts reading
+	 */
+	if ((sd.fd = open(fifo, O_WRONLY)) < 0) {
+		return STREAM_FALLBACK;
+	}
+
+	if ((curl = curl_easy_init()) == NULL) {
+		close(sd.fd);
+		return STREAM_FALLBACK;
+	}
+
+	for (ehdrs = headers(loaderData); ehdrs && *ehdrs; ++ehdrs) {
+		hdrs = curl_slist_append(hdrs, *ehdrs);
+	}
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, streamwrite);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sd);
+
+	status = curl_easy_perform(curl);
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+	curl_slist_free_all(hdrs);
+	curl_easy_cleanup(curl);
+	close(sd.fd);
+
+	if ((status == CURLE_OK) && sd.checked) {
+		return STREAM_OK;
+	}
+
+	if ((code == 404) || (code == 403)) {
+		return STREAM_MISSING;
+	}
+
+	return STREAM_FALLBACK;
+}
+
+/*
+ * start unpacking the image at 'url' into 'dir'. returns the worker's pid
+ * (see streamStarted() and waitUrlImage()), or -1.
+ */
+static pid_t
+streamUrlImage(struct loaderData_s *loaderData, char *url, char *dir,
+	int *verdictfd)
+{
+	char	fifo[PATH_MAX];
+	pid_t	pid, fetcher;
+	int	status, fd, rc;
+	int	verdict[2];
+
+	if (pipe(verdict) != 0) {
+		*verdictfd = -1;
+		return -1;
+	}
+
+	if ((pid = fork()) != 0) {
+		close(verdict[1]);
+
+		if (pid < 0) {
+			close(verdict[0]);
+			verdict[0] = -1;
+		}
+
+		*verdictfd = verdict[0];
+		return pid;
+	}
+
+	close(verdict[0]);
+
+	snprintf(fifo, sizeof(fifo), "%s.fifo", dir);
+	unlink(fifo);
+
+	if (mkfifo(fifo, 0600) != 0) {
+		_exit(STREAM_FALLBACK);
+	}
+
+	if ((fetcher = fork()) == 0) {
+		_exit(streamFetch(loaderData, url, fifo, verdict[1]));
+	}
+
+	/*
+	 * only the fetcher says anything down the pipe. if it is gone, the
+	 * loader sees the end of the pipe.
+	 */
+	close(verdict[1]);
+
+	if (fetcher < 0) {
+		unlink(fifo);
+		_exit(STREAM_FALLBACK);
+	}
+
+	rc = unpackCpioBall(fifo, dir);
+
+	/*
+	 * if the unpack gave up before it opened the fifo, let the fetcher
+	 * get past its open(). its next write fails.
+	 */
+	if ((fd = open(fifo, O_RDONLY | O_NONBLOCK)) >= 0) {
+		close(fd);
+	}
+
+	waitpid(fetcher, &status, 0);
+	unlink(fifo);
+
+	if (!WIFEXITED(status)) {
+		_exit(STREAM_FALLBACK);
+	}
+
+	if (WEXITSTATUS(status) != STREAM_OK) {
+		_exit(WEXITSTATUS(status));
+	}
+
+	_exit(rc ? STREAM_FALLBACK : STREAM_OK);
+}
+
+static int
+waitUrlImage(pid_t pid)
+{
+	int	status;
+
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid) ||
+			!WIFEXITED(status)) {
+		return STREAM_FALLBACK;
+	}
+
+	return WEXITSTATUS(status);
+}
+
+/*
+ * wait until the fetcher knows if the image is a cpio archive. returns
+ * STREAM_OK if it is being unpacked (the worker is still running), else
+ * the worker is done, '*pid' is cleared and its exit code is returned.
+ */
+static int
+streamStarted(pid_t *pid, int verdictfd)
+{
+	char	c;
+	int	n;
+
+	if (verdictfd < 0) {
+		n = 0;
+	} else {
+		while (((n = read(verdictfd, &c, 1)) < 0) && (errno == EINTR))
+			;
+
+		close(verdictfd);
+	}
+
+	if (n == 1) {
+		return STREAM_OK;
+	}
+
+	n = waitUrlImage(*pid);
+	*pid = -1;
+	return n;
+}
+#endif
+
+static int loadUrlImages(struct loaderData_s *loaderData, struct iurlinfo *ui) {
+    char *oldUrl, *path, *dest, *slash;
+    int rc;
+#ifdef ROCKS
+    struct timeval start;
+    char *url;
+    pid_t updatesPid = -1, productPid = -1;
+    int updatesFd, productFd;
+    int updatesRc = STREAM_FALLBACK, productRc = STREAM_FALLBACK;
+#endif
+
+    oldUrl = strdup(ui->url);
     free(ui->url);
+
+    /* Figure out the path where updates.img and product.img files are
+     * kept.  Since ui->url points to a stage2 image file, we just need
+     * to trim off the file name and look in the same directory.
+     */
+    if ((slash = strrchr(oldUrl, '/')) == NULL)
+        return 0;
+
+    if ((path = strndup(oldUrl, slash-oldUrl)) == NULL)
+        path = oldUrl;
+
+#ifdef	ROCKS
+    /*
+     * fetch and unpack updates.img and product.img in the background
+     * (through the local tracker-client) while install.img comes in
+     */
+    gettimeofday(&start, NULL);
+    if (httpd_ready && !strncmp(path, "http", 4)) {
+        headers(loaderData);
+
+        checked_asprintf(&url, "%s/%s", path, "updates.img");
+        updatesPid = streamUrlImage(loaderData, url, "/tmp/updates",
+                                    &updatesFd);
+        free(url);
+
+        checked_asprintf(&url, "%s/%s", path, "product.img");
+        productPid = streamUrlImage(loaderData, url, "/tmp/product",
+                                    &productFd);
+        free(url);
+
+        updatesRc = streamStarted(&updatesPid, updatesFd);
+        productRc = streamStarted(&productPid, productFd);
+    }
+
+    /*
+     * the images that can't be unpacked on the fly are done the old way,
+     * before install.img
+     */
+    if (updatesRc == STREAM_FALLBACK)
+        loadUpdatesImage(loaderData, ui, path);
+    if (productRc == STREAM_FALLBACK)
+        loadProductImage(loaderData, ui, path);
+#else
+    loadUpdatesImage(loaderData, ui, path);
+    loadProductImage(loaderData, ui, path);
+#endif
+
     ui->url = strdup(oldUrl);
 
-    checked_asprintf(&dest, "/tmp/install.img");
+#ifdef	ROCKS
+    /*
+     * with 'lazystage2' on the boot line, read install.img on demand.
+     * if that doesn't work, fall back to downloading all of it.
+     */
+    if (loaderData->lazyStage2 && !loadLazyUrlImage(ui, "/mnt/runtime")) {
+        timelineSpan("image", &start, "file=install.img mode=lazy result=ok");
+        rc = 0;
+    } else
+#endif
+    {
+        checked_asprintf(&dest, "/tmp/install.img");
+
+        rc = loadSingleUrlImage(loaderData, ui, dest, "/mnt/runtime", "/dev/loop0", 0);
+#ifdef ROCKS
+        timelineSpan("image", &start, "file=install.img mode=download result=%s",
+                     (rc ? "failed" : "ok"));
+#endif
+        free(dest);
+    }
+
+#ifdef	ROCKS
+    /*
+     * an image whose stream broke off part way is done the old way now
+     */
+    if (updatesPid > 0) {
+        updatesRc = waitUrlImage(updatesPid);
+        if (updatesRc == STREAM_FALLBACK)
+            loadUpdatesImage(loaderData, ui, path);
+    }
+    timelineSpan("image", &start, "file=updates.img mode=%s",
+                 (updatesRc == STREAM_OK ? "stream" :
+                  (updatesRc == STREAM_MISSING ? "missing" : "mount")));
+
+    if (productPid > 0) {
+        productRc = waitUrlImage(productPid);
+        if (productRc == STREAM_FALLBACK)
+            loadProductImage(loaderData, ui, path);
+    }
+    timelineSpan("image", &start, "file=product.img mode=%s",
+                 (productRc == STREAM_OK ? "stream" :
+                  (productRc == STREAM_MISSING ? "missing" : "mount")));
+#endif
 
-    rc = loadSingleUrlImage(loaderData, ui, dest, "/mnt/runtime", "/dev/loop0", 0);
-    free(dest);
     free(oldUrl);
 
     if (rc) {
@@ -307,6 +739,170 @@ static int loadUrlImages(struct loaderData_s *loaderData, struct iurlinfo *ui) {
 }
 
 #ifdef ROCKS
+/*
+ * lighttpd runs under a small supervisor. the supervisor starts lighttpd
+ * (which starts tracker-client), asks tracker-client for its status until
+ * it answers, then writes one byte down a pipe. the loader waits on the
+ * pipe instead of sleeping and retrying.
+ *
+ * the supervisor keeps the loader's old pid, so init still sees the same
+ * process exit when lighttpd is stopped at the end of the install.
+ */
+#define	HTTPD_READY_SECS	30
+#define	HTTPD_POLL_MSEC		100
+
+static pid_t	httpd_pid = -1;
+
+static void
+forward_signal(int sig)
+{
+	if (httpd_pid > 0) {
+		kill(httpd_pid, sig);
+	}
+}
+
+static size_t
+discard(void *ptr, size_t size, size_t nmemb, void *arg)
+{
+	return size * nmemb;
+}
+
+/*
+ * returns 0 when tracker-client answered. the status request is a HEAD
+ * that tracker-client answers itself, it doesn't ask the trackers about
+ * any file.
+ */
+#define	HTTPD_STATUS_URL	"http://127.0.0.1/tracker/tracker-client?status"
+
+static int
+warm_httpd(void)
+{
+	CURL	*curl;
+	long	code;
+	int	waited;
+	int	ready = -1;
+
+	if ((curl = curl_easy_init()) == NULL) {
+		return -1;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_URL, HTTPD_STATUS_URL);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)HTTPD_READY_SECS);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+	for (waited = 0 ; waited < (HTTPD_READY_SECS * 1000) ;
+			waited += HTTPD_POLL_MSEC) {
+
+		if (curl_easy_perform(curl) == CURLE_OK) {
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+			/*
+			 * anything else means lighttpd is up but
+			 * tracker-client isn't
+			 */
+			if (code == 200) {
+				ready = 0;
+				break;
+			}
+		}
+
+		usleep(HTTPD_POLL_MSEC * 1000);
+	}
+
+	curl_easy_cleanup(curl);
+	return ready;
+}
+
+static void
+supervise_httpd(char **args, int readyfd)
+{
+	int	status = 0;
+
+	httpd_pid = fork();
+	if (httpd_pid < 0) {
+		/*
+		 * no supervisor. just be lighttpd like we used to.
+		 */
+		if (readyfd >= 0) {
+			close(readyfd);
+		}
+
+		execv(args[0], args);
+		logMessage(ERROR, "start_httpd:lighttpd failed\n");
+		_exit(1);
+	}
+
+	if (httpd_pid == 0) {
+		if (readyfd >= 0) {
+			close(readyfd);
+		}
+
+		execv(args[0], args);
+		logMessage(ERROR, "start_httpd:lighttpd failed\n");
+		_exit(1);
+	}
+
+	signal(SIGTERM, forward_signal);
+	signal(SIGINT, forward_signal);
+	signal(SIGHUP, forward_signal);
+
+	if (readyfd >= 0) {
+		if (warm_httpd() == 0) {
+			if (write(readyfd, "1", 1) != 1) {
+				logMessage(ERROR,
+					"start_httpd:ready write failed\n");
+			}
+		} else {
+			logMessage(ERROR, "start_httpd:lighttpd not ready "
+				"after %d seconds\n", HTTPD_READY_SECS);
+		}
+
+		close(readyfd);
+	}
+
+	while ((waitpid(httpd_pid, &status, 0) < 0) && (errno == EINTR))
+		;
+
+	_exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/*
+ * wait for the supervisor to say lighttpd is ready. if it never does, the
+ * loader falls back to retrying its requests.
+ */
+static void
+wait_httpd(int readyfd)
+{
+	struct timeval	start, timeout;
+	fd_set		fds;
+	char		c;
+	int		n;
+
+	gettimeofday(&start, NULL);
+
+	timeout.tv_sec = HTTPD_READY_SECS + 5;
+	timeout.tv_usec = 0;
+
+	do {
+		FD_ZERO(&fds);
+		FD_SET(readyfd, &fds);
+		n = select(readyfd + 1, &fds, NULL, NULL, &timeout);
+	} while ((n < 0) && (errno == EINTR));
+
+	if ((n > 0) && (read(readyfd, &c, 1) == 1)) {
+		httpd_ready = 1;
+	}
+
+	close(readyfd);
+
+	timelineSpan("httpd", &start, "ready=%s", httpd_ready ? "yes" : "no");
+	logMessage(INFO, "start_httpd:lighttpd %s\n",
+		httpd_ready ? "is ready" : "did not say it was ready");
+}
+
 void
 start_httpd()
 {
@@ -318,7 +914,18 @@ start_httpd()
 				"-D", NULL };
 	int	pid;
 	int	i;
+	int	readyfd[2];
 	struct device	**devices;
+	static int	started = 0;
+
+	/*
+	 * we come back here if the image couldn't be loaded. lighttpd is
+	 * still running.
+	 */
+	if (started) {
+		return;
+	}
+	started = 1;
 
 	/*
 	 * try to mount the CD
@@ -370,6 +977,10 @@ start_httpd()
 	/*
 	 * start the service
 	 */
+	if (pipe(readyfd) != 0) {
+		readyfd[0] = readyfd[1] = -1;
+	}
+
 	pid = fork();
 	if (pid != 0) {
 #ifdef	LATER
@@ -380,8 +991,16 @@ start_httpd()
 		 */
 		close(2);
 #endif
-		execv(args[0], args);
-		logMessage(ERROR, "start_httpd:lighttpd failed\n");
+		if (readyfd[0] >= 0) {
+			close(readyfd[0]);
+		}
+
+		supervise_httpd(args, readyfd[1]);
+	}
+
+	if (readyfd[0] >= 0) {
+		close(readyfd[1]);
+		wait_httpd(readyfd[0]);
 	}
 }
 #endif
@@ -582,6 +1201,7 @@ writeInterfacesFile(struct loaderData_s *loaderData)
 #ifdef	ROCKS
 char	*trackers = NULL;
 char	*pkgservers = NULL;
+char	*trackermode = NULL;
 #endif
 
 int getFileFromUrl(char * url, char * dest, 
@@ -596,10 +1216,16 @@ int getFileFromUrl(char * url, char * dest,
     NMState state;
     const GPtrArray *devices;
     int i;
+    struct timeval start;
+    struct kscache kc;
+    extern char *lastetag, *lastmodified;
+    extern long lastresponse;
 #endif
     iface_init_iface_t(&iface);
 
 #ifdef  ROCKS
+    gettimeofday(&start, NULL);
+
     if (kickstartNetworkUp(loaderData, &iface)) {
         logMessage(ERROR, "ROCKS:getFileFromUrl:unable to bring up network");
         return(1);
@@ -668,6 +1294,10 @@ int getFileFromUrl(char * url, char * dest,
 
     logMessage(INFO, "%s: nextServer %s",
 		"ROCKS:getFileFromUrl", loaderData->nextServer);
+
+    timelineSpan("ksnetwork", &start, "nextserver=%s",
+		(loaderData->nextServer ? loaderData->nextServer : "-"));
+    gettimeofday(&start, NULL);
 #else
     if (kickstartNetworkUp(loaderData, &iface)) {
         logMessage(ERROR, "unable to bring up network");
@@ -773,6 +1403,14 @@ int getFileFromUrl(char * url, char * dest,
 
   
 #ifdef  ROCKS
+        /*
+         * if the last kickstart file is still around, only ask for a new
+         * one if it changed
+         */
+        kscacheFind(&kc);
+        ehdrs = kscacheHeaders(&kc, ehdrs);
+        lastetag = lastmodified = NULL;
+
         /*
          * try harder to get the kickstart file since the interface
          * might take some more time to establish the link
@@ -789,6 +1427,35 @@ int getFileFromUrl(char * url, char * dest,
 			// wait a sec
                         sleep(1);
                 }
+
+                if ((rc == 0) && (lastresponse == 304) &&
+                                (kscacheRestore(&kc, dest) != 0)) {
+                        /*
+                         * lost the cached copy, get all of it
+                         */
+                        rc = urlinstTransfer(loaderData, &ui,
+                                headers(loaderData), dest);
+                }
+
+                if ((rc == 0) && (lastresponse == 304)) {
+                        /*
+                         * a 304 may not repeat the X-Avalanche-* headers
+                         */
+                        if (trackers == NULL && kc.trackers)
+                                trackers = strdup(kc.trackers);
+                        if (pkgservers == NULL && kc.pkgservers)
+                                pkgservers = strdup(kc.pkgservers);
+                        if (trackermode == NULL && kc.trackermode)
+                                trackermode = strdup(kc.trackermode);
+                } else if (rc == 0) {
+                        kscacheSave(&kc, dest, lastetag, lastmodified,
+                                trackers, pkgservers, trackermode);
+                }
+
+                timelineSpan("kickstart", &start,
+                        "file=%s tries=%d result=%s cached=%s", dest,
+                        (i < 10 ? i + 1 : i), (rc ? "failed" : "ok"),
+                        (lastresponse == 304 ? "yes" : "no"));
         }
 #else
     rc = urlinstTransfer(loaderData, &ui, ehdrs, dest);
@@ -959,6 +1626,19 @@ writeAvalancheInfo(char *trackers, char *pkgservers)
 		logMessage(ERROR, "ROCKS:writeAvalancheInfo:write failed");
 	}
 
+	/*
+	 * e.g., "partition" to spread the files over the trackers
+	 * instead of registering every file with every tracker
+	 */
+	if (trackermode != NULL) {
+		snprintf(str, sizeof(str), "var.trackermode = \"%s\"\n",
+			trackermode);
+
+		if (write(fd, str, strlen(str)) < 0) {
+			logMessage(ERROR, "ROCKS:writeAvalancheInfo:write failed");
+		}
+	}
+
 	close(fd);
 }
 
@@ -124,8 +124,17 @@ int splitProxyParam(char *param, char **user, char **password, char **proxy) {
 #ifdef	ROCKS
 extern char	*trackers;
 extern char	*pkgservers;
+extern char	*trackermode;
 static int	sleeptime = 0;
 
+/*
+ * the validators of the last file we got, and the HTTP status of the
+ * last transfer (see kscache.c)
+ */
+char	*lastetag = NULL;
+char	*lastmodified = NULL;
+long	lastresponse = 0;
+
 static size_t
 returnedheaders(void *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -151,8 +160,14 @@ returnedheaders(void *ptr, size_t size, size_t nmemb, void *userdata)
 			trackers = strdup(p);
 		} else if (strcmp(ptr, "X-Avalanche-Pkg-Servers:") == 0) {
 			pkgservers = strdup(p);
+		} else if (strcmp(ptr, "X-Avalanche-Tracker-Mode:") == 0) {
+			trackermode = strdup(p);
 		} else if (strcmp(ptr, "Retry-After:") == 0) {
 			sleeptime = atoi(p);
+		} else if (strcmp(ptr, "ETag:") == 0) {
+			lastetag = strdup(p);
+		} else if (strcmp(ptr, "Last-Modified:") == 0) {
+			lastmodified = strdup(p);
 		}
 	}
 
@@ -334,6 +349,12 @@ int urlinstTransfer(struct loaderData_s *loaderData, struct iurlinfo *ui,
 		}
 	}
 }
+#endif
+#ifdef	ROCKS
+    if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &lastresponse) !=
+		    CURLE_OK) {
+        lastresponse = 0;
+    }
 #endif
     if (status)
         logMessage(ERROR, "Error downloading %s: %s", ui->url, curl_easy_strerror(status));
@@ -0,0 +1,164 @@
+#!/bin/bash
+#
+# $Id$
+#
+# stand-in kickstart server for the kickstart cache (kscache.c in
+# patch-files/anaconda-13.21.215/loader).
+#
+# 'start <ks file>' serves <ks file> as /install/sbin/kickstart.cgi over
+# https (a throwaway self-signed certificate) on PORT (443). every reply
+# carries an ETag (the MD5 of the file) and a Last-Modified, and a request
+# whose If-None-Match matches gets a '304 Not Modified' without the
+# X-Avalanche-* headers, like kickstart.cgi should. each request is logged
+# to $RUNDIR/requests as '<If-None-Match or -> <status>'.
+#
+# then boot a node against it three times (e.g., with the networks of
+# test-nicprobe.sh, and this server on the frontend address):
+#
+#	1. a node with an empty .rocks-kickstart directory on its
+#	   /state/partition1 gets the file (200) and caches it
+#	2. the same node again sends If-None-Match and uses its cached
+#	   copy (304)
+#	3. remove .rocks-kickstart/ks.cfg but leave .rocks-kickstart/info,
+#	   and boot it again: with no cached copy the loader asks without
+#	   conditions (200), and caches the file again
+#
+# (if the cached copy goes away between the request and the 304, the
+# loader asks again without conditions too. that can't be set up from
+# out here.)
+#
+# 'verify' checks the request log for exactly that. 'stop' stops the
+# server and removes its files.
+#
+
+PORT=${PORT:-443}
+PYTHON=${PYTHON:-python}
+RUNDIR=/tmp/rocks-kscache
+
+usage() {
+	echo "usage: $0 start <ks file> | stop | verify"
+	exit 1
+}
+
+die() {
+	echo "$0: $*" 1>&2
+	exit 1
+}
+
+start() {
+	ks=$1
+
+	[ -f "$ks" ] || usage
+
+	mkdir -p $RUNDIR || exit 1
+	cp $ks $RUNDIR/ks.cfg || exit 1
+	: > $RUNDIR/requests
+
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+		-subj "/CN=kscache-test" -keyout $RUNDIR/key.pem \
+		-out $RUNDIR/cert.pem > /dev/null 2>&1 ||
+		die "can't make a certificate"
+
+	cat > $RUNDIR/server.py << 'EOF'
+import sys, ssl, time, hashlib
+try:
+	from http.server import HTTPServer, BaseHTTPRequestHandler
+except ImportError:
+	from BaseHTTPServer import HTTPServer, BaseHTTPRequestHandler
+
+rundir, port = sys.argv[1], int(sys.argv[2])
+
+class Handler(BaseHTTPRequestHandler):
+	def do_GET(self):
+		if not self.path.startswith('/install/sbin/kickstart.cgi'):
+			self.send_error(404)
+			return
+
+		body = open(rundir + '/ks.cfg', 'rb').read()
+		etag = '"%s"' % hashlib.md5(body).hexdigest()
+		inm = self.headers.get('If-None-Match')
+
+		code = 200
+		if inm == etag:
+			code = 304
+
+		log = open(rundir + '/requests', 'a')
+		log.write('%s %d\n' % (inm or '-', code))
+		log.close()
+
+		self.send_response(code)
+		self.send_header('ETag', etag)
+		self.send_header('Last-Modified', time.strftime(
+			'%a, %d %b %Y %H:%M:%S GMT', time.gmtime()))
+		if code == 200:
+			self.send_header('X-Avalanche-Trackers', '10.1.1.1')
+			self.send_header('X-Avalanche-Pkg-Servers', '10.1.1.1')
+			self.send_header('Content-Length', str(len(body)))
+		self.end_headers()
+		if code == 200:
+			self.wfile.write(body)
+
+	def log_message(self, *args):
+		pass
+
+httpd = HTTPServer(('', port), Handler)
+if hasattr(ssl, 'SSLContext'):
+	ctx = ssl.SSLContext(ssl.PROTOCOL_SSLv23)
+	ctx.load_cert_chain(rundir + '/cert.pem', rundir + '/key.pem')
+	httpd.socket = ctx.wrap_socket(httpd.socket, server_side=True)
+else:
+	httpd.socket = ssl.wrap_socket(httpd.socket, server_side=True,
+		certfile=rundir + '/cert.pem', keyfile=rundir + '/key.pem')
+httpd.serve_forever()
+EOF
+
+	$PYTHON $RUNDIR/server.py $RUNDIR $PORT &
+	echo $! > $RUNDIR/server.pid
+
+	sleep 1
+	kill -0 `cat $RUNDIR/server.pid` 2> /dev/null ||
+		die "the server didn't start"
+
+	echo "serving $ks on port $PORT"
+}
+
+stop() {
+	if [ -f $RUNDIR/server.pid ]; then
+		kill `cat $RUNDIR/server.pid` 2> /dev/null
+	fi
+
+	rm -rf $RUNDIR
+}
+
+verify() {
+	[ -f $RUNDIR/requests ] || die "no request log"
+
+	#
+	# boot 1: 200. boot 2: 304. boot 3: 200 without conditions.
+	#
+	got=`awk '{ print ($1 == "-" ? "plain" : "cond") "-" $2 }' \
+		$RUNDIR/requests | tr '\n' ' '`
+	want="plain-200 cond-304 plain-200 "
+
+	if [ "$got" = "$want" ]; then
+		echo "PASS: $got"
+	else
+		echo "FAIL: got '$got', want '$want'"
+		exit 1
+	fi
+}
+
+case $1 in
+start)
+	start $2
+	;;
+stop)
+	stop
+	;;
+verify)
+	verify
+	;;
+*)
+	usage
+	;;
+esac
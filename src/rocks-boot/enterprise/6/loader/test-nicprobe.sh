@@ -0,0 +1,187 @@
+#!/bin/bash
+#
+# $Id$
+#
+# test network for the parallel NIC probe in chooseNetworkInterface()
+# (patch-files/anaconda-13.21.215/loader/net.c).
+#
+# 'setup' builds three networks out of veth pairs, each with its node side
+# on a bridge in this namespace, so a VM can plug a NIC into each of them:
+#
+#	brnic0	a 'public' network. dnsmasq hands out leases without a
+#		server-name.
+#	brnic1	a dead network. nothing answers DHCP.
+#	brnic2	the 'frontend' network. dnsmasq hands out leases with a
+#		server-name, unless setup is run with 'nosname'.
+#
+# the DHCP servers run in network namespaces of their own (rocks-pub and
+# rocks-fe). then boot a node image that has the new loader, with its
+# NICs in that order, e.g.:
+#
+#	qemu-kvm -m 2048 -kernel vmlinuz -initrd initrd.img \
+#		-append "ks loglevel=debug" \
+#		-netdev bridge,id=n0,br=brnic0 -device e1000,netdev=n0 \
+#		-netdev bridge,id=n1,br=brnic1 -device e1000,netdev=n1 \
+#		-netdev bridge,id=n2,br=brnic2 -device e1000,netdev=n2
+#
+# copy the loader's /tmp/anaconda.log out of the VM (from the shell on
+# tty2) and run 'verify anaconda.log' on it. with the server-name the
+# loader must pick eth2 within one DHCP timeout. with 'nosname' it must
+# pick eth0 or eth2 (the first lease, after the grace period) instead of
+# giving up.
+#
+# 'teardown' removes all of it.
+#
+
+DNSMASQ=${DNSMASQ:-dnsmasq}
+RUNDIR=/tmp/rocks-nicprobe
+
+FE_NET=10.1
+FE_ADDR=10.1.1.1
+PUB_NET=192.168.200
+PUB_ADDR=192.168.200.1
+
+usage() {
+	echo "usage: $0 setup [sname|nosname] | teardown | verify <loader log>"
+	exit 1
+}
+
+die() {
+	echo "$0: $*" 1>&2
+	exit 1
+}
+
+#
+# a veth pair from bridge 'br' to the namespace 'ns' (if any), with 'addr'
+# on the namespace end
+#
+network() {
+	br=$1
+	ns=$2
+	addr=$3
+
+	ip link add $br type bridge || return 1
+	ip link add $br-node type veth peer name $br-peer || return 1
+	ip link set $br-node master $br
+	ip link set $br-node up
+	ip link set $br up
+
+	if [ -z "$ns" ]; then
+		ip link set $br-peer up
+		return 0
+	fi
+
+	ip netns add $ns || return 1
+	ip link set $br-peer netns $ns
+	ip netns exec $ns ip addr add $addr dev $br-peer
+	ip netns exec $ns ip link set $br-peer up
+	ip netns exec $ns ip link set lo up
+}
+
+setup() {
+	mode=${1:-sname}
+
+	case $mode in
+	sname|nosname)
+		;;
+	*)
+		usage
+		;;
+	esac
+
+	which $DNSMASQ > /dev/null 2>&1 || die "no $DNSMASQ"
+
+	mkdir -p $RUNDIR || exit 1
+
+	network brnic0 rocks-pub $PUB_ADDR/24 || die "brnic0 failed"
+	network brnic1 "" "" || die "brnic1 failed"
+	network brnic2 rocks-fe $FE_ADDR/16 || die "brnic2 failed"
+
+	ip netns exec rocks-pub $DNSMASQ --no-resolv --no-hosts \
+		--interface=brnic0-peer --bind-interfaces \
+		--dhcp-range=$PUB_NET.100,$PUB_NET.200,5m \
+		--pid-file=$RUNDIR/pub.pid \
+		--dhcp-leasefile=$RUNDIR/pub.leases || die "public dnsmasq failed"
+
+	#
+	# the server-name goes out in the sname field of the reply
+	#
+	if [ "$mode" = "sname" ]; then
+		boot="--dhcp-boot=pxelinux.0,frontend,$FE_ADDR"
+	else
+		boot="--dhcp-boot=pxelinux.0"
+	fi
+
+	ip netns exec rocks-fe $DNSMASQ --no-resolv --no-hosts \
+		--interface=brnic2-peer --bind-interfaces \
+		--dhcp-range=$FE_NET.255.100,$FE_NET.255.200,5m \
+		$boot \
+		--pid-file=$RUNDIR/fe.pid \
+		--dhcp-leasefile=$RUNDIR/fe.leases ||
+		die "frontend dnsmasq failed"
+
+	echo $mode > $RUNDIR/mode
+	echo "networks up ($mode): brnic0 (public) brnic1 (dead) brnic2 (frontend)"
+}
+
+teardown() {
+	for pid in $RUNDIR/pub.pid $RUNDIR/fe.pid; do
+		if [ -f $pid ]; then
+			kill `cat $pid` 2> /dev/null
+		fi
+	done
+
+	for br in brnic0 brnic1 brnic2; do
+		ip link del $br-node 2> /dev/null
+		ip link del $br 2> /dev/null
+	done
+
+	for ns in rocks-pub rocks-fe; do
+		ip netns del $ns 2> /dev/null
+	done
+
+	rm -rf $RUNDIR
+}
+
+verify() {
+	log=$1
+
+	[ -f "$log" ] || usage
+	mode=`cat $RUNDIR/mode 2> /dev/null`
+
+	if grep -q "couldn't find a network device" $log; then
+		echo "FAIL: no device was chosen"
+		exit 1
+	fi
+
+	dev=`sed -n 's/.*ROCKS:chooseNetworkInterface:using:device (\([^)]*\)).*/\1/p' $log | tail -1`
+	if [ -z "$dev" ]; then
+		echo "FAIL: no 'using:device' line in $log"
+		exit 1
+	fi
+
+	case "$mode:$dev" in
+	sname:eth2|nosname:eth0|nosname:eth2)
+		echo "PASS: $mode: chose $dev"
+		;;
+	*)
+		echo "FAIL: $mode: chose $dev"
+		exit 1
+		;;
+	esac
+}
+
+case $1 in
+setup)
+	setup $2
+	;;
+teardown)
+	teardown
+	;;
+verify)
+	verify $2
+	;;
+*)
+	usage
+	;;
+esac
@@ -0,0 +1,603 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * keep the ramdisk /install cache inside a memory budget.
+ *
+ * until the file systems are formatted, every file that is downloaded
+ * lives in RAM. the cache is allowed to use CACHE_RAM_PERCENT of the
+ * memory that is free plus the memory it already uses, so when the
+ * installer grows the cache shrinks. when a new file pushes the cache over
+ * its budget, old files are thrown away in this order:
+ *
+ *	1) packages the installer has read that the tracker no longer
+ *	   reports as hot
+ *	2) packages the installer has read that are still hot
+ *	3) packages that were prefetched but not read yet
+ *
+ * within each class, the one that was used the longest time ago goes
+ * first. only packages are thrown away -- the images and the repository
+ * data are read more than once during an install.
+ *
+ * all the tracker-client processes share one index of the cache (a file
+ * in /tmp that is mapped into each process), so a file that is not in the
+ * index is not in the cache and getlocal() doesn't have to look at the
+ * file system. the index is only used while the cache is on the ramdisk,
+ * once the files start moving to the disk (see migrate.c) it is turned
+ * off for good.
+ *
+ * the index also holds the downloads the installer is waiting for (see
+ * cache_foreground()). that part is used for the whole install, so every
+ * prefetch, and the process that serves it, gets out of the installer's
+ * way no matter which tracker-client process the installer asked.
+ */
+
+#define	_XOPEN_SOURCE	500
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <sys/time.h>
+#include "tracker.h"
+
+extern void logmsg(const char *, ...);
+extern uint64_t hashit(char *);
+
+#define	CACHE_ROOT		"/install/"
+#define	CACHE_INDEX		"/tmp/tracker-cache"
+#define	CACHE_MAGIC		0x52434332
+#define	CACHE_SLOTS		4096
+#define	CACHE_NAME_LEN		208
+#define	CACHE_WAITERS		16
+
+/*
+ * slot states
+ */
+#define	SLOT_FREE		0
+#define	SLOT_INUSE		1
+#define	SLOT_DEAD		2
+
+/*
+ * slot flags
+ */
+#define	CACHE_USED		0x1	/* the installer has read it */
+#define	CACHE_PINNED		0x2	/* never thrown away */
+
+typedef struct {
+	uint64_t	hash;
+	uint64_t	size;
+	uint32_t	lastuse;
+	uint32_t	hotuntil;	/* the tracker says it is hot until */
+	uint16_t	state;
+	uint16_t	flags;
+	char		name[CACHE_NAME_LEN];
+} cache_entry_t;
+
+typedef struct {
+	uint64_t	hash;
+	uint32_t	since;		/* 0 if nobody is waiting */
+	uint32_t	pad;
+} cache_waiter_t;
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	stopped;
+	uint64_t	used;		/* bytes */
+	uint32_t	count;
+	uint32_t	evictions;
+	cache_entry_t	slots[CACHE_SLOTS];
+	cache_waiter_t	waiters[CACHE_WAITERS];
+} cache_index_t;
+
+static cache_index_t	*cache = NULL;
+static int		cachefd = -1;
+static int		cache_failed = 0;
+
+static int
+lock()
+{
+	return(flock(cachefd, LOCK_EX));
+}
+
+static void
+unlock()
+{
+	flock(cachefd, LOCK_UN);
+}
+
+/*
+ * hashit() is mostly decided by the last few characters of a name, fold
+ * the high bits in before picking a slot
+ */
+static int
+firstslot(uint64_t hash)
+{
+	return((hash ^ (hash >> 17) ^ (hash >> 41)) % CACHE_SLOTS);
+}
+
+/*
+ * find the slot for a file. if 'create' is set and the file is not in the
+ * index, a free slot is returned for it.
+ */
+static cache_entry_t *
+findslot(uint64_t hash, char *name, int create)
+{
+	cache_entry_t	*e;
+	cache_entry_t	*dead = NULL;
+	int		i, slot;
+
+	slot = firstslot(hash);
+
+	for (i = 0 ; i < CACHE_SLOTS ; ++i) {
+		e = &cache->slots[(slot + i) % CACHE_SLOTS];
+
+		if (e->state == SLOT_FREE) {
+			if (!create) {
+				return(NULL);
+			}
+
+			return(dead != NULL ? dead : e);
+		}
+
+		if (e->state == SLOT_DEAD) {
+			if (dead == NULL) {
+				dead = e;
+			}
+			continue;
+		}
+
+		if ((e->hash == hash) && (strcmp(e->name, name) == 0)) {
+			return(e);
+		}
+	}
+
+	return(create ? dead : NULL);
+}
+
+static void
+drop(cache_entry_t *e)
+{
+	cache->used -= e->size;
+	--cache->count;
+
+	e->state = SLOT_DEAD;
+	e->name[0] = '\0';
+}
+
+static cache_entry_t *
+insert(char *name, uint64_t size)
+{
+	cache_entry_t	*e;
+	uint64_t	hash;
+	int		len;
+
+	if ((len = strlen(name)) >= CACHE_NAME_LEN) {
+		return(NULL);
+	}
+
+	hash = hashit(name);
+
+	if ((e = findslot(hash, name, 1)) == NULL) {
+		return(NULL);
+	}
+
+	if (e->state == SLOT_INUSE) {
+		cache->used -= e->size;
+	} else {
+		bzero(e, sizeof(*e));
+		e->hash = hash;
+		strcpy(e->name, name);
+		e->state = SLOT_INUSE;
+		++cache->count;
+
+		if ((len < 4) || (strcmp(&name[len - 4], ".rpm") != 0)) {
+			e->flags |= CACHE_PINNED;
+		}
+	}
+
+	e->size = size;
+	e->lastuse = time(NULL);
+	cache->used += size;
+
+	return(e);
+}
+
+/*
+ * put the files that are already on the ramdisk in the index
+ */
+static int
+seed_file(const char *path, const struct stat *sb, int flag,
+	struct FTW *ftwbuf)
+{
+	if (flag == FTW_F) {
+		insert((char *)path, sb->st_size);
+	}
+
+	return(0);
+}
+
+/*
+ * map the index. the first process to get here builds it.
+ */
+static int
+cache_open()
+{
+	struct stat	buf;
+
+	if (cache != NULL) {
+		return(0);
+	}
+
+	if (cache_failed) {
+		return(-1);
+	}
+
+	if ((cachefd = open(CACHE_INDEX, O_RDWR|O_CREAT, 0644)) < 0) {
+		logmsg("cache_open:open failed:errno (%d)\n", errno);
+		cache_failed = 1;
+		return(-1);
+	}
+
+	if (lock() != 0) {
+		logmsg("cache_open:flock failed:errno (%d)\n", errno);
+		close(cachefd);
+		cache_failed = 1;
+		return(-1);
+	}
+
+	if ((fstat(cachefd, &buf) != 0) || ((buf.st_size <
+			sizeof(cache_index_t)) && (ftruncate(cachefd,
+			sizeof(cache_index_t)) != 0))) {
+		logmsg("cache_open:ftruncate failed:errno (%d)\n", errno);
+		unlock();
+		close(cachefd);
+		cache_failed = 1;
+		return(-1);
+	}
+
+	if ((cache = mmap(NULL, sizeof(cache_index_t), PROT_READ|PROT_WRITE,
+			MAP_SHARED, cachefd, 0)) == MAP_FAILED) {
+		logmsg("cache_open:mmap failed:errno (%d)\n", errno);
+		cache = NULL;
+		unlock();
+		close(cachefd);
+		cache_failed = 1;
+		return(-1);
+	}
+
+	if (cache->magic != CACHE_MAGIC) {
+		bzero(cache, sizeof(cache_index_t));
+
+		/*
+		 * if /install is already a link to the disk, there is
+		 * nothing to manage
+		 */
+		if ((lstat("/install", &buf) == 0) && S_ISLNK(buf.st_mode)) {
+			cache->stopped = 1;
+		} else {
+			nftw("/install", seed_file, 16, FTW_PHYS);
+		}
+
+		cache->magic = CACHE_MAGIC;
+
+		logmsg("cache_open:indexed %d files (%lld bytes)\n",
+			cache->count, (long long)cache->used);
+	}
+
+	unlock();
+	return(0);
+}
+
+/*
+ * how many bytes the cache may use right now
+ */
+static uint64_t
+budget()
+{
+	struct sysinfo	info;
+	uint64_t	freebytes;
+	uint64_t	limit;
+
+	if (sysinfo(&info) != 0) {
+		return(cache->used + CACHE_MIN_BYTES);
+	}
+
+	freebytes = (uint64_t)info.freeram * info.mem_unit;
+	limit = ((freebytes + cache->used) / 100) * CACHE_RAM_PERCENT;
+
+	if (limit < CACHE_MIN_BYTES) {
+		limit = CACHE_MIN_BYTES;
+	}
+
+	return(limit);
+}
+
+/*
+ * pick the file to throw away next, NULL if there is nothing left that
+ * can go
+ */
+static cache_entry_t *
+victim(cache_entry_t *keep, uint32_t now)
+{
+	cache_entry_t	*e, *best = NULL;
+	int		class, bestclass = 0;
+	int		i;
+
+	for (i = 0 ; i < CACHE_SLOTS ; ++i) {
+		e = &cache->slots[i];
+
+		if ((e->state != SLOT_INUSE) || (e == keep) ||
+				(e->flags & CACHE_PINNED)) {
+			continue;
+		}
+
+		if (!(e->flags & CACHE_USED)) {
+			class = 2;
+		} else if (e->hotuntil > now) {
+			class = 1;
+		} else {
+			class = 0;
+		}
+
+		if ((best == NULL) || (class < bestclass) ||
+				((class == bestclass) &&
+				(e->lastuse < best->lastuse))) {
+			best = e;
+			bestclass = class;
+		}
+	}
+
+	return(best);
+}
+
+/*
+ * look a file up in the index. 'used' is set if the installer (and not a
+ * prefetch) is reading it. returns:
+ *
+ *	CACHE_HIT	- the file is on the ramdisk
+ *	CACHE_MISS	- the file is not on the ramdisk
+ *	CACHE_UNKNOWN	- the index can't tell, look at the file system
+ */
+int
+cache_find(char *filename, int used)
+{
+	cache_entry_t	*e;
+	int		retval;
+
+	if ((strncmp(filename, CACHE_ROOT, strlen(CACHE_ROOT)) != 0) ||
+			(strlen(filename) >= CACHE_NAME_LEN) ||
+			(cache_open() != 0) || cache->stopped) {
+		return(CACHE_UNKNOWN);
+	}
+
+	if (lock() != 0) {
+		return(CACHE_UNKNOWN);
+	}
+
+	if (cache->stopped) {
+		retval = CACHE_UNKNOWN;
+	} else if ((e = findslot(hashit(filename), filename, 0)) == NULL) {
+		retval = CACHE_MISS;
+	} else {
+		e->lastuse = time(NULL);
+		if (used) {
+			e->flags |= CACHE_USED;
+		}
+		retval = CACHE_HIT;
+	}
+
+	unlock();
+	return(retval);
+}
+
+/*
+ * a file was just downloaded into the cache. if that puts the cache over
+ * its budget, throw away other files until it fits. the hashes of the
+ * files that were thrown away are put in 'evicted' (at most 'max' of
+ * them) so the caller can unregister them. returns how many there are.
+ */
+int
+cache_add(char *filename, int used, uint64_t *evicted, int max)
+{
+	struct stat	buf;
+	cache_entry_t	*e, *v;
+	uint64_t	limit;
+	uint32_t	now;
+	int		n = 0;
+
+	if ((strncmp(filename, CACHE_ROOT, strlen(CACHE_ROOT)) != 0) ||
+			(cache_open() != 0) || cache->stopped) {
+		return(0);
+	}
+
+	if (stat(filename, &buf) != 0) {
+		return(0);
+	}
+
+	if (lock() != 0) {
+		return(0);
+	}
+
+	if (cache->stopped) {
+		unlock();
+		return(0);
+	}
+
+	if ((e = insert(filename, buf.st_size)) == NULL) {
+		/*
+		 * the name is too long or the index is full. the file is
+		 * still in the cache, it just isn't managed.
+		 */
+		logmsg("cache_add:can't index (%s)\n", filename);
+		unlock();
+		return(0);
+	}
+
+	if (used) {
+		e->flags |= CACHE_USED;
+	}
+
+	now = time(NULL);
+	limit = budget();
+
+	while ((cache->used > limit) && (n < max)) {
+		if ((v = victim(e, now)) == NULL) {
+			break;
+		}
+
+		logmsg("cache_add:evict (%s) (%lld bytes)\n", v->name,
+			(long long)v->size);
+
+		unlink(v->name);
+		evicted[n++] = v->hash;
+		++cache->evictions;
+		drop(v);
+	}
+
+	unlock();
+	return(n);
+}
+
+/*
+ * the tracker told us a file is hot. keep it a while longer.
+ */
+void
+cache_hot(uint64_t hash)
+{
+	cache_entry_t	*e;
+	uint32_t	now;
+	int		i, slot;
+
+	if ((cache_open() != 0) || cache->stopped || (lock() != 0)) {
+		return;
+	}
+
+	now = time(NULL);
+
+	/*
+	 * we only know the hash, so mark every file that has it
+	 */
+	slot = firstslot(hash);
+
+	for (i = 0 ; i < CACHE_SLOTS ; ++i) {
+		e = &cache->slots[(slot + i) % CACHE_SLOTS];
+
+		if (e->state == SLOT_FREE) {
+			break;
+		}
+
+		if ((e->state == SLOT_INUSE) && (e->hash == hash)) {
+			e->hotuntil = now + CACHE_HOT_SECS;
+		}
+	}
+
+	unlock();
+}
+
+/*
+ * the files are moving to the disk. the index doesn't know where they
+ * are anymore.
+ */
+void
+cache_stop()
+{
+	if ((cache_open() != 0) || cache->stopped || (lock() != 0)) {
+		return;
+	}
+
+	if (!cache->stopped) {
+		logmsg("cache_stop:%d files (%lld bytes) : %d evictions\n",
+			cache->count, (long long)cache->used,
+			cache->evictions);
+		cache->stopped = 1;
+	}
+
+	unlock();
+}
+
+/*
+ * the installer is waiting for a download of 'hash' ('waiting' is set),
+ * or it is done waiting. if every slot is taken, the oldest wait is
+ * forgotten.
+ */
+void
+cache_foreground(uint64_t hash, int waiting)
+{
+	cache_waiter_t	*w, *slot;
+	int		i;
+
+	if ((cache_open() != 0) || (lock() != 0)) {
+		return;
+	}
+
+	slot = NULL;
+	for (i = 0 ; i < CACHE_WAITERS ; ++i) {
+		w = &cache->waiters[i];
+
+		if (!waiting) {
+			if ((w->since != 0) && (w->hash == hash)) {
+				w->since = 0;
+				break;
+			}
+		} else if ((slot == NULL) || (w->since < slot->since)) {
+			slot = w;
+		}
+	}
+
+	if (slot != NULL) {
+		slot->hash = hash;
+		slot->since = time(NULL);
+	}
+
+	unlock();
+}
+
+/*
+ * returns 1 if the installer is waiting for a download of a file other
+ * than 'hash' (0 for any file). a wait older than PREFETCH_HOLDOFF_MSEC
+ * doesn't count, the process that was waiting may be gone.
+ */
+int
+cache_waiting(uint64_t hash)
+{
+	cache_waiter_t	*w;
+	uint32_t	now;
+	int		i;
+
+	if (cache_open() != 0) {
+		return(0);
+	}
+
+	now = time(NULL);
+
+	for (i = 0 ; i < CACHE_WAITERS ; ++i) {
+		w = &cache->waiters[i];
+
+		if ((w->since != 0) && (w->hash != hash) &&
+				((now - w->since) * 1000 <
+				PREFETCH_HOLDOFF_MSEC)) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
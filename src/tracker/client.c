@@ -16,8 +16,11 @@ extern void logmsg(const char *, ...);
 
 static uint32_t	seqno = 0;
 
+int resend_msg(int, in_addr_t *, tracker_header_t *);
+
 int
-lookup(int sockfd, in_addr_t *tracker, uint64_t hash, tracker_info_t **info)
+lookup(int sockfd, in_addr_t *tracker, uint64_t hash, uint32_t flags,
+	tracker_info_t **info, uint64_t *hints, uint16_t *numhints)
 {
 	struct sockaddr_in	send_addr, recv_addr;
 	struct timeval		timeout;
@@ -31,6 +34,7 @@ lookup(int sockfd, in_addr_t *tracker, uint64_t hash, tracker_info_t **info)
 
 	bzero(&send_addr, sizeof(send_addr));
 	send_addr.sin_family = AF_INET;
+	*numhints = 0;
 
 #ifdef	DEBUG
 #endif
@@ -47,6 +51,7 @@ lookup(int sockfd, in_addr_t *tracker, uint64_t hash, tracker_info_t **info)
 	req.header.length = sizeof(tracker_lookup_req_t);
 	req.header.seqno = seqno++;
 	req.hash = hash;
+	req.flags = flags;
 
 	tracker_send(sockfd, (void *)&req, sizeof(req),
 		(struct sockaddr *)&send_addr, sizeof(send_addr));
@@ -105,11 +110,26 @@ lookup(int sockfd, in_addr_t *tracker, uint64_t hash, tracker_info_t **info)
 				abort();
 			}
 
+			/*
+			 * the hot files the tracker wants us to fetch come
+			 * after the info entries
+			 */
+			if ((resp->numhints <= HOT_HINTS) &&
+					(sizeof(tracker_lookup_resp_t) +
+					(resp->numhints * sizeof(uint64_t)) <=
+					resp->header.length)) {
+				*numhints = resp->numhints;
+			}
+
 			/*
 			 * get the size of the info structure
 			 */
 			infosize = resp->header.length -
-				sizeof(tracker_lookup_resp_t);
+				sizeof(tracker_lookup_resp_t) -
+				(*numhints * sizeof(uint64_t));
+
+			memcpy(hints, (char *)resp->info + infosize,
+				*numhints * sizeof(uint64_t));
 
 			if ((*info = (tracker_info_t *)malloc(infosize)) ==
 					NULL) {
@@ -135,35 +155,42 @@ lookup(int sockfd, in_addr_t *tracker, uint64_t hash, tracker_info_t **info)
 	return(retval);
 }
 
-int
-register_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
-	tracker_info_t *info)
+static void
+tracker_addr(struct sockaddr_in *send_addr, in_addr_t *ip)
+{
+	bzero(send_addr, sizeof(*send_addr));
+	send_addr->sin_family = AF_INET;
+
+	/*
+	 * the ip address is already in network byte order
+	 */
+	send_addr->sin_addr.s_addr = *ip;
+	send_addr->sin_port = htons(TRACKER_PORT);
+}
+
+static tracker_register_t *
+make_register(uint32_t numhashes, tracker_info_t *info, uint32_t flags)
 {
-	struct sockaddr_in	send_addr;
 	tracker_register_t	*req;
 	int			len, infolen;
 	int			i;
 
-	bzero(&send_addr, sizeof(send_addr));
-	send_addr.sin_family = AF_INET;
-
 	/*
-	 * the ip address is already in network byte order
+	 * the entries in 'info' are packed, each one is followed by its peers
 	 */
-	send_addr.sin_addr.s_addr = *ip;
-	send_addr.sin_port = htons(TRACKER_PORT);
-
 	infolen = 0;
 	for (i = 0 ; i < numhashes ; ++i) {
+		tracker_info_t	*p = (tracker_info_t *)((char *)info + infolen);
+
 		infolen += sizeof(tracker_info_t) +
-			(info[i].numpeers * sizeof(*(info[i].peers)));
+			(p->numpeers * sizeof(p->peers[0]));
 	}
 
 	len = sizeof(tracker_register_t) + infolen;
 
 	if ((req = (tracker_register_t *)malloc(len)) == NULL) {
 		logmsg("register_hash:malloc failed\n");
-		return(-1);
+		return(NULL);
 	}
 
 	bzero(req, len);
@@ -172,14 +199,30 @@ register_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
 	req->header.seqno = seqno++;
 
 	req->numhashes = numhashes;
+	req->flags = flags;
 
 #ifdef	DEBUG
 	logmsg("infolen (%d)\n", infolen);
 #endif
 
 	memcpy(req->info, info, infolen);
+	return(req);
+}
 
-	tracker_send(sockfd, (void *)req, len, 
+int
+register_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
+	tracker_info_t *info)
+{
+	struct sockaddr_in	send_addr;
+	tracker_register_t	*req;
+
+	tracker_addr(&send_addr, ip);
+
+	if ((req = make_register(numhashes, info, 0)) == NULL) {
+		return(-1);
+	}
+
+	tracker_send(sockfd, (void *)req, req->header.length, 
 		(struct sockaddr *)&send_addr, sizeof(send_addr));
 
 #ifdef	DEBUG
@@ -196,6 +239,38 @@ register_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
 	return(0);
 }
 
+/*
+ * like register_hash(), but ask the tracker for an ack. the message is
+ * returned, so the caller can match the ack to it (by seqno) and send it
+ * again with resend_msg() if the ack doesn't come. the caller frees it.
+ */
+tracker_register_t *
+register_hash_ack(int sockfd, in_addr_t *ip, uint32_t numhashes,
+	tracker_info_t *info)
+{
+	tracker_register_t	*req;
+
+	if ((req = make_register(numhashes, info, REGISTER_ACK)) == NULL) {
+		return(NULL);
+	}
+
+	resend_msg(sockfd, ip, (tracker_header_t *)req);
+	return(req);
+}
+
+int
+resend_msg(int sockfd, in_addr_t *ip, tracker_header_t *msg)
+{
+	struct sockaddr_in	send_addr;
+
+	tracker_addr(&send_addr, ip);
+
+	tracker_send(sockfd, (void *)msg, msg->length, 
+		(struct sockaddr *)&send_addr, sizeof(send_addr));
+
+	return(0);
+}
+
 int
 unregister_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
 	tracker_info_t *info)
@@ -214,10 +289,15 @@ unregister_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
 	send_addr.sin_addr.s_addr = *ip;
 	send_addr.sin_port = htons(TRACKER_PORT);
 
+	/*
+	 * the entries in 'info' are packed, each one is followed by its peers
+	 */
 	infolen = 0;
 	for (i = 0 ; i < numhashes ; ++i) {
+		tracker_info_t	*p = (tracker_info_t *)((char *)info + infolen);
+
 		infolen += sizeof(tracker_info_t) +
-			(info[i].numpeers * sizeof(*(info[i].peers)));
+			(p->numpeers * sizeof(p->peers[0]));
 	}
 
 	len = sizeof(tracker_unregister_t) + infolen;
@@ -257,6 +337,78 @@ unregister_hash(int sockfd, in_addr_t *ip, uint32_t numhashes,
 	return(0);
 }
 
+/*
+ * send one chunk of a manifest (the hashes of the files this host is going
+ * to ask for, in order) to a tracker: up to MANIFEST_CHUNK hashes starting
+ * at 'offset'. the tracker acks each chunk. like register_hash_ack(), the
+ * message is returned so the caller can match the ack to it and send it
+ * again with resend_msg(). the caller frees it.
+ */
+tracker_manifest_t *
+manifest_chunk(int sockfd, in_addr_t *ip, uint32_t offset, uint32_t numhashes,
+	uint64_t *hashes)
+{
+	tracker_manifest_t	*req;
+	uint32_t		n;
+	int			len;
+
+	n = min(numhashes - offset, MANIFEST_CHUNK);
+	len = sizeof(tracker_manifest_t) + (n * sizeof(uint64_t));
+
+	if ((req = (tracker_manifest_t *)malloc(len)) == NULL) {
+		logmsg("manifest_chunk:malloc failed\n");
+		return(NULL);
+	}
+
+	bzero(req, sizeof(tracker_manifest_t));
+	req->header.op = MANIFEST;
+	req->header.length = len;
+	req->header.seqno = seqno++;
+	req->offset = offset;
+	req->numhashes = n;
+
+	memcpy(req->hashes, &hashes[offset], n * sizeof(uint64_t));
+
+	resend_msg(sockfd, ip, (tracker_header_t *)req);
+	return(req);
+}
+
+/*
+ * send 'len' bytes of this host's timeline, starting at 'offset' in
+ * TIMELINE_FILE, to a tracker. the ack says where the tracker wants the
+ * next chunk to start. like manifest_chunk(), the message is returned and
+ * the caller frees it.
+ */
+tracker_timeline_t *
+timeline_chunk(int sockfd, in_addr_t *ip, uint32_t offset, char *lines,
+	uint32_t len)
+{
+	struct timeval		now;
+	tracker_timeline_t	*req;
+	int			reqlen;
+
+	reqlen = sizeof(tracker_timeline_t) + len;
+
+	if ((req = (tracker_timeline_t *)malloc(reqlen)) == NULL) {
+		logmsg("timeline_chunk:malloc failed\n");
+		return(NULL);
+	}
+
+	bzero(req, sizeof(tracker_timeline_t));
+	req->header.op = TIMELINE;
+	req->header.length = reqlen;
+	req->header.seqno = seqno++;
+	req->offset = offset;
+	req->length = len;
+	memcpy(req->lines, lines, len);
+
+	gettimeofday(&now, NULL);
+	req->sent = ((uint64_t)now.tv_sec * 1000000) + now.tv_usec;
+
+	resend_msg(sockfd, ip, (tracker_header_t *)req);
+	return(req);
+}
+
 int
 init(uint16_t *num_trackers, char *trackers_url, in_addr_t *trackers,
 	uint16_t *maxpeers, char *pkg_servers_url, uint16_t *num_pkg_servers,
@@ -348,3 +500,126 @@ send_msg(int sockfd, in_addr_t *ip, uint16_t op)
 	return(0);
 }
 
+
+/*
+ * consistent hashing of files onto trackers.
+ *
+ * every tracker is put on a ring of 64-bit points TRACKER_VNODES times.
+ * a file belongs to the tracker that owns the first point at or after
+ * the file's hash, and the next (different) trackers around the ring
+ * take over if that one doesn't answer. adding or removing a tracker
+ * only moves the files between it and its neighbors on the ring.
+ */
+typedef struct {
+	uint64_t	point;
+	int		tracker;	/* index into the trackers[] list */
+} ring_point_t;
+
+static ring_point_t	ring[MAX_TRACKERS * TRACKER_VNODES];
+static int		ringlen = 0;
+
+/*
+ * hashit() is mostly decided by the last few characters of a name. spread
+ * the bits out before a value goes on the ring.
+ */
+static uint64_t
+ringmix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return(x);
+}
+
+static int
+ringcmp(const void *a, const void *b)
+{
+	uint64_t	x = ((ring_point_t *)a)->point;
+	uint64_t	y = ((ring_point_t *)b)->point;
+
+	return(x < y ? -1 : (x > y ? 1 : 0));
+}
+
+void
+ring_init(uint16_t num_trackers, in_addr_t *trackers)
+{
+	struct in_addr	in;
+	char		buf[64];
+	int		i, j;
+
+	ringlen = 0;
+	for (i = 0 ; i < num_trackers ; ++i) {
+		in.s_addr = trackers[i];
+
+		for (j = 0 ; j < TRACKER_VNODES ; ++j) {
+			snprintf(buf, sizeof(buf), "%s#%d", inet_ntoa(in), j);
+
+			ring[ringlen].point = ringmix(hashit(buf));
+			ring[ringlen].tracker = i;
+			++ringlen;
+		}
+	}
+
+	qsort(ring, ringlen, sizeof(ring_point_t), ringcmp);
+}
+
+/*
+ * put the indexes of the trackers to ask about 'hash' in 'order', the
+ * owner first. without a ring, that's all the trackers in the order they
+ * were configured. returns the number of trackers.
+ */
+int
+ring_order(uint64_t hash, uint16_t num_trackers, int *order)
+{
+	uint64_t	point;
+	int		lo, hi, mid;
+	int		n, i, j;
+
+	if (ringlen == 0) {
+		for (i = 0 ; i < num_trackers ; ++i) {
+			order[i] = i;
+		}
+
+		return(num_trackers);
+	}
+
+	/*
+	 * the first point at or after the hash
+	 */
+	point = ringmix(hash);
+	lo = 0;
+	hi = ringlen;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (ring[mid].point < point) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/*
+	 * walk around the ring, picking up each tracker the first time we
+	 * see it
+	 */
+	n = 0;
+	for (i = 0 ; (i < ringlen) && (n < num_trackers) ; ++i) {
+		int	t = ring[(lo + i) % ringlen].tracker;
+
+		for (j = 0 ; j < n ; ++j) {
+			if (order[j] == t) {
+				break;
+			}
+		}
+
+		if (j == n) {
+			order[n++] = t;
+		}
+	}
+
+	return(n);
+}
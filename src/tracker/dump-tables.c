@@ -30,55 +30,269 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <curl/curl.h>
-#include <httpd/httpd.h>
 #include <netinet/in.h>
 #include "tracker.h"
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 
 static char builton[] = { "Built on: " __DATE__ " " __TIME__ };
 
-extern int init(uint16_t *, char *, in_addr_t *, uint16_t *, char *, uint16_t *,
-	in_addr_t *);
 extern int init_tracker_comm(int);
-extern int send_msg(int, in_addr_t *, uint16_t);
+extern int tracker_send(int, void *, size_t, struct sockaddr *, socklen_t);
 
-int
-main()
+/*
+ * print the peers of one hash on one line
+ */
+static void
+flushhash(int hashid, int ready, int downloading, char *peers)
 {
-	uint16_t	num_trackers;
-	in_addr_t	trackers[MAX_TRACKERS];
-	uint16_t	maxpeers;
-	uint16_t	num_pkg_servers;
-	in_addr_t	pkg_servers[MAX_PKG_SERVERS];
-	int		i;
-	int		sockfd;
-	char		trackers_url[256];
-	char		pkg_servers_url[256];
-
-	sprintf(trackers_url,"127.0.0.1");
-
-	sprintf(pkg_servers_url,"127.0.0.1");
-
-	fprintf(stderr, "main:trackers_url (%s)\n", trackers_url);
-	fprintf(stderr, "main:pkg_servers_url (%s)\n", pkg_servers_url);
-	
-	if (init(&num_trackers, trackers_url, trackers, &maxpeers,
-			pkg_servers_url, &num_pkg_servers, pkg_servers) != 0) {
-		fprintf(stderr, "main:init failed\n");
-		return(-1);
+	if (hashid < 0) {
+		return;
+	}
+
+	printf("%-8d %5d %5d  %s\n", hashid, ready, downloading, peers);
+}
+
+/*
+ * render a snapshot (see 'Table Snapshots' in server2.c)
+ */
+static void
+render(FILE *in)
+{
+	char	line[1024];
+	char	peers[4096];
+	char	ip[64], value[64], name[64];
+	char	section = '\0';
+	int	id, groupid, state;
+	int	hashid = -1, ready = 0, downloading = 0;
+	int	count = 0;
+
+	peers[0] = '\0';
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (line[0] != section) {
+			if (section == 'P') {
+				flushhash(hashid, ready, downloading, peers);
+			}
+
+			if (section != '\0') {
+				printf("(%d)\n\n", count);
+			}
+
+			section = line[0];
+			count = 0;
+
+			switch (section) {
+			case 'S':
+				printf("COUNTERS\n");
+				break;
+			case 'H':
+				printf("HOSTS\n%-8s %-16s %s\n", "ID", "IP",
+					"GROUPID");
+				break;
+			case 'F':
+				printf("HASHES\n%-8s %s\n", "ID", "HASH");
+				break;
+			case 'P':
+				printf("PEERS\n%-8s %5s %5s  %s\n", "HASHID",
+					"READY", "DOWN", "PEERS");
+				hashid = -1;
+				break;
+			}
+		}
+
+		switch (section) {
+		case 'S':
+			if (sscanf(line, "S,%63[^,],%63s", name, value) == 2) {
+				printf("%-24s %s\n", name, value);
+			}
+			break;
+
+		case 'H':
+			if (sscanf(line, "H,%d,%63[^,],%d", &id, ip,
+					&groupid) == 3) {
+				printf("%-8d %-16s %d\n", id, ip, groupid);
+			}
+			break;
+
+		case 'F':
+			if (sscanf(line, "F,%d,%63s", &id, value) == 2) {
+				printf("%-8d %s\n", id, value);
+			}
+			break;
+
+		case 'P':
+			if (sscanf(line, "P,%d,%63[^,],%d", &id, ip,
+					&state) != 3) {
+				break;
+			}
+
+			if (id != hashid) {
+				flushhash(hashid, ready, downloading, peers);
+				hashid = id;
+				ready = downloading = 0;
+				peers[0] = '\0';
+			}
+
+			if (state == DOWNLOADING) {
+				++downloading;
+				strcat(ip, "(d)");
+			} else {
+				++ready;
+			}
+
+			if (strlen(peers) + strlen(ip) + 2 < sizeof(peers)) {
+				if (peers[0] != '\0') {
+					strcat(peers, " ");
+				}
+				strcat(peers, ip);
+			}
+			break;
+		}
+
+		++count;
+	}
+
+	if (section == 'P') {
+		flushhash(hashid, ready, downloading, peers);
+	}
+
+	if (section != '\0') {
+		printf("(%d)\n", count);
+	}
+}
+
+/*
+ * ask a tracker for a snapshot and return a stream to read it from
+ */
+static FILE *
+getsnapshot(in_addr_t tracker)
+{
+	struct sockaddr_in	addr;
+	struct timeval		timeout;
+	tracker_dump_req_t	req;
+	socklen_t		addrlen;
+	fd_set			fds;
+	int			listenfd, fd;
+	int			sockfd;
+
+	/*
+	 * the tracker connects back to us on this port
+	 */
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("getsnapshot:socket");
+		return(NULL);
+	}
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = 0;
+
+	addrlen = sizeof(addr);
+	if ((bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+			(listen(listenfd, 1) != 0) ||
+			(getsockname(listenfd, (struct sockaddr *)&addr,
+				&addrlen) != 0)) {
+		perror("getsnapshot:bind");
+		return(NULL);
 	}
 
 	if ((sockfd = init_tracker_comm(0)) < 0) {
-		fprintf(stderr, "main:init_tracker_comm failed\n");
+		fprintf(stderr, "getsnapshot:init_tracker_comm failed\n");
+		return(NULL);
+	}
+
+	bzero(&req, sizeof(req));
+	req.header.op = DUMP_TABLES;
+	req.header.length = sizeof(req);
+	req.port = addr.sin_port;
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = tracker;
+	addr.sin_port = htons(TRACKER_PORT);
+
+	tracker_send(sockfd, (void *)&req, sizeof(req),
+		(struct sockaddr *)&addr, sizeof(addr));
+	close(sockfd);
+
+	FD_ZERO(&fds);
+	FD_SET(listenfd, &fds);
+	timeout.tv_sec = 10;
+	timeout.tv_usec = 0;
+
+	if (select(listenfd + 1, &fds, NULL, NULL, &timeout) <= 0) {
+		fprintf(stderr, "getsnapshot:no answer from the tracker\n");
+		return(NULL);
+	}
+
+	if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+		perror("getsnapshot:accept");
+		return(NULL);
+	}
+
+	close(listenfd);
+	return(fdopen(fd, "r"));
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: dump-tables [-t tracker] [-f snapshot] [-c]\n");
+	fprintf(stderr, "\t-t tracker\task this tracker (default 127.0.0.1)\n");
+	fprintf(stderr, "\t-f snapshot\trender a snapshot file instead\n");
+	fprintf(stderr, "\t-c\t\tprint the CSV as is\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE		*in;
+	in_addr_t	tracker;
+	char		*filename = NULL;
+	char		line[1024];
+	int		csv = 0;
+	int		c;
+
+	tracker = inet_addr("127.0.0.1");
+
+	while ((c = getopt(argc, argv, "t:f:c")) != -1) {
+		switch (c) {
+		case 't':
+			tracker = inet_addr(optarg);
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'c':
+			csv = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (filename != NULL) {
+		if ((in = fopen(filename, "r")) == NULL) {
+			perror(filename);
+			return(-1);
+		}
+	} else if ((in = getsnapshot(tracker)) == NULL) {
 		return(-1);
 	}
 
-	for (i = 0 ; i < num_trackers; ++i) {
-		send_msg(sockfd, &trackers[i], DUMP_TABLES);
+	if (csv) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			fputs(line, stdout);
+		}
+	} else {
+		render(in);
 	}
 
+	fclose(in);
 	return(0);
 }
-
@@ -0,0 +1,438 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * write the installer's manifest (see MANIFEST_FILE in tracker.h).
+ *
+ * the packages come from the %packages section of the kickstart file, in
+ * the order they are listed there. each one is looked up by name in the
+ * repository's primary metadata to get the path of its file. the
+ * metadata is fetched through the local web server, just like the
+ * installer fetches it, so it is cached and shared with the other peers
+ * as usual.
+ *
+ * the kickstart file doesn't list the dependencies the installer pulls
+ * in, and the installer's package backend installs the packages in its
+ * own order. so the manifest is a close guess, not the exact list: a
+ * LOOKUP for a file that isn't in it gets the hashid-order window, and
+ * the files that are predicted from it are all files the installer is
+ * going to ask for sooner or later.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <curl/curl.h>
+#include <zlib.h>
+#include "tracker.h"
+
+extern void logmsg(const char *, ...);
+
+#define	MANIFEST_REPOMD		"/tmp/tracker-repomd.xml"
+#define	MANIFEST_PRIMARY	"/tmp/tracker-primary.xml.gz"
+
+/*
+ * the repository if the kickstart file doesn't have a 'url' line, %s is
+ * the machine type
+ */
+#define	MANIFEST_REPO		"/install/rocks-dist/%s"
+
+typedef struct {
+	char	*name;
+	char	*arch;
+	char	*href;
+} package_t;
+
+static package_t	*packages = NULL;
+static int		numpackages = 0;
+
+/*
+ * get a file through the local web server
+ */
+static int
+fetch(char *path, char *dst)
+{
+	CURL	*curlhandle;
+	FILE	*file;
+	char	url[PATH_MAX];
+	int	retval;
+
+	if ((file = fopen(dst, "w")) == NULL) {
+		return(-1);
+	}
+
+	if ((curlhandle = curl_easy_init()) == NULL) {
+		fclose(file);
+		return(-1);
+	}
+
+	snprintf(url, sizeof(url), "http://127.0.0.1%s", path);
+
+	curl_easy_setopt(curlhandle, CURLOPT_URL, url);
+	curl_easy_setopt(curlhandle, CURLOPT_WRITEDATA, file);
+	curl_easy_setopt(curlhandle, CURLOPT_FAILONERROR, 1L);
+
+	retval = (curl_easy_perform(curlhandle) == CURLE_OK ? 0 : -1);
+
+	curl_easy_cleanup(curlhandle);
+
+	if ((fclose(file) != 0) || (retval != 0)) {
+		logmsg("manifest:fetch of %s failed\n", url);
+		unlink(dst);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * the value of 'attr="..."' in 'line', copied to 'value'
+ */
+static int
+attribute(char *line, char *attr, char *value, size_t len)
+{
+	char	*start, *end;
+
+	if ((start = strstr(line, attr)) == NULL) {
+		return(-1);
+	}
+
+	start += strlen(attr);
+	if ((end = strchr(start, '"')) == NULL) {
+		return(-1);
+	}
+
+	snprintf(value, len, "%.*s", (int)(end - start), start);
+	return(0);
+}
+
+/*
+ * the text between '<tag>' and '</tag>' in 'line', copied to 'value'
+ */
+static int
+element(char *line, char *tag, char *value, size_t len)
+{
+	char	*start, *end;
+
+	if ((start = strstr(line, tag)) == NULL) {
+		return(-1);
+	}
+
+	start += strlen(tag);
+	if ((end = strchr(start, '<')) == NULL) {
+		return(-1);
+	}
+
+	snprintf(value, len, "%.*s", (int)(end - start), start);
+	return(0);
+}
+
+/*
+ * the path of the primary metadata, from repomd.xml
+ */
+static int
+primarypath(char *repo, char *path, size_t len)
+{
+	FILE	*file;
+	char	line[1024];
+	char	href[PATH_MAX];
+	int	primary = 0;
+	int	retval = -1;
+
+	snprintf(path, len, "%s/repodata/repomd.xml", repo);
+	if (fetch(path, MANIFEST_REPOMD) != 0) {
+		return(-1);
+	}
+
+	if ((file = fopen(MANIFEST_REPOMD, "r")) == NULL) {
+		return(-1);
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strstr(line, "<data type=\"primary\">") != NULL) {
+			primary = 1;
+		} else if (strstr(line, "</data>") != NULL) {
+			primary = 0;
+		}
+
+		if (primary && (attribute(line, "<location href=\"", href,
+				sizeof(href)) == 0)) {
+			snprintf(path, len, "%s/%s", repo, href);
+			retval = 0;
+			break;
+		}
+	}
+
+	fclose(file);
+	unlink(MANIFEST_REPOMD);
+
+	return(retval);
+}
+
+/*
+ * read the name, arch and location of every package in the primary
+ * metadata. createrepo puts each element on a line of its own.
+ */
+static int
+readprimary(char *repo)
+{
+	package_t	*more, pkg;
+	gzFile		file;
+	char		path[PATH_MAX];
+	char		line[4096];
+	char		name[256];
+	char		arch[64];
+	char		href[PATH_MAX];
+	int		max = 0;
+
+	if ((primarypath(repo, path, sizeof(path)) != 0) ||
+			(fetch(path, MANIFEST_PRIMARY) != 0)) {
+		return(-1);
+	}
+
+	if ((file = gzopen(MANIFEST_PRIMARY, "r")) == NULL) {
+		unlink(MANIFEST_PRIMARY);
+		return(-1);
+	}
+
+	name[0] = arch[0] = href[0] = '\0';
+
+	while (gzgets(file, line, sizeof(line)) != NULL) {
+		if (strstr(line, "<package ") != NULL) {
+			name[0] = arch[0] = href[0] = '\0';
+			continue;
+		}
+
+		if ((element(line, "<name>", name, sizeof(name)) == 0) ||
+				(element(line, "<arch>", arch,
+					sizeof(arch)) == 0) ||
+				(attribute(line, "<location href=\"", href,
+					sizeof(href)) == 0)) {
+			continue;
+		}
+
+		if ((strstr(line, "</package>") == NULL) ||
+				(name[0] == '\0') || (href[0] == '\0')) {
+			continue;
+		}
+
+		if (numpackages == max) {
+			max = (max ? max * 2 : 4096);
+			if ((more = (package_t *)realloc(packages,
+					max * sizeof(package_t))) == NULL) {
+				break;
+			}
+			packages = more;
+		}
+
+		pkg.name = strdup(name);
+		pkg.arch = strdup(arch);
+
+		snprintf(path, sizeof(path), "%s/%s", repo, href);
+		pkg.href = strdup(path);
+
+		if ((pkg.name == NULL) || (pkg.arch == NULL) ||
+				(pkg.href == NULL)) {
+			break;
+		}
+
+		packages[numpackages++] = pkg;
+	}
+
+	gzclose(file);
+	unlink(MANIFEST_PRIMARY);
+
+	return(numpackages > 0 ? 0 : -1);
+}
+
+/*
+ * can a package of 'arch' be installed on this machine
+ */
+static int
+archok(char *arch, char *machine)
+{
+	if ((strcmp(arch, "noarch") == 0) || (strcmp(arch, machine) == 0)) {
+		return(1);
+	}
+
+	/*
+	 * i386 ... i686
+	 */
+	if ((arch[0] == 'i') && (machine[0] == 'i') &&
+			(strcmp(&arch[2], "86") == 0) &&
+			(strcmp(&machine[2], "86") == 0)) {
+		return(arch[1] <= machine[1]);
+	}
+
+	return(0);
+}
+
+/*
+ * write the files of the package 'want' (a name, or name.arch) to 'out'
+ */
+static int
+addpackage(FILE *out, char *want, char *machine)
+{
+	char	namearch[PATH_MAX];
+	int	i, n = 0;
+
+	for (i = 0 ; i < numpackages ; ++i) {
+		if (strcmp(packages[i].name, want) == 0) {
+			if (!archok(packages[i].arch, machine)) {
+				continue;
+			}
+		} else {
+			snprintf(namearch, sizeof(namearch), "%s.%s",
+				packages[i].name, packages[i].arch);
+			if (strcmp(namearch, want) != 0) {
+				continue;
+			}
+		}
+
+		fprintf(out, "%s\n", packages[i].href);
+		++n;
+	}
+
+	return(n);
+}
+
+/*
+ * write the name of every package to NAMES_FILE
+ */
+static int
+writenames()
+{
+	FILE	*out;
+	char	tmp[PATH_MAX];
+	int	i;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", NAMES_FILE, (int)getpid());
+	if ((out = fopen(tmp, "w")) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0 ; i < numpackages ; ++i) {
+		fprintf(out, "%s\n", packages[i].href);
+	}
+
+	if ((fclose(out) != 0) || (rename(tmp, NAMES_FILE) != 0)) {
+		unlink(tmp);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * write MANIFEST_FILE, and NAMES_FILE. returns 0 if the manifest was
+ * written.
+ */
+int
+makemanifest()
+{
+	struct utsname	uts;
+	FILE		*ks, *out;
+	char		line[1024];
+	char		repo[PATH_MAX];
+	char		tmp[PATH_MAX];
+	char		*start, *ptr;
+	int		inpackages = 0;
+	int		n = 0;
+
+	if (uname(&uts) != 0) {
+		return(-1);
+	}
+
+	if ((ks = fopen(KICKSTART_FILE, "r")) == NULL) {
+		return(-1);
+	}
+
+	/*
+	 * the path of the repository, from 'url --url http://host/path'
+	 */
+	snprintf(repo, sizeof(repo), MANIFEST_REPO, uts.machine);
+
+	while (fgets(line, sizeof(line), ks) != NULL) {
+		if ((strncmp(line, "url ", 4) == 0) &&
+				((start = strstr(line, "://")) != NULL) &&
+				((start = strchr(start + 3, '/')) != NULL)) {
+			snprintf(repo, sizeof(repo), "%s", start);
+			repo[strcspn(repo, " \t\r\n")] = '\0';
+			break;
+		}
+	}
+
+	while (((ptr = rindex(repo, '/')) != NULL) && (ptr[1] == '\0')) {
+		*ptr = '\0';
+	}
+
+	if (readprimary(repo) != 0) {
+		logmsg("manifest:no package list for %s\n", repo);
+		fclose(ks);
+		return(-1);
+	}
+
+	if (writenames() != 0) {
+		logmsg("manifest:writing %s failed\n", NAMES_FILE);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", MANIFEST_FILE, (int)getpid());
+	if ((out = fopen(tmp, "w")) == NULL) {
+		fclose(ks);
+		return(-1);
+	}
+
+	rewind(ks);
+	while (fgets(line, sizeof(line), ks) != NULL) {
+		if (line[0] == '%') {
+			inpackages = (strncmp(line, "%packages", 9) == 0);
+			continue;
+		}
+
+		if (!inpackages) {
+			continue;
+		}
+
+		/*
+		 * one package per line. skip groups (@...), excluded
+		 * packages (-...) and comments.
+		 */
+		for (start = line ; isspace(*start) ; ++start)
+			;
+		start[strcspn(start, " \t\r\n")] = '\0';
+
+		if ((*start == '\0') || (*start == '#') || (*start == '@') ||
+				(*start == '-')) {
+			continue;
+		}
+
+		n += addpackage(out, start, uts.machine);
+	}
+
+	fclose(ks);
+
+	if ((fclose(out) != 0) || (n == 0) ||
+			(rename(tmp, MANIFEST_FILE) != 0)) {
+		unlink(tmp);
+		return(-1);
+	}
+
+	logmsg("manifest:%d files from %s\n", n, repo);
+	return(0);
+}
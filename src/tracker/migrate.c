@@ -0,0 +1,471 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * relocate the ramdisk /install cache to /mnt/sysimage/install.
+ *
+ * the move is done by a background process so the fastcgi loop never
+ * blocks on it. each file is copied (or hard linked, if the two trees
+ * happen to be on the same file system) to a temporary name in the
+ * destination and atomically renamed into place. then the ramdisk copy is
+ * atomically replaced by a symbolic link to the new one. peers fetch
+ * /install/... straight from lighttpd, so a file never goes missing from
+ * /install while it moves, and the ramdisk memory is given back one file
+ * at a time.
+ *
+ * when all the files have been moved, /install is swapped for a symbolic
+ * link to /mnt/sysimage/install.
+ *
+ * lighttpd runs several tracker-client processes. the first one that sees
+ * the file systems starts the one migration for all of them: it creates
+ * MIGRATE_MARKER and its migration process holds a lock on it until the
+ * swap is done. the other processes look at the marker to know where new
+ * files go and when the migration has finished.
+ */
+
+#define	_XOPEN_SOURCE	500
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern void logmsg(const char *, ...);
+extern int createdir(char *);
+
+#define	MIGRATE_SRC		"/install"
+#define	MIGRATE_DSTROOT		"/mnt/sysimage"
+#define	MIGRATE_DST		"/mnt/sysimage/install"
+#define	MIGRATE_WORKERS		4
+#define	MIGRATE_MARKER		"/tmp/tracker-migrate"
+
+/*
+ * migration states
+ */
+#define	MIGRATE_IDLE		0
+#define	MIGRATE_RUNNING		1
+#define	MIGRATE_DONE		2
+
+static int	migrate_state = MIGRATE_IDLE;
+static pid_t	migrate_pid = -1;
+
+/*
+ * used by the nftw() callbacks in the worker processes
+ */
+static int	worker_id;
+static int	worker_count;
+static int	file_index;
+
+static int
+copyfile(const char *src, const char *dst)
+{
+	char	buf[128*1024];
+	ssize_t	i;
+	int	in, out;
+
+	if ((in = open(src, O_RDONLY)) < 0) {
+		return(-1);
+	}
+
+	if ((out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		close(in);
+		return(-1);
+	}
+
+	while ((i = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, i) != i) {
+			i = -1;
+			break;
+		}
+	}
+
+	close(in);
+	if (close(out) != 0) {
+		i = -1;
+	}
+
+	if (i < 0) {
+		unlink(dst);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * atomically replace the ramdisk copy of a file with a symbolic link to
+ * the disk copy. if that fails, the ramdisk copy stays until the swap.
+ */
+static int
+linkback(const char *src, const char *dst)
+{
+	char	tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.migrate.%d", src, (int)getpid());
+	unlink(tmp);
+
+	if (symlink(dst, tmp) != 0) {
+		logmsg("migrate:symlink of %s failed:errno (%d)\n", src, errno);
+		return(-1);
+	}
+
+	if (rename(tmp, src) != 0) {
+		logmsg("migrate:rename of %s failed:errno (%d)\n", tmp, errno);
+		unlink(tmp);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * move one file from the ramdisk to the disk. the file shows up in the
+ * destination under its real name only after it is complete.
+ */
+static int
+movefile(const char *src)
+{
+	struct stat	buf;
+	char		dst[PATH_MAX];
+	char		tmp[PATH_MAX];
+	char		*ptr;
+
+	if (snprintf(dst, sizeof(dst), "%s%s", MIGRATE_DSTROOT, src) >=
+			sizeof(dst)) {
+		return(-1);
+	}
+
+	/*
+	 * the fastcgi loop writes new downloads straight into the
+	 * destination once a migration has started. if the file is already
+	 * there, the ramdisk copy is not needed anymore.
+	 */
+	if (stat(dst, &buf) == 0) {
+		return(linkback(src, dst));
+	}
+
+	if ((ptr = rindex(dst, '/')) != NULL) {
+		*ptr = '\0';
+		if (stat(dst, &buf) != 0) {
+			createdir(dst);
+		}
+		*ptr = '/';
+	}
+
+	if (link(src, dst) == 0) {
+		return(linkback(src, dst));
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.migrate.%d", dst, (int)getpid());
+
+	if (copyfile(src, tmp) != 0) {
+		logmsg("migrate:copy of %s failed:errno (%d)\n", src, errno);
+		return(-1);
+	}
+
+	if (rename(tmp, dst) != 0) {
+		logmsg("migrate:rename of %s failed:errno (%d)\n", tmp, errno);
+		unlink(tmp);
+		return(-1);
+	}
+
+	return(linkback(src, dst));
+}
+
+static int
+migrate_file(const char *path, const struct stat *sb, int flag,
+	struct FTW *ftwbuf)
+{
+	if (flag != FTW_F) {
+		return(0);
+	}
+
+	/*
+	 * each worker takes every 'worker_count'th file
+	 */
+	if ((file_index++ % worker_count) == worker_id) {
+		movefile(path);
+	}
+
+	return(0);
+}
+
+/*
+ * clean up the old ramdisk tree after the swap. only the symbolic links
+ * the move left behind are removed, a file that could not be moved stays.
+ */
+static int
+remove_old(const char *path, const struct stat *sb, int flag,
+	struct FTW *ftwbuf)
+{
+	if (flag == FTW_SL) {
+		unlink(path);
+	} else if (flag == FTW_DP) {
+		rmdir(path);
+	}
+
+	return(0);
+}
+
+/*
+ * the body of the background migration process
+ */
+static void
+migrate_all()
+{
+	struct stat	buf;
+	pid_t		workers[MIGRATE_WORKERS];
+	int		i, s;
+
+	for (i = 0 ; i < MIGRATE_WORKERS ; ++i) {
+		if ((workers[i] = fork()) == 0) {
+			worker_id = i;
+			worker_count = MIGRATE_WORKERS;
+			file_index = 0;
+
+			nftw(MIGRATE_SRC, migrate_file, 16, FTW_PHYS);
+			_exit(0);
+		}
+	}
+
+	for (i = 0 ; i < MIGRATE_WORKERS ; ++i) {
+		if (workers[i] > 0) {
+			waitpid(workers[i], &s, 0);
+		}
+	}
+
+	/*
+	 * a worker may have left a file behind (e.g., a copy failed).
+	 * sweep up anything that is still on the ramdisk in this process.
+	 */
+	worker_id = 0;
+	worker_count = 1;
+	file_index = 0;
+	nftw(MIGRATE_SRC, migrate_file, 16, FTW_PHYS);
+
+	/*
+	 * all the files are on the disk. swap /install for a symbolic link.
+	 */
+	unlink(MIGRATE_SRC ".new");
+	if (symlink(MIGRATE_DST, MIGRATE_SRC ".new") != 0) {
+		logmsg("migrate:symlink failed:errno (%d)\n", errno);
+		_exit(1);
+	}
+
+	if ((lstat(MIGRATE_SRC, &buf) == 0) && S_ISDIR(buf.st_mode)) {
+		if (rename(MIGRATE_SRC, MIGRATE_SRC ".old") != 0) {
+			logmsg("migrate:rename of %s failed:errno (%d)\n",
+				MIGRATE_SRC, errno);
+			unlink(MIGRATE_SRC ".new");
+			_exit(1);
+		}
+	}
+
+	if (rename(MIGRATE_SRC ".new", MIGRATE_SRC) != 0) {
+		logmsg("migrate:rename of %s.new failed:errno (%d)\n",
+			MIGRATE_SRC, errno);
+		rename(MIGRATE_SRC ".old", MIGRATE_SRC);
+		_exit(1);
+	}
+
+	nftw(MIGRATE_SRC ".old", remove_old, 16, FTW_PHYS|FTW_DEPTH);
+	_exit(0);
+}
+
+/*
+ * notice a migration that another tracker-client process started
+ */
+static void
+migrate_check()
+{
+	struct stat	buf;
+
+	if ((migrate_state == MIGRATE_IDLE) &&
+			(stat(MIGRATE_MARKER, &buf) == 0)) {
+		migrate_state = MIGRATE_RUNNING;
+	}
+}
+
+/*
+ * the migration is done once nobody holds the lock on the marker
+ */
+static int
+migrate_finished()
+{
+	int	fd;
+	int	done;
+
+	if ((fd = open(MIGRATE_MARKER, O_RDONLY)) < 0) {
+		return(1);
+	}
+
+	done = (flock(fd, LOCK_SH|LOCK_NB) == 0);
+
+	close(fd);
+	return(done);
+}
+
+/*
+ * create the marker, locked. returns -1 if another process got there
+ * first. the lock goes with the open file, so the migration process
+ * keeps holding it after the fork.
+ */
+static int
+migrate_claim()
+{
+	char	tmp[PATH_MAX];
+	int	fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", MIGRATE_MARKER, (int)getpid());
+
+	if ((fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+		logmsg("migrate_claim:open failed:errno (%d)\n", errno);
+		return(-1);
+	}
+
+	if ((flock(fd, LOCK_EX) != 0) || (link(tmp, MIGRATE_MARKER) != 0)) {
+		unlink(tmp);
+		close(fd);
+		return(-1);
+	}
+
+	unlink(tmp);
+	return(fd);
+}
+
+/*
+ * called before every download. starts the migration once the file
+ * systems have been formatted and notices when it has finished.
+ */
+void
+migrate_poll()
+{
+	struct stat	buf;
+	int		fd;
+	int		s;
+
+	migrate_check();
+
+	switch (migrate_state) {
+	case MIGRATE_IDLE:
+		if (stat(MIGRATE_DSTROOT, &buf) != 0) {
+			return;
+		}
+
+		if (stat(MIGRATE_DST, &buf) != 0) {
+			mkdir(MIGRATE_DST, 0755);
+		}
+
+		if ((lstat(MIGRATE_SRC, &buf) != 0) || S_ISLNK(buf.st_mode)) {
+			/*
+			 * nothing on the ramdisk to move
+			 */
+			if (lstat(MIGRATE_SRC, &buf) != 0) {
+				symlink(MIGRATE_DST, MIGRATE_SRC);
+			}
+
+			migrate_state = MIGRATE_DONE;
+			return;
+		}
+
+		if ((fd = migrate_claim()) < 0) {
+			/*
+			 * another process is moving the files
+			 */
+			migrate_check();
+			return;
+		}
+
+		if ((migrate_pid = fork()) < 0) {
+			logmsg("migrate_poll:fork failed:errno (%d)\n", errno);
+			unlink(MIGRATE_MARKER);
+			close(fd);
+			return;
+		}
+
+		if (migrate_pid == 0) {
+			signal(SIGCHLD, SIG_DFL);
+			migrate_all();
+		}
+
+		close(fd);
+
+		logmsg("migrate_poll:started migration pid %d\n",
+			(int)migrate_pid);
+		migrate_state = MIGRATE_RUNNING;
+		break;
+
+	case MIGRATE_RUNNING:
+		if ((migrate_pid > 0) &&
+				(waitpid(migrate_pid, &s, WNOHANG) == migrate_pid)) {
+			logmsg("migrate_poll:migration done:status (%d)\n", s);
+			migrate_pid = -1;
+		}
+
+		if (migrate_finished()) {
+			migrate_state = MIGRATE_DONE;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * once this is set, new files don't go to the ramdisk anymore
+ */
+int
+migrate_started()
+{
+	migrate_check();
+	return(migrate_state != MIGRATE_IDLE);
+}
+
+/*
+ * map a name under /install to the place the file actually lives.
+ *
+ * a file that is being read is served from whichever tree has a complete
+ * copy of it. once a migration has started, new files are always written
+ * to the disk.
+ */
+char *
+migrate_path(char *filename, char *path, size_t len, int forwrite)
+{
+	struct stat	buf;
+
+	migrate_check();
+
+	if ((migrate_state == MIGRATE_IDLE) ||
+			(strncmp(filename, MIGRATE_SRC "/",
+				strlen(MIGRATE_SRC "/")) != 0)) {
+		snprintf(path, len, "%s", filename);
+		return(path);
+	}
+
+	snprintf(path, len, "%s%s", MIGRATE_DSTROOT, filename);
+
+	if (forwrite || (stat(path, &buf) == 0)) {
+		return(path);
+	}
+
+	snprintf(path, len, "%s", filename);
+	return(path);
+}
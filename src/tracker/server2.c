@@ -6,13 +6,26 @@
 #include <sys/time.h>
 #include "tracker.h"
 
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <sys/wait.h>
 
 #include "sqlite3.h"
 static char builton[] = { "Built on: " __DATE__ " " __TIME__ };
 
+int garbageCollect(sqlite3 *db);
+void lookupCacheInvalidate(int hashid);
+void inflightDone(int hashid, int hostid);
+void inflightDropHost(int hostid);
+void invalidateHashids(sqlite3 *db, char *sqlStmt);
+void hotSupply(uint64_t hash);
+
 
 
 /* -------------------------------------------- */
@@ -132,7 +145,8 @@ int hostid = 0;
 	/* Don't add if already there */
 	if ( (hostid = hostExists(db, ip)))
 		return hostid;
-	sprintf(sqlStmt, "INSERT INTO hosts(hostid,ip,groupid) values(NULL,%d,0)", ip);
+	sprintf(sqlStmt, "INSERT INTO hosts(hostid,ip,groupid) values(NULL,%d,%d)", ip,
+		topology_group((in_addr_t) ip));
 	sql_stmt(db,sqlStmt);
 	return hostExists(db,ip);
 
@@ -144,6 +158,11 @@ char sqlStmt[256];
 int hostid = 0;
 	if ( (hostid = hostExists(db, ip))  <= 0 )
 		return 0;
+	/* every hash the host had a copy of changes */
+	sprintf(sqlStmt, "SELECT hashid FROM peers WHERE hostid=%d",hostid);
+	invalidateHashids(db,sqlStmt);
+	/* its claims go with its rows, the hostid can be handed out again */
+	inflightDropHost(hostid);
 	/* delete host from peers table */
 	sprintf(sqlStmt, "DELETE FROM peers WHERE hostid=%d",hostid);
 	sql_stmt(db,sqlStmt);
@@ -189,6 +208,7 @@ char sqlStmt[256];
 int hashid = 0;
 	if ( (hashid = hashExists(db, hash)) <= 0)
 		return 0;
+	lookupCacheInvalidate(hashid);
 	/* delete hash from peers table */
 	sprintf(sqlStmt, "DELETE FROM peers WHERE hashid=%d",hashid);
 	sql_stmt(db,sqlStmt);
@@ -202,6 +222,11 @@ int hashid = 0;
 /* --        Peer Table Routines             -- */         
 /* -------------------------------------------- */
 
+/* registrations that were already there (e.g., a REGISTER batch that
+   was sent again) and acks sent for REGISTER_ACK batches */
+static unsigned long long	registerDups = 0;
+static unsigned long long	registerAcks = 0;
+
 /* --- registerPeer --- */
 int registerPeer(sqlite3 *db, uint64_t hash, int ip) {
 char sqlStmt[256];
@@ -212,98 +237,437 @@ int hostid = 0;
 	hashid = addHash(db,hash);
 
 	/* check if registered */
-	sprintf(sqlStmt, "SELECT hashid FROM peers WHERE hashid=%d and hostid=%d", hashid, hostid);
-	if ( getIntValue(db,sqlStmt) )
+	sprintf(sqlStmt, "SELECT state FROM peers WHERE hashid=%d and hostid=%d", hashid, hostid);
+	switch (getIntValue(db,sqlStmt))
+	{
+	case 0:
+		break;
+	case DOWNLOADING:
+		/* the host got the file it was fetching */
+		inflightDone(hashid, hostid);
+		sprintf(sqlStmt, "UPDATE peers SET state=%d WHERE hashid=%d and hostid=%d", READY, hashid, hostid);
+		sql_stmt(db,sqlStmt);
+		lookupCacheInvalidate(hashid);
+		hotSupply(hash);
+		return 0;
+	default:
+		registerDups++;
 		return 0;
-	sprintf(sqlStmt, "INSERT INTO PEERS(hashid, hostid, state) VALUES(%d,%d,'r')", hashid, hostid);
+	}
+	sprintf(sqlStmt, "INSERT INTO PEERS(hashid, hostid, state) VALUES(%d,%d,%d)", hashid, hostid, READY);
 
 	sql_stmt(db,sqlStmt);
+	lookupCacheInvalidate(hashid);
+	hotSupply(hash);
 	return 0;
 }
 
-/* -- Randomly Copy Peers -- */
-int
-randomCopyPeers(peer_t *dstpeers, peer_t *srcpeers, int npeers, int maxpeers)
+/* -------------------------------------------- */
+/* --          Host Lease Routines           -- */         
+/* -------------------------------------------- */
+/* A host's entries in the peers table are only good for as long as the
+   host holds a lease. Any LOOKUP, REGISTER or KEEPALIVE from the host
+   renews it. When a lease runs out (e.g., the host crashed or rebooted
+   in the middle of an install), the host is removed, so clients are no
+   longer sent to a peer that isn't there. Expiry is driven by the timer
+   wheel in timer.c */
+
+#define	LEASE_BUCKETS	1024
+
+typedef struct lease {
+	in_addr_t	ip;
+	tracker_timer_t	timer;
+	uint64_t	*manifest;	/* files the host will ask for */
+	uint32_t	manifestlen;
+	uint32_t	cursor;		/* next file in the manifest */
+	unsigned int	load;		/* times handed out as a peer */
+	time_t		lasthint;	/* when it was last sent hot files */
+	uint32_t	timelineoff;	/* next byte of the host's timeline */
+	struct lease	*next;
+} lease_t;
+
+static lease_t	*leases[LEASE_BUCKETS];
+static sqlite3	*lease_db;
+
+static lease_t **
+leaseBucket(in_addr_t ip)
 {
-int start;
-int count;
-int bottomcopy, topcopy;
-	if (npeers <= 0)
-		return npeers;
+	return &leases[ntohl(ip) % LEASE_BUCKETS];
+}
+
+/* --- forget a lease, leave the tables alone --- */
+void leaseDrop(in_addr_t ip) {
+lease_t **prev;
+lease_t *lease;
+	for (prev = leaseBucket(ip); (lease = *prev) != NULL; prev = &lease->next)
+	{
+		if (lease->ip == ip)
+		{
+			*prev = lease->next;
+			timer_del(&lease->timer);
+			if (lease->manifest != NULL)
+				free(lease->manifest);
+			free(lease);
+			return;
+		}
+	}
+}
 
-       /* Copy at most maxpeers from src to dest, starting at a random index
-          in the srcpeers array.   Take care of wrap */ 
+/* --- timer callback: the host went away --- */
+void leaseExpired(void *arg) {
+lease_t *lease = (lease_t *)arg;
+struct in_addr in;
+in_addr_t ip = lease->ip;
 
-	count = min(npeers,maxpeers);
+	in.s_addr = ip;
+	fprintf(stderr, "lease expired for (%s)\n", inet_ntoa(in));
 
-	/* pick a random starting index [0, npeers -1] */
-	start = rand() % npeers;
+	leaseDrop(ip);
+	deleteHost(lease_db, (int) ip);
+	garbageCollect(lease_db);
+}
 
-	if ( (start + count) >= npeers ) /* Wrap */
+/* --- find the lease of a host --- */
+lease_t *leaseFind(in_addr_t ip) {
+lease_t *lease;
+	for (lease = *leaseBucket(ip); lease != NULL; lease = lease->next)
 	{
-		bottomcopy=npeers-start;
-		topcopy=count-bottomcopy;
+		if (lease->ip == ip)
+			break;
 	}
-	else  /* No Wrap */
+	return lease;
+}
+
+/* --- start or renew the lease of a host --- */
+lease_t *leaseRenew(in_addr_t ip) {
+lease_t *lease;
+	if ((lease = leaseFind(ip)) == NULL)
 	{
-		bottomcopy=count;
-		topcopy=0;
+		if ((lease = (lease_t *)calloc(1, sizeof(lease_t))) == NULL)
+			return NULL;
+		lease->ip = ip;
+		lease->timer.func = leaseExpired;
+		lease->timer.arg = lease;
+		lease->next = *leaseBucket(ip);
+		*leaseBucket(ip) = lease;
 	}
 
-	/* copy the bottom part of src array */
-	memcpy(dstpeers, &srcpeers[start], (bottomcopy)*sizeof(peer_t));
-
-	/* copy top part of src array */
-	if (topcopy > 0)
-		memcpy(&dstpeers[bottomcopy], srcpeers, 
-				topcopy*sizeof(peer_t));
-	return count;
+	timer_add(&lease->timer, LEASE_TTL * 1000);
+	return lease;
 }
 
-/* -- dolookup(): lookup peers for hashes -- */
-void
-dolookup(sqlite3 *db, int sockfd, uint64_t hash, uint32_t seqno,
-	struct sockaddr_in *from_addr)
+/* -------------------------------------------- */
+/* --        In-flight Download Routines     -- */         
+/* -------------------------------------------- */
+/* When a LOOKUP finds no peers for a file, the requestor is going to get
+   it from a package server. Rather than send everyone else that asks for
+   the file in the next few seconds to the package servers too, list the
+   requestor as a DOWNLOADING peer of the file. Those hosts then wait for
+   the file to show up on the requestor (see getremote() in
+   tracker-client.c). The claim is dropped if the requestor hasn't
+   registered the file after INFLIGHT_TTL seconds. */
+
+#define	INFLIGHT_BUCKETS	1024
+
+typedef struct inflight {
+	int		hashid;
+	int		hostid;
+	tracker_timer_t	timer;
+	struct inflight	*next;
+} inflight_t;
+
+static inflight_t	*inflights[INFLIGHT_BUCKETS];
+
+static inflight_t **
+inflightBucket(int hashid)
 {
-tracker_lookup_resp_t	*resp;
-tracker_info_t		*respinfo;
-size_t			len;
-int			flags;
-int			npeers;
-char			buf[64*1024];
+	return &inflights[(unsigned int) hashid % INFLIGHT_BUCKETS];
+}
+
+/* --- forget a claim, leave the tables alone --- */
+void inflightDone(int hashid, int hostid) {
+inflight_t **prev;
+inflight_t *claim;
+	for (prev = inflightBucket(hashid); (claim = *prev) != NULL; 
+			prev = &claim->next)
+	{
+		if (claim->hashid == hashid && claim->hostid == hostid)
+		{
+			*prev = claim->next;
+			timer_del(&claim->timer);
+			free(claim);
+			return;
+		}
+	}
+}
+
+/* --- forget every claim of a host, leave the tables alone --- */
+void inflightDropHost(int hostid) {
+inflight_t **prev;
+inflight_t *claim;
+int i;
+	for (i = 0; i < INFLIGHT_BUCKETS; i++)
+	{
+		prev = &inflights[i];
+		while ((claim = *prev) != NULL)
+		{
+			if (claim->hostid == hostid)
+			{
+				*prev = claim->next;
+				timer_del(&claim->timer);
+				free(claim);
+			}
+			else
+				prev = &claim->next;
+		}
+	}
+}
+
+/* --- timer callback: the host never registered the file --- */
+void inflightExpired(void *arg) {
+inflight_t *claim = (inflight_t *)arg;
 char sqlStmt[256];
-peer_t			peers[MAX_SHUFFLE_PEERS];
-sqlite3_stmt *preppedStmt; 
-int rcode, sqlCode;
-int ip, hashid, state;
-int peercount, thisid;
+	sprintf(sqlStmt, "DELETE FROM peers WHERE hashid=%d and hostid=%d and state=%d", claim->hashid, claim->hostid, DOWNLOADING);
+	sql_stmt(lease_db,sqlStmt);
+	lookupCacheInvalidate(claim->hashid);
+	inflightDone(claim->hashid, claim->hostid);
+}
 
-	/* -- Response Header -- */
-	resp = (tracker_lookup_resp_t *)buf;
-	resp->header.op = LOOKUP;
-	resp->header.seqno = seqno;
+/* --- list a host as fetching a hash --- */
+void inflightClaim(sqlite3 *db, uint64_t hash, int ip) {
+inflight_t *claim;
+char sqlStmt[256];
+int hashid, hostid;
+	hostid = addHost(db,ip);
+	hashid = addHash(db,hash);
 
-	/*
-	 * keep a running count for the length of the data
-	 */
-	len = sizeof(tracker_lookup_resp_t);
+	sprintf(sqlStmt, "SELECT hashid FROM peers WHERE hashid=%d and hostid=%d", hashid, hostid);
+	if ( getIntValue(db,sqlStmt) )
+		return;
 
-	/*
-	 * look up info for this hash
-	 */
-	respinfo = (tracker_info_t *)resp->info;
-	respinfo->hash = hash;
-	resp->numhashes = 1;   /* always return this hash, even if no peers */
+	if ((claim = (inflight_t *)calloc(1, sizeof(inflight_t))) == NULL)
+		return;
 
-	len += sizeof(tracker_info_t);
+	sprintf(sqlStmt, "INSERT INTO PEERS(hashid, hostid, state) VALUES(%d,%d,%d)", hashid, hostid, DOWNLOADING);
+	sql_stmt(db,sqlStmt);
+	lookupCacheInvalidate(hashid);
+
+	claim->hashid = hashid;
+	claim->hostid = hostid;
+	claim->timer.func = inflightExpired;
+	claim->timer.arg = claim;
+	claim->next = *inflightBucket(hashid);
+	*inflightBucket(hashid) = claim;
+	timer_add(&claim->timer, INFLIGHT_TTL * 1000);
+}
+
+/* -------------------------------------------- */
+/* --          LOOKUP Response Cache         -- */         
+/* -------------------------------------------- */
+/* Building a LOOKUP response takes a join over the prediction window and
+   a hashidToHash() for every predicted hash. During a mass reinstall
+   thousands of hosts ask for the same hashes within seconds, so the
+   window built for a hash is kept here, keyed by the hash, and reused
+   until a peer of one of the hashes in the window changes.
+
+   Every hashid has a version that is bumped when one of its peers
+   changes (REGISTER, UNREGISTER, PEER_DONE, an expired claim or lease).
+   A window keeps the versions of the PREDICTIONS hashids it covers as
+   they were when it was built, and a LOOKUP only reuses it if none of
+   them moved. So a change costs one increment, however many windows
+   cover the hashid, and only the windows that really cover it are
+   rebuilt, the next time they are asked for.
+
+   The peers of each hash are shuffled once, when the window is built.
+   Each response after that starts the copy at the next peer in the list
+   (the 'rotor'), so successive requestors are still spread over all the
+   peers without going back to the database. */
+
+#define	LOOKUP_CACHE_BUCKETS	4096
+#define	LOOKUP_CACHE_ENTRIES	4096
+#define	LOOKUP_CACHE_STATS	60	/* seconds between stats messages */
+
+typedef struct lookup_cache {
+	uint64_t		hash;		/* the hash that was asked for */
+	int			hashid;		/* first hashid in the window */
+	int			numhashes;
+	unsigned int		rotor;
+	hash_info_t		info[PREDICTIONS];
+	unsigned int		versions[PREDICTIONS];	/* of each hashid */
+	struct lookup_cache	*hashnext;	/* chain by hash */
+	struct lookup_cache	*lrunext;
+	struct lookup_cache	*lruprev;
+} lookup_cache_t;
+
+static lookup_cache_t	*cacheByHash[LOOKUP_CACHE_BUCKETS];
+static lookup_cache_t	cacheLru = { 0 };	/* head, most recent first */
+static int		cacheEntries = 0;
+static unsigned int	*hashVersions = NULL;	/* indexed by hashid */
+static int		hashVersionsLen = 0;
+
+static unsigned long long	cacheHits = 0;
+static unsigned long long	cacheMisses = 0;
+static unsigned long long	cacheDrops = 0;
+static tracker_timer_t		cacheStatsTimer;
+
+static lookup_cache_t **
+cacheHashBucket(uint64_t hash)
+{
+	return &cacheByHash[(hash ^ (hash >> 32)) % LOOKUP_CACHE_BUCKETS];
+}
+
+/* --- unlink an entry from all the lists and free it --- */
+static void
+cacheFree(lookup_cache_t *entry)
+{
+lookup_cache_t **prev;
+	for (prev = cacheHashBucket(entry->hash); *prev != NULL; 
+			prev = &(*prev)->hashnext)
+	{
+		if (*prev == entry)
+		{
+			*prev = entry->hashnext;
+			break;
+		}
+	}
+	entry->lruprev->lrunext = entry->lrunext;
+	entry->lrunext->lruprev = entry->lruprev;
+
+	/* all the peer lists are in one block, see cacheFill() */
+	free(entry->info[0].peers);
+	free(entry);
+	cacheEntries--;
+}
+
+/* --- move an entry to the front of the LRU list --- */
+static void
+cacheTouch(lookup_cache_t *entry)
+{
+	if (entry->lruprev != NULL)
+	{
+		entry->lruprev->lrunext = entry->lrunext;
+		entry->lrunext->lruprev = entry->lruprev;
+	}
+	entry->lrunext = cacheLru.lrunext;
+	entry->lruprev = &cacheLru;
+	cacheLru.lrunext->lruprev = entry;
+	cacheLru.lrunext = entry;
+}
+
+/* --- the version of a hashid --- */
+static unsigned int
+hashVersion(int hashid)
+{
+	if (hashid <= 0 || hashid >= hashVersionsLen)
+		return 0;
+	return hashVersions[hashid];
+}
+
+/* --- a peer of 'hashid' changed, the windows that cover it are stale --- */
+void lookupCacheInvalidate(int hashid) {
+unsigned int *versions;
+int len;
+	if (hashid <= 0)
+		return;
+	if (hashid >= hashVersionsLen)
+	{
+		for (len = (hashVersionsLen ? hashVersionsLen : 1024); 
+				len <= hashid; len *= 2)
+			;
+		if ((versions = (unsigned int *)realloc(hashVersions, 
+				len * sizeof(unsigned int))) == NULL)
+		{
+			/* can't keep the version, forget every window */
+			while (cacheEntries > 0)
+			{
+				cacheFree(cacheLru.lruprev);
+				cacheDrops++;
+			}
+			return;
+		}
+		bzero(&versions[hashVersionsLen], 
+			(len - hashVersionsLen) * sizeof(unsigned int));
+		hashVersions = versions;
+		hashVersionsLen = len;
+	}
+	hashVersions[hashid]++;
+}
+
+/* --- did a peer of any hashid in the window change since it was built --- */
+static int
+cacheStale(lookup_cache_t *entry)
+{
+int i;
+	for (i = 0; i < PREDICTIONS; i++)
+	{
+		if (entry->versions[i] != hashVersion(entry->hashid + i))
+			return 1;
+	}
+	return 0;
+}
+
+/* --- invalidate every hashid returned by a SELECT --- */
+void invalidateHashids(sqlite3 *db, char *sqlStmt) {
+sqlite3_stmt *preppedStmt; 
+	if (cacheEntries == 0)
+		return;
+	if (prep_stmt(db, sqlStmt, &preppedStmt) == SQLITE_OK)
+	{
+		while ( sqlite3_step(preppedStmt) == SQLITE_ROW )
+			lookupCacheInvalidate(sqlite3_column_int(preppedStmt,0));
+		sqlite3_finalize(preppedStmt);
+	}
+}
+
+static lookup_cache_t *
+cacheFind(uint64_t hash)
+{
+lookup_cache_t *entry;
+	for (entry = *cacheHashBucket(hash); entry != NULL; 
+			entry = entry->hashnext)
+	{
+		if (entry->hash == hash)
+			return entry;
+	}
+	return NULL;
+}
+
+/* --- build the prediction window for a hash from the database.
+   if 'add' is 0 the hash must already be there --- */
+static lookup_cache_t *
+cacheFill(sqlite3 *db, uint64_t hash, int add)
+{
+lookup_cache_t *entry;
+char sqlStmt[256];
+static peer_t peers[PREDICTIONS][MAX_SHUFFLE_PEERS];
+peer_t tmp, *block;
+sqlite3_stmt *preppedStmt; 
+int sqlCode;
+int hashid, thisid, ip, state;
+int total, n, i, j;
+
+	if (add)
+		hashid = addHash(db,hash);
+	else if ((hashid = hashExists(db,hash)) <= 0)
+		return NULL;
+
+	if ((entry = (lookup_cache_t *)calloc(1, sizeof(lookup_cache_t))) 
+			== NULL)
+		return NULL;
+
+	/* -- Query Database for peers of this hash -- */
+	entry->hash = hash;
+	entry->hashid = hashid;
+	entry->numhashes = 1; /* always return this hash, even if no peers */
+	entry->info[0].hash = hash;
+	entry->info[0].numpeers = 0;
+	for (i = 0; i < PREDICTIONS; i++)
+		entry->versions[i] = hashVersion(hashid + i);
 
-	/*  -- Query Database for peers of this hash -- */
-	hashid = addHash(db,hash);
 	sprintf(sqlStmt, "select hashid,IP,state from peers inner join hosts using(hostid) where hashid >= %d and hashid < %d order by hashid", hashid, hashid + PREDICTIONS);
 	if (prep_stmt(db, sqlStmt, &preppedStmt) == SQLITE_OK)
 	{
-		npeers = 0;
-		peercount = 0;
+		n = 0;
 		while ( (sqlCode = sqlite3_step(preppedStmt))  == SQLITE_ROW )
 		{
 			thisid = sqlite3_column_int(preppedStmt,0);
@@ -313,61 +677,677 @@ int peercount, thisid;
 			/* see if we have predicted a new hash */
 			if (thisid != hashid) 
 			{
-				/* shuffle and copy peers of previous hash */
-				respinfo->numpeers = 
-					randomCopyPeers(respinfo->peers, 
-					peers, npeers, MAX_PEERS);
-				len += (sizeof(respinfo->peers[0]) * 
-					respinfo->numpeers);
-
-				hash = hashidToHash(db, thisid);
+				n = entry->numhashes++;
+				entry->info[n].hash = hashidToHash(db, thisid);
+				entry->info[n].numpeers = 0;
+				hashid = thisid;
 #ifdef	DEBUG
 				fprintf(stderr, "new predicted hash (%llx)\n", 
-					(long long unsigned) hash);
-				fprintf(stderr, "resp info numpeers (%d)\n", 
-					respinfo->numpeers);
+					(long long unsigned) entry->info[n].hash);
 #endif
-				/* new "header" for this new hash */
-				respinfo = (tracker_info_t *) 
-					(&(respinfo->peers[respinfo->numpeers]));
-				len += sizeof(tracker_info_t);
-				
-				respinfo->hash = hash;
-				respinfo->numpeers = 0;
-				hashid = thisid;
-				npeers = 0;
-				peercount = 0;
-				resp->numhashes ++;
 			}
 
-			/* check if requestor is already a peer */
-			if (ip == (int) from_addr->sin_addr.s_addr) 
+			if (entry->info[n].numpeers < MAX_SHUFFLE_PEERS)
+			{
+				i = entry->info[n].numpeers++;
+				peers[n][i].ip = ip;
+				peers[n][i].state = state;
+			}
+		}
+		if (sqlCode != SQLITE_DONE)
+			fprintf (stderr, "error in getPeers (%d)\n", sqlCode);
+		sqlite3_finalize(preppedStmt);
+	}
+
+	/* keep all the peer lists in one block */
+	total = 0;
+	for (n = 0; n < entry->numhashes; n++)
+		total += entry->info[n].numpeers;
+	if ((block = (peer_t *)malloc((total + 1) * sizeof(peer_t))) == NULL)
+	{
+		free(entry);
+		return NULL;
+	}
+
+	for (n = 0; n < entry->numhashes; n++)
+	{
+		entry->info[n].peers = block;
+		for (i = entry->info[n].numpeers - 1; i > 0; i--)
+		{
+			j = rand() % (i + 1);
+			tmp = peers[n][i];
+			peers[n][i] = peers[n][j];
+			peers[n][j] = tmp;
+		}
+		memcpy(block, peers[n], entry->info[n].numpeers * sizeof(peer_t));
+		block += entry->info[n].numpeers;
+	}
+
+	/* make room, then link the new window in */
+	while (cacheEntries >= LOOKUP_CACHE_ENTRIES)
+		cacheFree(cacheLru.lruprev);
+
+	entry->hashnext = *cacheHashBucket(hash);
+	*cacheHashBucket(hash) = entry;
+	cacheTouch(entry);
+	cacheEntries++;
+
+	return entry;
+}
+
+/* --- timer callback: log how well the cache is doing --- */
+static void
+cacheStats(void *arg)
+{
+static unsigned long long lastHits = 0, lastMisses = 0;
+	if (cacheHits != lastHits || cacheMisses != lastMisses)
+	{
+		fprintf(stderr, "lookup cache: hits %llu misses %llu (%.1f%%) drops %llu entries %d\n",
+			cacheHits, cacheMisses, 
+			(100.0 * cacheHits) / (cacheHits + cacheMisses),
+			cacheDrops, cacheEntries);
+		lastHits = cacheHits;
+		lastMisses = cacheMisses;
+	}
+	timer_add(&cacheStatsTimer, LOOKUP_CACHE_STATS * 1000);
+}
+
+void
+lookupCacheInit()
+{
+	cacheLru.lrunext = cacheLru.lruprev = &cacheLru;
+	cacheStatsTimer.func = cacheStats;
+	cacheStatsTimer.arg = NULL;
+	timer_add(&cacheStatsTimer, LOOKUP_CACHE_STATS * 1000);
+}
+
+/* -- Copy Peers, closest first -- */
+int
+rankCopyPeers(peer_t *dstpeers, peer_t *srcpeers, int npeers, int maxpeers,
+	in_addr_t requestor, unsigned int rotor)
+{
+int distance[MAX_SHUFFLE_PEERS];
+int members[MAX_SHUFFLE_PEERS];
+int count, nmembers;
+int tier;
+int i, k;
+	if (npeers <= 0)
+		return 0;
+
+	/* Copy at most maxpeers from src to dest, but never the requestor.
+	   Peers on the requestor's switch go first, then peers in its rack,
+	   then everyone else, so the swarm's traffic stays off the uplinks.
+	   Within a tier, start at a different peer every time, so the load
+	   is spread over all of them. */
+	for (i = 0; i < npeers; i++)
+	{
+		if (srcpeers[i].ip == requestor)
+			distance[i] = -1;
+		else
+			distance[i] = topology_distance(requestor, 
+				srcpeers[i].ip);
+	}
+
+	count = 0;
+	for (tier = TOPO_SAME_SWITCH; tier <= TOPO_FAR; tier++)
+	{
+		nmembers = 0;
+		for (i = 0; i < npeers; i++)
+		{
+			if (distance[i] == tier)
+				members[nmembers++] = i;
+		}
+		for (k = 0; k < nmembers && count < maxpeers; k++)
+		{
+			i = members[(k + rotor) % nmembers];
+			dstpeers[count++] = srcpeers[i];
+		}
+	}
+	return count;
+}
+
+/* -------------------------------------------- */
+/* --           Hot File Routines            -- */         
+/* -------------------------------------------- */
+/* The tracker counts the LOOKUPs for every hash and remembers how many
+   READY peers the hash had when it was last looked up. A hash that is
+   asked for much more often than there are peers to serve it is 'hot'
+   (see HOT_RATIO in tracker.h). Hosts that aren't serving much
+   themselves, and don't have the file yet, are sent a few hot files
+   with their LOOKUP responses. tracker-client finds their names in
+   NAMES_FILE and fetches them in the background, so the supply of a
+   hot file grows before the rest of the cluster gets to it. */
+
+#define	HOT_BUCKETS	1024
+#define	HOT_ENTRIES	8192
+
+typedef struct hot {
+	uint64_t	hash;
+	unsigned int	demand;		/* LOOKUPs, halved every HOT_DECAY_SECS */
+	int		ready;		/* READY peers */
+	struct hot	*next;
+} hot_t;
+
+static hot_t		*hots[HOT_BUCKETS];
+static int		hotEntries = 0;
+static uint64_t		hotList[HOT_LIST];	/* hottest first */
+static int		hotListLen = 0;
+static tracker_timer_t	hotTimer;
+
+static unsigned long long	hotHintsSent = 0;
+
+static hot_t **
+hotBucket(uint64_t hash)
+{
+	return &hots[hash % HOT_BUCKETS];
+}
+
+static hot_t *
+hotFind(uint64_t hash)
+{
+hot_t *hot;
+	for (hot = *hotBucket(hash); hot != NULL; hot = hot->next)
+	{
+		if (hot->hash == hash)
+			break;
+	}
+	return hot;
+}
+
+/* --- count a LOOKUP of a hash, 'peers' are all of its peers --- */
+void hotDemand(uint64_t hash, peer_t *peers, int npeers) {
+hot_t *hot;
+int i, ready;
+	if ((hot = hotFind(hash)) == NULL)
+	{
+		if (hotEntries >= HOT_ENTRIES || 
+				(hot = (hot_t *)calloc(1, sizeof(hot_t))) == NULL)
+			return;
+		hot->hash = hash;
+		hot->next = *hotBucket(hash);
+		*hotBucket(hash) = hot;
+		hotEntries++;
+	}
+
+	ready = 0;
+	for (i = 0; i < npeers; i++)
+	{
+		if (peers[i].state == READY)
+			ready++;
+	}
+	hot->demand++;
+	hot->ready = ready;
+}
+
+/* --- a host registered a hash --- */
+void hotSupply(uint64_t hash) {
+hot_t *hot;
+	if ((hot = hotFind(hash)) != NULL)
+		hot->ready++;
+}
+
+/* --- the peers in a LOOKUP response are going to be busy --- */
+void hotServed(peer_t *peers, int npeers) {
+lease_t *lease;
+int i;
+	for (i = 0; i < npeers; i++)
+	{
+		if ((lease = leaseFind(peers[i].ip)) != NULL)
+			lease->load++;
+	}
+}
+
+static int
+hotIsHot(hot_t *hot)
+{
+	return hot->demand >= HOT_MIN_DEMAND && 
+		hot->demand > HOT_RATIO * hot->ready;
+}
+
+/* --- timer callback: pick the hot files, then age the counts --- */
+static void
+hotDecay(void *arg)
+{
+static int lastLen = 0;
+hot_t **prev, *hot;
+hot_t *list[HOT_LIST];
+lease_t *lease;
+int n, i, j;
+
+	/* keep the HOT_LIST hashes with the most LOOKUPs per READY peer */
+	n = 0;
+	for (i = 0; i < HOT_BUCKETS; i++)
+	{
+		for (hot = hots[i]; hot != NULL; hot = hot->next)
+		{
+			if (!hotIsHot(hot))
 				continue;
-				
-			/* copy the info just read from DB into unshuffled
-                           peers array */ 
-		 	peercount++;
-			if ( peercount < MAX_SHUFFLE_PEERS)
+			for (j = n; j > 0; j--)
 			{
-				peers[npeers].ip = ip;
-				peers[npeers].state = (state == DOWNLOADING ? 'd' :'r');
-				npeers++;
+				if ((unsigned long long) list[j-1]->demand * 
+						(hot->ready + 1) >= 
+					(unsigned long long) hot->demand * 
+						(list[j-1]->ready + 1))
+					break;
+				if (j < HOT_LIST)
+					list[j] = list[j-1];
+			}
+			if (j < HOT_LIST)
+			{
+				list[j] = hot;
+				if (n < HOT_LIST)
+					n++;
 			}
 		}
-		if (sqlCode != SQLITE_DONE && npeers < MAX_SHUFFLE_PEERS)
+	}
+	for (i = 0; i < n; i++)
+		hotList[i] = list[i]->hash;
+	hotListLen = n;
+
+	if (n != lastLen)
+	{
+		fprintf(stderr, "hot files: %d (of %d) hints sent %llu\n",
+			n, hotEntries, hotHintsSent);
+		lastLen = n;
+	}
+
+	for (i = 0; i < HOT_BUCKETS; i++)
+	{
+		prev = &hots[i];
+		while ((hot = *prev) != NULL)
 		{
-			rcode=sqlCode;
-			fprintf (stderr, "error in getPeers (%d)\n", rcode);
+			if ((hot->demand /= 2) == 0)
+			{
+				*prev = hot->next;
+				free(hot);
+				hotEntries--;
+			}
+			else
+				prev = &hot->next;
 		}
-		sqlite3_finalize(preppedStmt);
 	}
 
-	respinfo->numpeers = randomCopyPeers(respinfo->peers, peers, npeers, MAX_PEERS);
+	for (i = 0; i < LEASE_BUCKETS; i++)
+	{
+		for (lease = leases[i]; lease != NULL; lease = lease->next)
+			lease->load /= 2;
+	}
+
+	timer_add(&hotTimer, HOT_DECAY_SECS * 1000);
+}
+
+/* --- hot files for a host to prefetch, returns how many --- */
+int hotHints(sqlite3 *db, in_addr_t ip, uint64_t asked, uint64_t *hints) {
+char sqlStmt[256];
+lease_t *lease;
+hot_t *hot;
+time_t now;
+int hashid;
+int i, n;
+
+	/* only a host that isn't busy serving others */
+	if (hotListLen == 0 || (lease = leaseFind(ip)) == NULL ||
+			lease->load > HOT_IDLE_LOAD)
+		return 0;
+
+	now = time(NULL);
+	if (now - lease->lasthint < HOT_HINT_SECS)
+		return 0;
+
+	n = 0;
+	for (i = 0; i < hotListLen && n < HOT_HINTS; i++)
+	{
+		/* it may have cooled off since the list was made */
+		if ((hot = hotFind(hotList[i])) == NULL || !hotIsHot(hot) ||
+				hot->hash == asked)
+			continue;
+
+		/* the host already has it, or is getting it */
+		if ( (hashid = hashExists(db, hot->hash)) )
+		{
+			sprintf(sqlStmt, "SELECT hashid FROM peers INNER JOIN hosts USING(hostid) WHERE hashid=%d and ip=%d", hashid, (int) ip);
+			if ( getIntValue(db,sqlStmt) )
+				continue;
+		}
+
+		/* count the copy now, so the next idle hosts are sent the
+		   next file instead of this one */
+		hints[n++] = hot->hash;
+		hot->ready++;
+	}
+
+	if (n > 0)
+	{
+		lease->lasthint = now;
+		hotHintsSent += n;
+	}
+	return n;
+}
+
+void
+hotInit()
+{
+	hotTimer.func = hotDecay;
+	hotTimer.arg = NULL;
+	timer_add(&hotTimer, HOT_DECAY_SECS * 1000);
+}
+
+/* -------------------------------------------- */
+/* --         Host Manifest Routines         -- */         
+/* -------------------------------------------- */
+/* A host can upload the list of files it is going to ask for, in order
+   (see MANIFEST_FILE in tracker.h). The manifest is kept with the host's
+   lease. When the host looks up a file that is in its manifest, the
+   response predicts the files that follow it in the manifest instead of
+   guessing from the order the hashes were first seen in. The peers of
+   each predicted file come from the LOOKUP cache, so a host walking its
+   manifest only goes to the database when a peer list changed. */
+
+/* --- the cached window for a hash, built if it isn't there. 'add' as
+   in cacheFill() --- */
+static lookup_cache_t *
+cacheGet(sqlite3 *db, uint64_t hash, int add)
+{
+lookup_cache_t *entry;
+	if ((entry = cacheFind(hash)) != NULL)
+	{
+		if (!cacheStale(entry))
+		{
+			cacheHits++;
+			cacheTouch(entry);
+			return entry;
+		}
+		cacheFree(entry);
+		cacheDrops++;
+	}
+	cacheMisses++;
+	return cacheFill(db, hash, add);
+}
+
+/* --- store one chunk of a host's manifest --- */
+void
+domanifest(sqlite3 *db, int sockfd, char *buf, ssize_t len,
+	struct sockaddr_in *from_addr)
+{
+tracker_manifest_t	*req = (tracker_manifest_t *)buf;
+tracker_manifest_resp_t	resp;
+lease_t			*lease;
+uint64_t		*manifest;
+uint32_t		end;
+
+	if (len < sizeof(tracker_manifest_t) || 
+			len < sizeof(tracker_manifest_t) + 
+				(req->numhashes * sizeof(req->hashes[0])) ||
+			req->offset + req->numhashes > MANIFEST_MAX)
+	{
+		fprintf(stderr, "domanifest:bad message from (%s)\n", 
+			inet_ntoa(from_addr->sin_addr));
+		return;
+	}
+
+	if ((lease = leaseRenew(from_addr->sin_addr.s_addr)) == NULL)
+		return;
+
+	if (req->offset == 0)
+	{
+		lease->manifestlen = 0;
+		lease->cursor = 0;
+	}
+
+	/* chunks come in order, but a chunk can be sent twice if our
+	   response was lost. don't ack a chunk past a gap, the host
+	   will start over */
+	if (req->offset > lease->manifestlen)
+		return;
+
+	end = req->offset + req->numhashes;
+	if (end > lease->manifestlen)
+	{
+		if ((manifest = (uint64_t *)realloc(lease->manifest, 
+				end * sizeof(uint64_t))) == NULL)
+			return;
+		lease->manifest = manifest;
+		lease->manifestlen = end;
+	}
+	memcpy(&lease->manifest[req->offset], req->hashes, 
+		req->numhashes * sizeof(req->hashes[0]));
+
+	bzero(&resp, sizeof(resp));
+	resp.header.op = MANIFEST;
+	resp.header.length = sizeof(resp);
+	resp.header.seqno = req->header.seqno;
+	sendto(sockfd, &resp, sizeof(resp), 0, (struct sockaddr *)from_addr,
+		sizeof(*from_addr));
+}
+
+/* --- merge one chunk of a host's timeline into the cluster timeline --- */
+/* Each span is written as
+	<host>,<name>,<start usec>,<end usec>,<key=value ...>
+   with the times moved onto our clock, so the spans of all the hosts
+   can be sorted into one timeline (sort -t, -k3 -n). The time the
+   message spent on the wire is not taken out, it is well under the
+   resolution anyone cares about here. */
+void
+dotimeline(char *buf, ssize_t len, int sockfd, struct sockaddr_in *from_addr)
+{
+tracker_timeline_t	*req = (tracker_timeline_t *)buf;
+tracker_timeline_resp_t	resp;
+struct timeval		now;
+lease_t			*lease;
+FILE			*out;
+char			*line, *next, *end;
+char			name[64];
+unsigned long long	start, stop;
+long long		skew;
+int			n;
+
+	if (len < sizeof(tracker_timeline_t) || 
+			len < sizeof(tracker_timeline_t) + req->length)
+	{
+		fprintf(stderr, "dotimeline:bad message from (%s)\n", 
+			inet_ntoa(from_addr->sin_addr));
+		return;
+	}
+
+	if ((lease = leaseRenew(from_addr->sin_addr.s_addr)) == NULL)
+		return;
+
+	/* a chunk we already have is only acked. after a gap (our lease
+	   ran out) take what comes, the lines in the gap are gone */
+	if (req->offset >= lease->timelineoff &&
+			(out = fopen(CLUSTER_TIMELINE_FILE, "a")) != NULL)
+	{
+		gettimeofday(&now, NULL);
+		skew = ((long long)now.tv_sec * 1000000 + now.tv_usec) -
+			(long long)req->sent;
+
+		end = req->lines + req->length;
+		for (line = req->lines; line < end; line = next)
+		{
+			if ((next = memchr(line, '\n', end - line)) == NULL)
+				break;
+			*next++ = '\0';
+
+			n = strlen(line);
+			if (sscanf(line, "%63s %llu %llu %n", name, &start,
+					&stop, &n) < 3)
+				continue;
+
+			fprintf(out, "%s,%s,%lld,%lld,%s\n",
+				inet_ntoa(from_addr->sin_addr), name,
+				(long long)start + skew, (long long)stop + skew,
+				line + n);
+		}
+		fclose(out);
+
+		lease->timelineoff = req->offset + req->length;
+	}
+
+	bzero(&resp, sizeof(resp));
+	resp.header.op = TIMELINE;
+	resp.header.length = sizeof(resp);
+	resp.header.seqno = req->header.seqno;
+	resp.offset = lease->timelineoff;
+	sendto(sockfd, &resp, sizeof(resp), 0, (struct sockaddr *)from_addr,
+		sizeof(*from_addr));
+}
+
+/* --- answer a LOOKUP from the host's manifest, returns 0 if we can't --- */
+int
+manifestLookup(sqlite3 *db, int sockfd, uint64_t hash, uint32_t seqno,
+	uint32_t reqflags, struct sockaddr_in *from_addr)
+{
+tracker_lookup_resp_t	*resp;
+tracker_info_t		*respinfo;
+lease_t			*lease;
+lookup_cache_t		*entry;
+hash_info_t		*info;
+size_t			len;
+uint32_t		i, j, last;
+char			buf[64*1024];
+
+	if ((lease = leaseFind(from_addr->sin_addr.s_addr)) == NULL ||
+			lease->manifestlen == 0)
+		return 0;
+
+	/* look from where the host was last time, then from the top */
+	for (i = lease->cursor; i < lease->manifestlen; i++)
+	{
+		if (lease->manifest[i] == hash)
+			break;
+	}
+	if (i == lease->manifestlen)
+	{
+		for (i = 0; i < lease->cursor; i++)
+		{
+			if (lease->manifest[i] == hash)
+				break;
+		}
+		if (i == lease->cursor)
+			return 0;
+	}
+	lease->cursor = i + 1;
+
+	resp = (tracker_lookup_resp_t *)buf;
+	resp->header.op = LOOKUP;
+	resp->header.seqno = seqno;
+	len = sizeof(tracker_lookup_resp_t);
+
+	/* always return this hash, even if no peers. after that, only the
+	   files that have peers */
+	respinfo = (tracker_info_t *)resp->info;
+	resp->numhashes = 0;
+	last = min(i + MANIFEST_PREDICTIONS, lease->manifestlen);
+	for (j = i; j < last; j++)
+	{
+		/* only the file that was asked for gets a hashid. the
+		   files the host asks for later get theirs when it does,
+		   so the hashid order stays the order the files were
+		   asked for in, for the hosts without a manifest */
+		if ((entry = cacheGet(db, lease->manifest[j], j == i)) == NULL)
+		{
+			if (j == i)
+				return 0;
+			continue;
+		}
+		info = &entry->info[0];
+
+		if (j == i)
+			hotDemand(hash, info->peers, info->numpeers);
+		else if (info->numpeers == 0)
+			continue;
+
+		respinfo->hash = lease->manifest[j];
+		respinfo->numpeers = rankCopyPeers(respinfo->peers, 
+			info->peers, info->numpeers, MAX_PEERS, 
+			from_addr->sin_addr.s_addr, entry->rotor++);
+		hotServed(respinfo->peers, respinfo->numpeers);
+		len += sizeof(tracker_info_t) + 
+			(sizeof(respinfo->peers[0]) * respinfo->numpeers);
+		respinfo = (tracker_info_t *) 
+			(&(respinfo->peers[respinfo->numpeers]));
+		resp->numhashes++;
+	}
+
+	/* hot files for the host to fetch, after the entries */
+	resp->numhints = hotHints(db, from_addr->sin_addr.s_addr, hash,
+		(uint64_t *)respinfo);
+	len += resp->numhints * sizeof(uint64_t);
+
+	resp->header.length = len;
+	sendto(sockfd, buf, len, 0, (struct sockaddr *)from_addr,
+		sizeof(*from_addr));
+
+	if ((((tracker_info_t *)resp->info)->numpeers == 0) &&
+			!(reqflags & LOOKUP_NOCLAIM))
+		inflightClaim(db, hash, (int) from_addr->sin_addr.s_addr);
+	return 1;
+}
+
+/* -- dolookup(): lookup peers for hashes -- */
+void
+dolookup(sqlite3 *db, int sockfd, uint64_t hash, uint32_t seqno,
+	uint32_t reqflags, struct sockaddr_in *from_addr)
+{
+tracker_lookup_resp_t	*resp;
+tracker_info_t		*respinfo;
+lookup_cache_t		*entry;
+size_t			len;
+int			flags;
+int			i;
+char			buf[64*1024];
+
+	if (manifestLookup(db, sockfd, hash, seqno, reqflags, from_addr))
+		return;
+
+	if ((entry = cacheGet(db, hash, 1)) == NULL)
+	{
+		fprintf(stderr, "dolookup:cacheFill:failed\n");
+		return;
+	}
+
+	/* -- Response Header -- */
+	resp = (tracker_lookup_resp_t *)buf;
+	resp->header.op = LOOKUP;
+	resp->header.seqno = seqno;
+	resp->numhashes = entry->numhashes;
+
+	/*
+	 * keep a running count for the length of the data
+	 */
+	len = sizeof(tracker_lookup_resp_t);
+
+	hotDemand(hash, entry->info[0].peers, entry->info[0].numpeers);
+
+	respinfo = (tracker_info_t *)resp->info;
+	for (i = 0; i < entry->numhashes; i++)
+	{
+		respinfo->hash = entry->info[i].hash;
+		respinfo->numpeers = rankCopyPeers(respinfo->peers, 
+			entry->info[i].peers, entry->info[i].numpeers, 
+			MAX_PEERS, from_addr->sin_addr.s_addr, entry->rotor);
+		hotServed(respinfo->peers, respinfo->numpeers);
 #ifdef	DEBUG
-	fprintf(stderr, "resp info numpeers (%d)\n", respinfo->numpeers);
+		fprintf(stderr, "resp info numpeers (%d)\n", respinfo->numpeers);
 #endif
+		len += sizeof(tracker_info_t) + 
+			(sizeof(respinfo->peers[0]) * respinfo->numpeers);
+		respinfo = (tracker_info_t *) 
+			(&(respinfo->peers[respinfo->numpeers]));
+	}
+	entry->rotor++;
 
-	len += (sizeof(respinfo->peers[0]) * respinfo->numpeers);
+	/* hot files for the host to fetch, after the entries */
+	resp->numhints = hotHints(db, from_addr->sin_addr.s_addr, hash,
+		(uint64_t *)respinfo);
+	len += resp->numhints * sizeof(uint64_t);
+
+	/* nobody else has this file, the requestor will get it from a
+	   package server. this makes 'entry' stale. a requestor
+	   that only wants a range of it will never register it */
+	if ((((tracker_info_t *)resp->info)->numpeers == 0) &&
+			!(reqflags & LOOKUP_NOCLAIM))
+		inflightClaim(db, hash, (int) from_addr->sin_addr.s_addr);
 
 #ifdef	DEBUG
 	fprintf(stderr, "len (%d)\n", (int)len);
@@ -397,6 +1377,8 @@ int peercount, thisid;
 int garbageCollect(sqlite3 *db) {
 char sqlStmt[256];
 	/* Remove all hashes not referenced in peers table */
+	sprintf(sqlStmt, "SELECT hashes.hashid FROM hashes LEFT OUTER JOIN peers ON (hashes.hashid=peers.hashid) WHERE hostid IS NULL");
+	invalidateHashids(db,sqlStmt);
 	sprintf(sqlStmt, " DELETE from hashes where hashid in (SELECT hashes.hashid FROM hashes LEFT OUTER JOIN peers ON (hashes.hashid=peers.hashid) WHERE hostid IS NULL)");
 	sql_stmt(db,sqlStmt);
 	sprintf(sqlStmt, "DELETE FROM HOSTS WHERE hosts.hostid in (SELECT hosts.hostid FROM hosts LEFT OUTER JOIN peers ON (hosts.hostid=peers.hostid) WHERE hashid IS NULL)");
@@ -437,6 +1419,11 @@ int sqlCode;
 		sqlite3_finalize(preppedStmt);
 	}
 
+	fprintf(stderr, "\nLOOKUP CACHE\nhits %llu misses %llu drops %llu entries %d\n",
+		cacheHits, cacheMisses, cacheDrops, cacheEntries);
+	fprintf(stderr, "\nREGISTER\nacks %llu duplicates %llu\n",
+		registerAcks, registerDups);
+
 	sprintf(sqlStmt, "SELECT hashes.hash,hosts.ip,peers.state FROM peers INNER JOIN hashes USING(hashid) INNER JOIN hosts USING(hostid) ORDER by hashes.hash" );
 	if (prep_stmt(db, sqlStmt, &preppedStmt) == SQLITE_OK)
 	{
@@ -453,17 +1440,27 @@ int sqlCode;
 }
 
 void
-register_hash(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
+register_hash(sqlite3 *db, int sockfd, char *buf, struct sockaddr_in *from_addr)
 {
 	tracker_register_t	*req = (tracker_register_t *)buf;
+	tracker_register_resp_t	resp;
 	tracker_info_t		*reqinfo;
 	uint16_t		numpeers;
 	peer_t			dynamic_peers[1];
 	peer_t			*peers;
+	char			*end = buf + req->header.length;
 	int			i, j;
 
+	/*
+	 * the entries are packed, each one is followed by its peers
+	 */
+	reqinfo = req->info;
 	for (i = 0; i < req->numhashes; ++i) {
-		reqinfo = &req->info[i];
+		if ((char *)&reqinfo->peers[reqinfo->numpeers] > end) {
+			fprintf(stderr, "register_hash:short message\n");
+			break;
+		}
+
 		if (reqinfo->numpeers == 0) {
 			/*
 			 * no peer specified. dynamically determine
@@ -488,6 +1485,21 @@ register_hash(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 #ifdef	DEBUG
 	fprintf(stderr, "register_hash:exit:hash (0x%llx)\n", (long long unsigned) reqinfo->hash);
 #endif
+		reqinfo = (tracker_info_t *)&reqinfo->peers[reqinfo->numpeers];
+	}
+
+	/*
+	 * the client sends the batch again if the ack is lost. that's ok,
+	 * registerPeer() skips a peer that is already registered.
+	 */
+	if (req->flags & REGISTER_ACK) {
+		bzero(&resp, sizeof(resp));
+		resp.header.op = REGISTER;
+		resp.header.length = sizeof(resp);
+		resp.header.seqno = req->header.seqno;
+		sendto(sockfd, &resp, sizeof(resp), 0, 
+			(struct sockaddr *)from_addr, sizeof(*from_addr));
+		registerAcks++;
 	}
 }
 
@@ -497,9 +1509,11 @@ void
 unregister_hash(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 {
 	tracker_unregister_t	*req = (tracker_unregister_t *)buf;
+	tracker_info_t		*info;
 	int			i,j;
 	int			hashid, hostid;
 	char			sqlStmt[256];
+	char			*end = buf + req->header.length;
 
 #ifdef	DEBUG
 	fprintf(stderr, "unregister_hash:enter\n");
@@ -507,11 +1521,26 @@ unregister_hash(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 	dumpTables(db);
 #endif
 
+	/* the entries are packed, each one is followed by its peers */
+	info = req->info;
 	for (i = 0 ; i < req->numhashes ; ++i) 
 	{
-		tracker_info_t	*info = &req->info[i];
+		if ((char *)&info->peers[info->numpeers] > end)
+		{
+			fprintf(stderr, "unregister_hash:short message\n");
+			break;
+		}
 		if( (hashid = hashExists(db, info->hash)) )
 		{
+			/* no peers means the sender dropped its own copy */
+			if ((info->numpeers == 0) && (hostid =
+				hostExists(db, from_addr->sin_addr.s_addr)))
+			{
+				sprintf(sqlStmt, "DELETE FROM peers WHERE hashid=%d and hostid=%d", hashid, hostid);
+				sql_stmt(db,sqlStmt);
+				lookupCacheInvalidate(hashid);
+			}
+
 			for (j = 0 ; j < info->numpeers ; ++j) 
 			{
 				if ( (hostid = 
@@ -519,9 +1548,11 @@ unregister_hash(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 				{
 					sprintf(sqlStmt, "DELETE FROM peers WHERE hashid=%d and hostid=%d", hashid, hostid);
 					sql_stmt(db,sqlStmt);
+					lookupCacheInvalidate(hashid);
 				}
 			}
 		}
+		info = (tracker_info_t *)&info->peers[info->numpeers];
 	}
 
 #ifdef	DEBUG
@@ -539,6 +1570,7 @@ unregister_all(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 	dumpTables(db);
 #endif
 
+	leaseDrop(from_addr->sin_addr.s_addr);
 	deleteHost(db,(int) from_addr->sin_addr.s_addr);
 	garbageCollect(db);
 
@@ -549,11 +1581,203 @@ unregister_all(sqlite3 *db, char *buf, struct sockaddr_in *from_addr)
 
 }
 
+/* -------------------------------------------- */
+/* --            Table Snapshots             -- */         
+/* -------------------------------------------- */
+/* DUMP_TABLES used to print every row to stderr from the request loop,
+   which stalled every LOOKUP during a busy install. Now the tracker
+   forks: the child has a copy-on-write view of the tables as they were
+   at that instant and writes it out as CSV, while the parent goes right
+   back to answering requests. The records are:
+
+	S,<name>,<value>		counters
+	H,<hostid>,<ip>,<groupid>	hosts
+	F,<hashid>,<hash>		hashes (files)
+	P,<hashid>,<ip>,<state>		peers, in hashid order
+
+   dump-tables renders it.
+
+   Only one snapshot child runs at a time, a request that comes in while
+   one is running is dropped. Since the request is a datagram, its source
+   address can be forged, so a snapshot is only sent back to loopback or
+   to an address of this host (the frontend). */
+
+static pid_t	snapshotPid = 0;
+
+static void
+snapshotRows(sqlite3 *db, FILE *out, char *sqlStmt, char type)
+{
+sqlite3_stmt *preppedStmt; 
+struct in_addr in;
+	if (prep_stmt(db, sqlStmt, &preppedStmt) != SQLITE_OK)
+		return;
+	while ( sqlite3_step(preppedStmt) == SQLITE_ROW )
+	{
+		switch (type)
+		{
+		case 'H':
+			in.s_addr = sqlite3_column_int(preppedStmt,1);
+			fprintf(out, "H,%d,%s,%d\n", 
+				sqlite3_column_int(preppedStmt,0),
+				inet_ntoa(in), 
+				sqlite3_column_int(preppedStmt,2));
+			break;
+		case 'F':
+			fprintf(out, "F,%d,%016llx\n", 
+				sqlite3_column_int(preppedStmt,0),
+				(long long unsigned) 
+				sqlite3_column_int64(preppedStmt,1));
+			break;
+		case 'P':
+			in.s_addr = sqlite3_column_int(preppedStmt,1);
+			fprintf(out, "P,%d,%s,%d\n", 
+				sqlite3_column_int(preppedStmt,0),
+				inet_ntoa(in), 
+				sqlite3_column_int(preppedStmt,2));
+			break;
+		}
+	}
+	sqlite3_finalize(preppedStmt);
+}
+
+static void
+snapshotWrite(sqlite3 *db, FILE *out)
+{
+	fprintf(out, "S,time,%ld\n", (long) time(NULL));
+	fprintf(out, "S,cache_hits,%llu\n", cacheHits);
+	fprintf(out, "S,cache_misses,%llu\n", cacheMisses);
+	fprintf(out, "S,cache_drops,%llu\n", cacheDrops);
+	fprintf(out, "S,cache_entries,%d\n", cacheEntries);
+	fprintf(out, "S,register_acks,%llu\n", registerAcks);
+	fprintf(out, "S,register_duplicates,%llu\n", registerDups);
+	fprintf(out, "S,hot_files,%d\n", hotListLen);
+	fprintf(out, "S,hot_hints,%llu\n", hotHintsSent);
+
+	snapshotRows(db, out, "SELECT hostid,ip,groupid FROM hosts ORDER BY hostid", 'H');
+	snapshotRows(db, out, "SELECT hashid,hash FROM hashes ORDER BY hashid", 'F');
+	snapshotRows(db, out, "SELECT hashid,ip,state FROM peers INNER JOIN hosts USING(hostid) ORDER BY hashid", 'P');
+}
+
+/* --- is 'addr' loopback or one of this host's addresses --- */
+static int
+snapshotLocal(in_addr_t addr)
+{
+struct ifaddrs *ifaddrs, *ifa;
+struct sockaddr_in *sin;
+int local = 0;
+	if ((ntohl(addr) >> 24) == 127)
+		return 1;
+	if (getifaddrs(&ifaddrs) != 0)
+		return 0;
+	for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		sin = (struct sockaddr_in *)ifa->ifa_addr;
+		if ((sin != NULL) && (sin->sin_family == AF_INET) &&
+				(sin->sin_addr.s_addr == addr))
+		{
+			local = 1;
+			break;
+		}
+	}
+	freeifaddrs(ifaddrs);
+	return local;
+}
+
+/* --- reap the snapshot child --- */
+void snapshotReap() {
+pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+	{
+		if (pid == snapshotPid)
+			snapshotPid = 0;
+	}
+}
+
+/* --- write a snapshot from a child process --- */
+void snapshot(sqlite3 *db, char *buf, ssize_t len, 
+	struct sockaddr_in *from_addr) {
+tracker_dump_req_t *req = (tracker_dump_req_t *)buf;
+struct sockaddr_in to_addr;
+FILE *out;
+pid_t pid;
+int fd;
+
+	snapshotReap();
+	if (snapshotPid != 0)
+	{
+		fprintf(stderr, "snapshot:pid %d still running, dropped (%s)\n",
+			(int) snapshotPid, inet_ntoa(from_addr->sin_addr));
+		return;
+	}
+
+	if (!snapshotLocal(from_addr->sin_addr.s_addr))
+	{
+		fprintf(stderr, "snapshot:not a local address, dropped (%s)\n",
+			inet_ntoa(from_addr->sin_addr));
+		return;
+	}
+
+	if ((pid = fork()) < 0)
+	{
+		fprintf(stderr, "snapshot:fork:failed: errno %d\n", errno);
+		return;
+	}
+
+	if (pid > 0)
+	{
+		snapshotPid = pid;
+		fprintf(stderr, "snapshot:pid %d for (%s)\n", (int) pid,
+			inet_ntoa(from_addr->sin_addr));
+		return;
+	}
+
+	if ((len >= sizeof(tracker_dump_req_t)) && (req->port != 0))
+	{
+		memcpy(&to_addr, from_addr, sizeof(to_addr));
+		to_addr.sin_port = req->port;
+
+		if (((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+				(connect(fd, (struct sockaddr *)&to_addr,
+					sizeof(to_addr)) != 0) ||
+				((out = fdopen(fd, "w")) == NULL))
+		{
+			fprintf(stderr, "snapshot:connect:failed: errno %d\n",
+				errno);
+			_exit(1);
+		}
+
+		snapshotWrite(db, out);
+		fclose(out);
+	}
+	else
+	{
+		if ((out = fopen(SNAPSHOT_FILE ".tmp", "w")) == NULL)
+		{
+			fprintf(stderr, "snapshot:fopen:failed: errno %d\n",
+				errno);
+			_exit(1);
+		}
+
+		snapshotWrite(db, out);
+
+		if ((fclose(out) != 0) || 
+				(rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) != 0))
+		{
+			unlink(SNAPSHOT_FILE ".tmp");
+			_exit(1);
+		}
+	}
+
+	_exit(0);
+}
+
 int
 main()
 {
 struct sockaddr_in	from_addr;
 socklen_t		from_addr_len;
+struct timeval		timeout;
+fd_set			sockfds;
 ssize_t			recvbytes;
 int			sockfd;
 char			buf[64*1024];
@@ -562,6 +1786,7 @@ struct timeval		start_time, end_time;
 unsigned long long	s, e;
 sqlite3  *db;
 tracker_lookup_req_t	*req;
+int			rcvbuf;
 
 
 	if ((sockfd = init_tracker_comm(TRACKER_PORT)) < 0) {
@@ -569,6 +1794,15 @@ tracker_lookup_req_t	*req;
 		abort();
 	}
 
+	/*
+	 * a big receive buffer, so a boot storm doesn't overflow it
+	 */
+	rcvbuf = TRACKER_RCVBUF;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			sizeof(rcvbuf)) != 0) {
+		perror("main:setsockopt(SO_RCVBUF):failed:");
+	}
+
 	if ((init_db(&db)) != 0) {
 		fprintf(stderr, "main:init_hash_table:failed\n");
 		abort();
@@ -582,8 +1816,36 @@ tracker_lookup_req_t	*req;
 	 */
 	srand(time(NULL));
 
+	/*
+	 * the snapshot process is reaped by snapshotReap()
+	 */
+	signal(SIGCHLD, SIG_DFL);
+
+	timer_init();
+	lease_db = db;
+	lookupCacheInit();
+	hotInit();
+
+	/* where the hosts are, reloaded when the snapshot changes */
+	topology_init(TOPOLOGY_FILE);
+
 	done = 0;
 	while (!done) {
+		/*
+		 * expire leases, then wait for a message, but no longer than
+		 * the next tick of the timer wheel
+		 */
+		timer_run();
+		timer_next(&timeout);
+		snapshotReap();
+
+		FD_ZERO(&sockfds);
+		FD_SET(sockfd, &sockfds);
+
+		if (select(sockfd + 1, &sockfds, NULL, NULL, &timeout) <= 0) {
+			continue;
+		}
+
 		from_addr_len = sizeof(from_addr);
 		recvbytes = tracker_recv(sockfd, buf, sizeof(buf),
 			(struct sockaddr *)&from_addr, &from_addr_len, NULL);
@@ -606,14 +1868,35 @@ tracker_lookup_req_t	*req;
 			switch(p->op) {
 			case LOOKUP:
 				
+				leaseRenew(from_addr.sin_addr.s_addr);
 				addHost(db, (int) from_addr.sin_addr.s_addr);
 				req = (tracker_lookup_req_t *)buf;
+
+				/* older clients don't send the flags */
+				if (recvbytes < sizeof(tracker_lookup_req_t))
+					req->flags = 0;
+
 				dolookup(db, sockfd, req->hash,
-						req->header.seqno, &from_addr);
+						req->header.seqno, req->flags,
+						&from_addr);
 				break;
 
 			case REGISTER:
-				register_hash(db, buf, &from_addr);
+				leaseRenew(from_addr.sin_addr.s_addr);
+				register_hash(db, sockfd, buf, &from_addr);
+				break;
+
+			case KEEPALIVE:
+				leaseRenew(from_addr.sin_addr.s_addr);
+				break;
+
+			case MANIFEST:
+				domanifest(db, sockfd, buf, recvbytes,
+					&from_addr);
+				break;
+
+			case TIMELINE:
+				dotimeline(buf, recvbytes, sockfd, &from_addr);
 				break;
 
 			case UNREGISTER:
@@ -631,10 +1914,7 @@ tracker_lookup_req_t	*req;
 				exit(0);
 
 			case DUMP_TABLES:
-				fprintf(stderr,
-					"Received 'DUMP_TABLES' from (%s)\n",
-					inet_ntoa(from_addr.sin_addr));
-				dumpTables(db);
+				snapshot(db, buf, recvbytes, &from_addr);
 				break;
 
 			default:
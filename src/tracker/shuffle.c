@@ -200,6 +200,14 @@ getcoop(in_addr_t host, char *attr)
 		}
 	}
 
+	/*
+	 * next, the snapshot of the cluster database
+	 */
+	if ((strcmp(attr, "coop") == 0) &&
+			((value = topology_coop(host)) != NULL)) {
+		return(value);
+	}
+
 	in.s_addr = host;
 	ip = inet_ntoa(in);
 
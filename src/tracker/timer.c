@@ -0,0 +1,249 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * a hierarchical timer wheel.
+ *
+ * time is counted in ticks of TIMER_TICK_MSEC. the wheel has TIMER_LEVELS
+ * levels of TIMER_SLOTS slots each. a timer that expires within the next
+ * TIMER_SLOTS ticks goes into the first level, one slot per tick. timers
+ * further out go into a higher level, where each slot covers TIMER_SLOTS
+ * times as many ticks as a slot in the level below it. every time the
+ * first level wraps around, the next slot of the level above is emptied
+ * and its timers are put back into the wheel closer to their expiry.
+ *
+ * adding, re-arming or removing a timer is O(1), and a tick only touches
+ * the timers that expire (or move down a level) on that tick -- no matter
+ * how many timers are pending.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "tracker.h"
+
+#define	TIMER_SLOT_BITS		6
+#define	TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define	TIMER_SLOT_MASK		(TIMER_SLOTS - 1)
+#define	TIMER_LEVELS		4
+
+static tracker_timer_t		wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned long long	ticks = 0;	/* the current tick */
+static unsigned long long	start;		/* time of tick 0, in msecs */
+
+static unsigned long long
+now_msecs()
+{
+	struct timeval	now;
+
+	gettimeofday(&now, NULL);
+	return((now.tv_sec * 1000ULL) + (now.tv_usec / 1000));
+}
+
+static void
+list_add(tracker_timer_t *head, tracker_timer_t *timer)
+{
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void
+list_del(tracker_timer_t *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+/*
+ * put a timer in the slot that covers its expiry time
+ */
+static void
+wheel_add(tracker_timer_t *timer)
+{
+	int	level;
+	int	shift;
+	int	slot;
+
+	if (timer->expires < ticks) {
+		timer->expires = ticks;
+	}
+
+	/*
+	 * find the lowest level whose current turn of the wheel covers the
+	 * expiry time, that is, the expiry time and now only differ in the
+	 * bits of that level (or below)
+	 */
+	for (level = 0 ; level < TIMER_LEVELS ; ++level) {
+		shift = (level + 1) * TIMER_SLOT_BITS;
+
+		if ((timer->expires >> shift) == (ticks >> shift)) {
+			break;
+		}
+	}
+
+	if (level == TIMER_LEVELS) {
+		/*
+		 * past the end of the wheel. park it in the slot of the top
+		 * level that is cascaded last, it will be looked at again
+		 * then.
+		 */
+		level = TIMER_LEVELS - 1;
+		slot = ((ticks >> (level * TIMER_SLOT_BITS)) - 1) &
+			TIMER_SLOT_MASK;
+	} else {
+		slot = (timer->expires >> (level * TIMER_SLOT_BITS)) &
+			TIMER_SLOT_MASK;
+	}
+
+	list_add(&wheel[level][slot], timer);
+}
+
+/*
+ * move all the timers in one slot of a higher level down the wheel.
+ * returns the index of the slot, so the caller knows if this level
+ * wrapped around too.
+ */
+static int
+cascade(int level)
+{
+	tracker_timer_t	head;
+	tracker_timer_t	*timer;
+	int		slot;
+
+	slot = (ticks >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+
+	if (wheel[level][slot].next == &wheel[level][slot]) {
+		return(slot);
+	}
+
+	/*
+	 * take the whole list off the slot first, a timer may go right back
+	 * into the same slot
+	 */
+	head.next = wheel[level][slot].next;
+	head.prev = wheel[level][slot].prev;
+	head.next->prev = &head;
+	head.prev->next = &head;
+	wheel[level][slot].next = wheel[level][slot].prev = &wheel[level][slot];
+
+	while ((timer = head.next) != &head) {
+		list_del(timer);
+		wheel_add(timer);
+	}
+
+	return(slot);
+}
+
+void
+timer_init()
+{
+	int	i, j;
+
+	for (i = 0 ; i < TIMER_LEVELS ; ++i) {
+		for (j = 0 ; j < TIMER_SLOTS ; ++j) {
+			wheel[i][j].next = wheel[i][j].prev = &wheel[i][j];
+		}
+	}
+
+	ticks = 0;
+	start = now_msecs();
+}
+
+int
+timer_pending(tracker_timer_t *timer)
+{
+	return(timer->next != NULL);
+}
+
+/*
+ * (re)arm a timer to fire in 'msecs' milliseconds
+ */
+void
+timer_add(tracker_timer_t *timer, unsigned int msecs)
+{
+	if (timer_pending(timer)) {
+		list_del(timer);
+	}
+
+	timer->expires = ticks + (msecs + TIMER_TICK_MSEC - 1) /
+		TIMER_TICK_MSEC;
+	wheel_add(timer);
+}
+
+void
+timer_del(tracker_timer_t *timer)
+{
+	if (timer_pending(timer)) {
+		list_del(timer);
+	}
+}
+
+/*
+ * catch up with the clock and call the function of every timer that
+ * expired. a timer function may add or delete any timer.
+ */
+void
+timer_run()
+{
+	unsigned long long	target;
+	tracker_timer_t		*head;
+	tracker_timer_t		*timer;
+	int			level;
+
+	target = (now_msecs() - start) / TIMER_TICK_MSEC;
+
+	while (ticks <= target) {
+		/*
+		 * the first level wrapped around, pull the next slot of each
+		 * higher level down (and stop at the first level that
+		 * didn't wrap)
+		 */
+		if ((ticks & TIMER_SLOT_MASK) == 0) {
+			for (level = 1 ; level < TIMER_LEVELS ; ++level) {
+				if (cascade(level) != 0) {
+					break;
+				}
+			}
+		}
+
+		head = &wheel[0][ticks & TIMER_SLOT_MASK];
+
+		while ((timer = head->next) != head) {
+			list_del(timer);
+			timer->func(timer->arg);
+		}
+
+		++ticks;
+	}
+}
+
+/*
+ * how long until the next tick
+ */
+void
+timer_next(struct timeval *tv)
+{
+	unsigned long long	next;
+	unsigned long long	now;
+
+	next = start + (ticks * TIMER_TICK_MSEC);
+	now = now_msecs();
+
+	if (next <= now) {
+		tv->tv_sec = 0;
+		tv->tv_usec = 0;
+	} else {
+		tv->tv_sec = (next - now) / 1000;
+		tv->tv_usec = ((next - now) % 1000) * 1000;
+	}
+}
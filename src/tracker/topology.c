@@ -0,0 +1,304 @@
+/*
+ * $Id$
+ *
+ * @COPYRIGHT@
+ * @COPYRIGHT@
+ *
+ * $Log$
+ *
+ */
+
+/*
+ * where the hosts are in the cluster network.
+ *
+ * the tracker reads a snapshot of the host -> switch/rack/coop mapping
+ * that export-topology dumps from the cluster database. the snapshot is a
+ * text file with one host per line:
+ *
+ *	<ip> <switch> <rack> <coop>
+ *
+ * a '-' means the value is not known. lines that start with '#' are
+ * comments. the file is checked every TOPOLOGY_POLL_SECS seconds and
+ * reloaded when it changes, so the tracker never has to talk to the
+ * database itself.
+ *
+ * names are turned into small integers when the file is read, so
+ * comparing two hosts is just a couple of integer compares.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tracker.h"
+
+#define	TOPOLOGY_BUCKETS	4096
+#define	TOPOLOGY_POLL_SECS	5
+
+typedef struct topo_host {
+	in_addr_t		ip;
+	int			sw;		/* 0 if not known */
+	int			rack;
+	int			coop;
+	struct topo_host	*next;
+} topo_host_t;
+
+typedef struct {
+	topo_host_t	*buckets[TOPOLOGY_BUCKETS];
+	char		**names;	/* interned switch/rack/coop names */
+	int		numnames;
+	int		maxnames;
+} topology_t;
+
+static topology_t	*topology = NULL;
+static char		*topology_path = NULL;
+static struct stat	topology_stat;
+static tracker_timer_t	topology_timer;
+
+static topo_host_t **
+bucket(topology_t *t, in_addr_t ip)
+{
+	return(&t->buckets[ntohl(ip) % TOPOLOGY_BUCKETS]);
+}
+
+/*
+ * map a name to a number, 0 is 'not known'
+ */
+static int
+intern(topology_t *t, char *name)
+{
+	int	i;
+
+	if (strcmp(name, "-") == 0) {
+		return(0);
+	}
+
+	for (i = 0 ; i < t->numnames ; ++i) {
+		if (strcmp(t->names[i], name) == 0) {
+			return(i + 1);
+		}
+	}
+
+	if (t->numnames == t->maxnames) {
+		char	**names;
+
+		t->maxnames = (t->maxnames == 0 ? 64 : t->maxnames * 2);
+
+		if ((names = realloc(t->names,
+				t->maxnames * sizeof(char *))) == NULL) {
+			return(0);
+		}
+
+		t->names = names;
+	}
+
+	if ((t->names[t->numnames] = strdup(name)) == NULL) {
+		return(0);
+	}
+
+	return(++t->numnames);
+}
+
+static void
+free_topology(topology_t *t)
+{
+	topo_host_t	*host, *next;
+	int		i;
+
+	if (t == NULL) {
+		return;
+	}
+
+	for (i = 0 ; i < TOPOLOGY_BUCKETS ; ++i) {
+		for (host = t->buckets[i] ; host != NULL ; host = next) {
+			next = host->next;
+			free(host);
+		}
+	}
+
+	for (i = 0 ; i < t->numnames ; ++i) {
+		free(t->names[i]);
+	}
+
+	free(t->names);
+	free(t);
+}
+
+static topo_host_t *
+findhost(topology_t *t, in_addr_t ip)
+{
+	topo_host_t	*host;
+
+	if (t == NULL) {
+		return(NULL);
+	}
+
+	for (host = *bucket(t, ip) ; host != NULL ; host = host->next) {
+		if (host->ip == ip) {
+			return(host);
+		}
+	}
+
+	return(NULL);
+}
+
+/*
+ * read the snapshot. the old topology stays in use if the file can't
+ * be read.
+ */
+static int
+load_topology()
+{
+	topology_t	*t;
+	topo_host_t	*host;
+	struct in_addr	in;
+	FILE		*file;
+	char		line[1024];
+	char		ip[64], sw[256], rack[256], coop[256];
+	int		count = 0;
+
+	if ((file = fopen(topology_path, "r")) == NULL) {
+		return(-1);
+	}
+
+	if ((t = (topology_t *)calloc(1, sizeof(topology_t))) == NULL) {
+		fclose(file);
+		return(-1);
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if ((line[0] == '#') || (sscanf(line, "%63s %255s %255s %255s",
+				ip, sw, rack, coop) != 4)) {
+			continue;
+		}
+
+		if (inet_aton(ip, &in) == 0) {
+			continue;
+		}
+
+		if ((host = findhost(t, in.s_addr)) == NULL) {
+			if ((host = (topo_host_t *)malloc(sizeof(*host)))
+					== NULL) {
+				break;
+			}
+
+			host->ip = in.s_addr;
+			host->next = *bucket(t, in.s_addr);
+			*bucket(t, in.s_addr) = host;
+			++count;
+		}
+
+		host->sw = intern(t, sw);
+		host->rack = intern(t, rack);
+		host->coop = intern(t, coop);
+	}
+
+	fclose(file);
+
+	free_topology(topology);
+	topology = t;
+
+	fprintf(stderr, "topology: loaded %d hosts from %s\n", count,
+		topology_path);
+
+	return(0);
+}
+
+/*
+ * timer callback. reload the snapshot if it changed.
+ */
+static void
+poll_topology(void *arg)
+{
+	struct stat	buf;
+
+	if (stat(topology_path, &buf) == 0) {
+		if ((buf.st_mtime != topology_stat.st_mtime) ||
+				(buf.st_size != topology_stat.st_size) ||
+				(buf.st_ino != topology_stat.st_ino)) {
+
+			if (load_topology() == 0) {
+				memcpy(&topology_stat, &buf, sizeof(buf));
+			}
+		}
+	}
+
+	timer_add(&topology_timer, TOPOLOGY_POLL_SECS * 1000);
+}
+
+void
+topology_init(char *path)
+{
+	topology_path = strdup(path);
+	bzero(&topology_stat, sizeof(topology_stat));
+
+	topology_timer.func = poll_topology;
+	topology_timer.arg = NULL;
+
+	poll_topology(NULL);
+}
+
+/*
+ * how far apart two hosts are:
+ *
+ *	TOPO_SAME_SWITCH - on the same switch
+ *	TOPO_SAME_RACK	 - in the same rack
+ *	TOPO_FAR	 - anywhere else (or we don't know)
+ */
+int
+topology_distance(in_addr_t a, in_addr_t b)
+{
+	topo_host_t	*hosta, *hostb;
+
+	if (((hosta = findhost(topology, a)) == NULL) ||
+			((hostb = findhost(topology, b)) == NULL)) {
+		return(TOPO_FAR);
+	}
+
+	if (hosta->sw && (hosta->sw == hostb->sw)) {
+		return(TOPO_SAME_SWITCH);
+	}
+
+	if (hosta->rack && (hosta->rack == hostb->rack)) {
+		return(TOPO_SAME_RACK);
+	}
+
+	return(TOPO_FAR);
+}
+
+/*
+ * the rack of a host as a number (0 if not known). used as the 'groupid'
+ * in the tracker's hosts table.
+ */
+int
+topology_group(in_addr_t ip)
+{
+	topo_host_t	*host;
+
+	if ((host = findhost(topology, ip)) == NULL) {
+		return(0);
+	}
+
+	return(host->rack);
+}
+
+/*
+ * the coop group of a host. the caller frees the returned string.
+ */
+char *
+topology_coop(in_addr_t ip)
+{
+	topo_host_t	*host;
+
+	if (((host = findhost(topology, ip)) == NULL) || (host->coop == 0)) {
+		return(NULL);
+	}
+
+	return(strdup(topology->names[host->coop - 1]));
+}
@@ -126,26 +126,249 @@
 #include "tracker.h"
 #include "fcgi_stdio.h"
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <libgen.h>
 #include <openssl/md5.h>
 #include <rpm/rpmcli.h>
 #include <rpm/rpmts.h>
+#include <time.h>
 
 static char builton[] = { "Built on: " __DATE__ " " __TIME__ };
 
 extern int init(uint16_t *, char *, in_addr_t *, uint16_t *, char *, uint16_t *,
 	in_addr_t *);
-extern int lookup(int, in_addr_t *, uint64_t, tracker_info_t **);
+extern int lookup(int, in_addr_t *, uint64_t, uint32_t, tracker_info_t **,
+	uint64_t *, uint16_t *);
 extern int register_hash(int, in_addr_t *, uint32_t, tracker_info_t *);
+extern int unregister_hash(int, in_addr_t *, uint32_t, tracker_info_t *);
+extern tracker_register_t *register_hash_ack(int, in_addr_t *, uint32_t,
+	tracker_info_t *);
+extern int resend_msg(int, in_addr_t *, tracker_header_t *);
 extern void logmsg(const char *, ...);
 extern int send_msg(int, in_addr_t *, uint16_t);
+extern tracker_manifest_t *manifest_chunk(int, in_addr_t *, uint32_t,
+	uint32_t, uint64_t *);
+extern tracker_timeline_t *timeline_chunk(int, in_addr_t *, uint32_t,
+	char *, uint32_t);
+extern void ring_init(uint16_t, in_addr_t *);
+extern int ring_order(uint64_t, uint16_t, int *);
 extern int check_md5(char *);
+extern int makemanifest();
+extern void migrate_poll();
+extern char *migrate_path(char *, char *, size_t, int);
+extern int migrate_started();
+extern int cache_find(char *, int);
+extern int cache_add(char *, int, uint64_t *, int);
+extern void cache_hot(uint64_t);
+extern void cache_stop();
+extern void cache_foreground(uint64_t, int);
+extern int cache_waiting(uint64_t);
 
 int	status = HTTP_OK;
+
+/*
+ * set when a peer turns us away because it is serving too many other
+ * hosts already (see mod_uploadlimit in the lighttpd package). it still
+ * has the file, so it is not unregistered.
+ */
+int	peerbusy = 0;
 int     isRpm = 0;
+
+/*
+ * the size of the file from the 'Content-Range: bytes *\/<size>' of a
+ * 416 reply, or -1 (see downloadfile())
+ */
+off_t	unsatisfiedsize = -1;
 MD5_CTX	context;
 
+/*
+ * state for passing a byte range of a remote file straight through to
+ * the client (see getremoterange())
+ */
+int	passthru = 0;
+size_t	passthrubytes;
+char	passthrulength[32];
+char	passthrurange[128];
+char	passthrutype[128];
+
+/*
+ * a download that was cut short. the next peer (or package server) is
+ * only asked for the rest of the file.
+ */
+typedef struct {
+	char	*tempfilename;	/* NULL if there is nothing to resume */
+	off_t	offset;		/* how many bytes are in it */
+} partial_t;
+
+/*
+ * how fast each host sent us its last few files, in bytes a second (see
+ * setstall())
+ */
+typedef struct {
+	in_addr_t	ip;
+	uint32_t	rate;
+} peerrate_t;
+
+peerrate_t	peerrates[PEER_RATES];
+
+/*
+ * REGISTER and UNREGISTER messages are not sent to the trackers right
+ * away. they are handed to the control process (see control()) over
+ * CONTROL_FIFO, and it sends them in batches. the control process also fetches
+ * files ahead of the installer (see prefetch()), and is told about them
+ * over the same pipe:
+ *
+ *	PREFETCH	- a hot file a tracker asked us to fetch
+ *	PREDICT		- one of the next files the installer will ask for.
+ *			  a new window of predictions replaces the old one.
+ *	COMPLETE	- the installer read part of a file we don't have,
+ *			  fetch all of it. its name is in COMPLETE_NAME.<hash>,
+ *			  it may not be in the repository.
+ *
+ * whether the installer is waiting for a download isn't sent down the
+ * pipe. it is kept in the cache index (see cache_foreground()), where the
+ * other tracker-client processes see it too.
+ */
+#define	PREFETCH	0x100
+#define	PREDICT		0x101
+#define	COMPLETE	0x104
+
+typedef struct {
+	uint16_t	op;
+	uint16_t	last;		/* PREDICT: last file in the window */
+	in_addr_t	peer;		/* the bad peer, for an UNREGISTER */
+	uint64_t	hash;
+} ctlmsg_t;
+
+int	ctlfd = -1;
+
+/*
+ * the trackers, for when the control process has to be started again
+ * (see startcontrol())
+ */
+uint16_t	ctl_num_trackers = 0;
+in_addr_t	ctl_trackers[MAX_TRACKERS];
+
+/*
+ * in the control process: its end of CONTROL_FIFO and its lock on
+ * CONTROL_MARKER. the processes it forks close them, so they don't keep
+ * it alive for the other tracker-client processes.
+ */
+int	ctl_readfd = -1;
+int	ctl_lockfd = -1;
+
+/*
+ * set when the files are spread over the trackers (var.trackermode is
+ * "partition"). then each file is only registered with and looked up on
+ * the tracker that owns it on the hash ring, or the next one around the
+ * ring if the owner doesn't answer.
+ */
+int	partitioned = 0;
+
+/*
+ * the names of the files in the repository (NAMES_FILE), sorted by hash.
+ * a file the tracker(s) only tell us the hash of (a predicted or a hot
+ * file) can only be prefetched if we know its name.
+ */
+typedef struct {
+	uint64_t	hash;
+	char		*name;
+} file_name_t;
+
+file_name_t	*file_names = NULL;
+uint32_t	file_numnames = 0;
+time_t		names_mtime = 0;
+
+/*
+ * files the installer read part of, predicted files and hot files waiting
+ * to be fetched (in that order), and the process that is fetching one
+ */
+#define	FROM_COMPLETE	0
+#define	FROM_PREDICT	1
+#define	FROM_HOT	2
+
+uint64_t		completeq[PREFETCH_WINDOW];
+int			completelen = 0;
+uint64_t		prefetchq[PREFETCH_QUEUE];
+int			prefetchlen = 0;
+uint64_t		predictq[PREFETCH_WINDOW];
+int			predictlen = 0;
+uint64_t		newwindow[PREFETCH_WINDOW];
+int			newwindowlen = 0;
+pid_t			prefetch_pid = -1;
+uint64_t		prefetch_hash;
+int			prefetch_from;
+
+/*
+ * set while this process is serving a request from a prefetch (of
+ * 'prefetching_hash'). 'prefetchyield' is set when the download was
+ * stopped because the installer is waiting for another file.
+ */
+int		prefetching = 0;
+uint64_t	prefetching_hash;
+int		prefetchyield = 0;
+
+/*
+ * REGISTER batches that are waiting for an ack from a tracker. like the
+ * round trip times below, these live in the control process, so there is
+ * one set for the whole node (see startcontrol()).
+ */
+typedef struct {
+	tracker_register_t	*msg;		/* NULL if the slot is free */
+	int			tracker;
+	int			tries;
+	unsigned long long	sent;		/* when it was first sent */
+	unsigned long long	deadline;	/* when to send it again */
+} pending_t;
+
+pending_t	pending[CTL_PENDING];
+
+/*
+ * the manifest goes to each tracker one chunk at a time, and the timeline
+ * to the first tracker. a chunk waits here for its ack. readacks() picks
+ * the acks up along with the REGISTER acks, so the control loop never
+ * waits for them, and retransmit() sends a late chunk again like a
+ * REGISTER batch.
+ */
+typedef struct {
+	tracker_header_t	*msg;		/* NULL if nothing is waiting */
+	int			tries;
+	unsigned long long	deadline;	/* when to send it again */
+} upload_t;
+
+upload_t	manifest_upload[MAX_TRACKERS];
+uint64_t	*manifest_hashes = NULL;
+uint32_t	manifest_numhashes = 0;
+time_t		manifest_mtime = 0;	/* 0 to send it (again) */
+pid_t		manifest_pid = -1;	/* writing MANIFEST_FILE */
+int		manifest_tries = 0;
+
+upload_t	timeline_upload;
+uint32_t	timeline_offset = 0;	/* how much the tracker has */
+
+/*
+ * smoothed round trip time, its variance and the retransmit timeout for
+ * each tracker, in msecs. all of this node's REGISTER batches feed the
+ * same estimate.
+ */
+long		srtt[MAX_TRACKERS];
+long		rttvar[MAX_TRACKERS];
+long		rto[MAX_TRACKERS];
+
+/*
+ * counters. 'registered' and 'dropped' count hashes, 'retransmits'
+ * counts messages.
+ */
+unsigned long long	registered = 0;
+unsigned long long	retransmits = 0;
+unsigned long long	dropped = 0;
+
 
 int
 getargs(char *forminfo, char *filename)
@@ -238,6 +461,50 @@ doheaders(void *ptr, size_t size, size_t nmemb, void *stream)
 	if ((status >= HTTP_OK) && (status <= HTTP_MULTI_STATUS)) {
 		if (sscanf(ptr, "HTTP/1.1 %d", &httpstatus) == 1) {
 			status = httpstatus;
+
+			if (httpstatus == HTTP_SERVICE_UNAVAILABLE) {
+				peerbusy = 1;
+			}
+		}
+	}
+
+	if ((status == HTTP_RANGE_NOT_SATISFIABLE) &&
+			(strncasecmp(ptr, "Content-Range:", 14) == 0)) {
+		long long	size;
+
+		if (sscanf((char *)ptr + 14, " bytes */%lld", &size) == 1) {
+			unsatisfiedsize = (off_t)size;
+		}
+	}
+
+	if (passthru) {
+		if (strncasecmp(ptr, "Content-Length:", 15) == 0) {
+			sscanf((char *)ptr + 15, " %31[0-9]", passthrulength);
+		} else if (strncasecmp(ptr, "Content-Range:", 14) == 0) {
+			sscanf((char *)ptr + 14, " %127[^\r\n]", passthrurange);
+		} else if (strncasecmp(ptr, "Content-Type:", 13) == 0) {
+			/*
+			 * a multipart/byteranges reply has the boundary in
+			 * here
+			 */
+			sscanf((char *)ptr + 13, " %127[^\r\n]", passthrutype);
+		} else if ((size * nmemb) <= 2) {
+			/*
+			 * end of the headers. if the server didn't honor the
+			 * range, then don't output anything
+			 */
+			if (status != HTTP_PARTIAL_CONTENT) {
+				status = HTTP_RANGE_NOT_SATISFIABLE;
+			} else {
+				printf("HTTP/1.1 %d\n", HTTP_PARTIAL_CONTENT);
+				printf("Content-Type: %s\n", passthrutype);
+				printf("Content-Length: %s\n", passthrulength);
+				if (passthrurange[0] != '\0') {
+					printf("Content-Range: %s\n",
+						passthrurange);
+				}
+				printf("\n");
+			}
 		}
 	}
 
@@ -247,7 +514,21 @@ doheaders(void *ptr, size_t size, size_t nmemb, void *stream)
 size_t
 dobody(void *ptr, size_t size, size_t nmemb, void *stream)
 {
-	if ((status >= HTTP_OK) && (status <= HTTP_MULTI_STATUS)) {
+	if (passthru) {
+		if (status == HTTP_PARTIAL_CONTENT) {
+			fwrite(ptr, size, nmemb, stream);
+			passthrubytes += size * nmemb;
+		}
+	} else if ((status >= HTTP_OK) && (status <= HTTP_MULTI_STATUS)) {
+		/*
+		 * a prefetch stops when the installer starts waiting for a
+		 * download of another file
+		 */
+		if (prefetching && cache_waiting(prefetching_hash)) {
+			prefetchyield = 1;
+			return(0);
+		}
+
 		fwrite(ptr, size, nmemb, stream);
 		if ( isRpm == 0 ){
 			if (MD5_Update(&context, ptr, size * nmemb) != 1) {
@@ -311,131 +592,246 @@ do_sendfile(char *filename, char *range)
 	printf("\n");
 }
 
+/*
+ * a byte range of a file, both ends included. a request may ask for at
+ * most MAX_RANGES of them.
+ */
+#define	MAX_RANGES	32
+
+typedef struct {
+	off_t	first;
+	off_t	last;
+} byterange_t;
+
+/*
+ * parse the value of a Range header (without the 'bytes=') for a file of
+ * 'size' bytes, as in RFC 7233:
+ *
+ *	first-last	- the bytes from 'first' to 'last'
+ *	first-		- the bytes from 'first' to the end of the file
+ *	-count		- the last 'count' bytes of the file
+ *
+ * separated by commas. a range that starts past the end of the file is
+ * left out. returns the number of ranges that are left, or -1 if the
+ * header is not valid (then it is ignored and the whole file is sent).
+ */
 int
-outputfile(char *filename, char *range)
+parseranges(char *spec, off_t size, byterange_t *ranges, int max)
 {
-	struct stat	statbuf;
-	off_t		offset;
-	size_t		lastbyte;
-	size_t		totalbytes;
-	size_t		bytesread;
-	char		done;
-	char		buf[128*1024];
-	size_t		count;
-	int		fd;
+	long long	first, last;
+	char		*ptr, *end;
+	int		n = 0;
 
-	/*
-	 * make sure the file exists
-	 */
-	if (stat(filename, &statbuf) != 0) {
-		return(-1);
-	}
+	ptr = spec;
 
-	/*
-	 * if a range is supplied, then we need to calculate the offset
-	 * and total number of bytes to read
-	 */
-	if (range != NULL) {
+	while (1) {
+		while ((*ptr == ' ') || (*ptr == '\t')) {
+			++ptr;
+		}
 
-		/*
-		 * there are three cases:
-		 *
-		 *	1) there is no 'offset' supplied. this means read from
-		 *	   the beginning of the file (offset 0).
-		 *
-		 *	2) there is no 'last byte' supplied. this means read
-		 *	   to the end of the file
-		 *
-		 *	3) both 'offset and 'last byte' are supplied.
-		 */
-		if (range[0] == '-') {
+		if (*ptr == '-') {
 			/*
-			 * case 1
+			 * the last 'count' bytes
 			 */
-			sscanf(range, "-%ld", &lastbyte);
-			offset = 0;
-		} else if (range[strlen(range) - 1] == '-') {
-			/*
-			 * case 2
-			 */
-			sscanf(range, "%ld-", &offset);
-			lastbyte = statbuf.st_size;
+			last = strtoll(ptr + 1, &end, 10);
+			if ((end == ptr + 1) || (last < 0)) {
+				return(-1);
+			}
+
+			first = (last > size ? 0 : size - last);
+			last = size - 1;
+
+			if (first > last) {
+				first = size;	/* a count of 0 */
+			}
 		} else {
-			/*
-			 * case 3
-			 */
-			sscanf(range, "%ld-%ld", &offset, &lastbyte);
+			first = strtoll(ptr, &end, 10);
+			if ((end == ptr) || (*end != '-') || (first < 0)) {
+				return(-1);
+			}
+
+			ptr = end + 1;
+			last = strtoll(ptr, &end, 10);
+			if (end == ptr) {
+				last = size - 1;
+			} else if (last < first) {
+				return(-1);
+			} else if (last >= size) {
+				last = size - 1;
+			}
 		}
 
-		totalbytes = (lastbyte - offset) + 1;
+		ptr = end;
+		while ((*ptr == ' ') || (*ptr == '\t')) {
+			++ptr;
+		}
 
-	} else {
-		offset = 0;
-		totalbytes = statbuf.st_size;
+		if ((*ptr != ',') && (*ptr != '\0')) {
+			return(-1);
+		}
+
+		if (first < size) {
+			if (n == max) {
+				return(-1);
+			}
+
+			ranges[n].first = first;
+			ranges[n].last = last;
+			++n;
+		}
+
+		if (*ptr == '\0') {
+			break;
+		}
+
+		++ptr;
 	}
 
-	if ((fd = open(filename, O_RDONLY)) < 0) {
-		logmsg("outputfile:open failed:errno (%d)\n", errno);
+	return(n);
+}
+
+/*
+ * copy 'count' bytes of a file, starting at 'offset', to stdout
+ */
+int
+sendbytes(int fd, off_t offset, off_t count)
+{
+	char	buf[128*1024];
+	ssize_t	i;
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		logmsg("sendbytes:lseek failed:errno (%d)\n", errno);
 		return(-1);
 	}
 
-	if (offset > 0) {
-		int	s;
-
-		if ((s = lseek(fd, offset, SEEK_SET)) < 0) {
-			logmsg("outputfile:lseek failed:errno (%d)\n", errno);
-			logmsg("outputfile:lseek failed:s (%d)\n", s);
-			close(fd);
+	while (count > 0) {
+		if ((i = read(fd, buf, min((off_t)sizeof(buf), count))) <= 0) {
+			if (i < 0) {
+				logmsg("sendbytes:read failed: errno (%d)\n",
+					errno);
+			}
 			return(-1);
 		}
+
+		/*
+		 * output the buffer on stdout
+		 */
+		fwrite(buf, i, 1, stdout);
+		count -= i;
 	}
 
+	return(0);
+}
+
+/*
+ * the header of one part of a multipart/byteranges response
+ */
+int
+partheader(char *buf, size_t len, char *boundary, byterange_t *range,
+	off_t size)
+{
+	return(snprintf(buf, len, "\r\n--%s\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+		(long long)range->first, (long long)range->last,
+		(long long)size));
+}
+
+int
+outputfile(char *filename, char *range)
+{
+	struct stat	statbuf;
+	byterange_t	ranges[MAX_RANGES];
+	char		boundary[64];
+	char		header[256];
+	off_t		totalbytes;
+	int		numranges;
+	int		fd, i;
+
 	/*
-	 * output the HTTP headers
+	 * make sure the file exists
 	 */
-	if (range != NULL) {
-		printf("HTTP/1.1 %d\n", HTTP_PARTIAL_CONTENT);
-	} else {
-		printf("HTTP/1.1 %d\n", status);
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return(-1);
 	}
 
-	printf("Content-Type: application/octet-stream\n");
-	printf("Content-Length: %d\n", (int)totalbytes);
-	printf("\n");
+	if (fstat(fd, &statbuf) != 0) {
+		logmsg("outputfile:fstat failed:errno (%d)\n", errno);
+		close(fd);
+		return(-1);
+	}
 
-	bytesread = 0;
-	done = 0;
+	numranges = -1;
+	if (range != NULL) {
+		numranges = parseranges(range, statbuf.st_size, ranges,
+			MAX_RANGES);
+	}
 
 #ifdef	DEBUG
-	logmsg("outputfile:filename (%s)\n", filename);
+	logmsg("outputfile:filename (%s) : ranges (%d)\n", filename,
+		numranges);
 #endif
 
-	while (!done) {
-		ssize_t	i;
+	/*
+	 * output the HTTP headers, then the bytes
+	 */
+	if (numranges == 0) {
+		printf("HTTP/1.1 %d\n", HTTP_RANGE_NOT_SATISFIABLE);
+		printf("Content-Range: bytes */%lld\n",
+			(long long)statbuf.st_size);
+		printf("Content-Length: 0\n");
+		printf("\n");
+	} else if (numranges == 1) {
+		totalbytes = (ranges[0].last - ranges[0].first) + 1;
 
-		if ((sizeof(buf) + bytesread) > totalbytes) {
-			count = totalbytes - bytesread;
-		} else {
-			count = sizeof(buf);
+		printf("HTTP/1.1 %d\n", HTTP_PARTIAL_CONTENT);
+		printf("Content-Type: application/octet-stream\n");
+		printf("Content-Length: %lld\n", (long long)totalbytes);
+		printf("Content-Range: bytes %lld-%lld/%lld\n",
+			(long long)ranges[0].first, (long long)ranges[0].last,
+			(long long)statbuf.st_size);
+		printf("\n");
+
+		sendbytes(fd, ranges[0].first, totalbytes);
+	} else if (numranges > 1) {
+		snprintf(boundary, sizeof(boundary), "TRACKER%08lx%08lx",
+			(unsigned long)time(NULL), (unsigned long)random());
+
+		totalbytes = strlen("\r\n--") + strlen(boundary) +
+			strlen("--\r\n");
+		for (i = 0 ; i < numranges ; ++i) {
+			totalbytes += partheader(header, sizeof(header),
+				boundary, &ranges[i], statbuf.st_size) +
+				(ranges[i].last - ranges[i].first) + 1;
 		}
 
-		if ((i = read(fd, buf, count)) < 0) {
-			logmsg("outputfile:read failed: errno (%d)\n", errno);
-			done = 1;
-			continue;
+		printf("HTTP/1.1 %d\n", HTTP_PARTIAL_CONTENT);
+		printf("Content-Type: multipart/byteranges; boundary=%s\n",
+			boundary);
+		printf("Content-Length: %lld\n", (long long)totalbytes);
+		printf("\n");
+
+		for (i = 0 ; i < numranges ; ++i) {
+			partheader(header, sizeof(header), boundary,
+				&ranges[i], statbuf.st_size);
+			fputs(header, stdout);
+
+			if (sendbytes(fd, ranges[i].first, (ranges[i].last -
+					ranges[i].first) + 1) != 0) {
+				break;
+			}
 		}
 
-		/*
-		 * output the buffer on stdout
-		 */
-		fwrite(buf, i, 1, stdout);
-
-		bytesread += i;
+		printf("\r\n--%s--\r\n", boundary);
+	} else {
+		printf("HTTP/1.1 %d\n", status);
+		printf("Content-Type: application/octet-stream\n");
+		printf("Content-Length: %lld\n", (long long)statbuf.st_size);
+		printf("\n");
 
-		if (bytesread >= totalbytes) {
-			done = 1;
-		}
+		sendbytes(fd, 0, statbuf.st_size);
 	}
+
 	fflush(stdout);
 
 	close(fd);
@@ -444,12 +840,51 @@ outputfile(char *filename, char *range)
 
 unsigned long long	curltime;
 
+/*
+ * downloadfile() return codes
+ */
+#define	DOWNLOAD_OK		0
+#define	DOWNLOAD_FAILED		-1	/* the file is no good */
+#define	DOWNLOAD_CUT		-2	/* the transfer broke off. the bytes */
+					/* in the file so far are good */
+
+/*
+ * the first 'offset' bytes of a file we are resuming were written by an
+ * earlier transfer. put them in the checksum before the new ones.
+ */
+int
+md5prefix(char *filename, off_t offset)
+{
+	char	buf[128*1024];
+	ssize_t	i;
+	int	fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return(-1);
+	}
+
+	while (offset > 0) {
+		if ((i = read(fd, buf, min(sizeof(buf), offset))) <= 0) {
+			close(fd);
+			return(-1);
+		}
+
+		MD5_Update(&context, buf, i);
+		offset -= i;
+	}
+
+	close(fd);
+	return(0);
+}
+
 /**
- * downloadfile it downloads the file and checks for integrity
- * if some errors are found it return -1 otherwise 0
+ * downloadfile it downloads the file and checks for integrity.
+ * if 'offset' is not 0, the first 'offset' bytes are already in the
+ * file and only the rest is asked for.
  */
 int
-downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realfilename)
+downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp,
+	char *realfilename, off_t offset)
 {
 	CURLcode		curlcode;
 #ifdef	TIMEIT
@@ -461,7 +896,8 @@ downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realf
 			CURLE_OK) {
 		logmsg("downloadfile:curl_easy_setopt():failed:(%d)\n",
 			curlcode);
-		return(-1);
+		fclose(fp);
+		return(DOWNLOAD_CUT);
 	}
 
 	if ( isRpm == 0) {
@@ -469,8 +905,19 @@ downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realf
 			fprintf(stderr, "MD5_Init failed\n");
 			exit(-1);
 		}
+
+		if ((offset > 0) && (md5prefix(filename, offset) != 0)) {
+			logmsg("downloadfile:md5prefix failed:errno (%d)\n",
+				errno);
+			fclose(fp);
+			return(DOWNLOAD_FAILED);
+		}
 	}
 
+	curl_easy_setopt(curlhandle, CURLOPT_RESUME_FROM_LARGE,
+		(curl_off_t)offset);
+	unsatisfiedsize = -1;
+
 #ifdef	DEBUG
 	logmsg("URL : ");
 	logmsg(url);
@@ -481,10 +928,23 @@ downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realf
 	gettimeofday(&start_time, NULL);
 #endif
 
-	if ((curlcode = curl_easy_perform(curlhandle)) != CURLE_OK) {
+	curlcode = curl_easy_perform(curlhandle);
+	curl_easy_setopt(curlhandle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+
+	if (curlcode != CURLE_OK) {
 		logmsg("downloadfile:curl_easy_perform():failed:(%d)\n",
 			curlcode);
-		return(-1);
+		fclose(fp);
+
+		/*
+		 * the server ignored the range, what it sent can't be
+		 * glued onto the end of the file
+		 */
+		if (curlcode == CURLE_RANGE_ERROR) {
+			return(DOWNLOAD_FAILED);
+		}
+
+		return(DOWNLOAD_CUT);
 	}
 
 #ifdef	TIMEIT
@@ -496,10 +956,33 @@ downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realf
 #endif
 
 	fclose(fp);
+
+	/*
+	 * the earlier transfer got all of the file, it just broke off before
+	 * it was done. there is nothing left to ask for, the server says so
+	 * with a 416.
+	 */
+	if ((offset > 0) && (status == HTTP_RANGE_NOT_SATISFIABLE) &&
+			(unsatisfiedsize == offset)) {
+		logmsg("downloadfile:%s was complete at %lld\n", url,
+			(long long)offset);
+		status = HTTP_OK;
+	}
+
+	/*
+	 * dobody() doesn't write anything unless the server said OK
+	 */
+	if ((status < HTTP_OK) || (status > HTTP_MULTI_STATUS)) {
+		return(DOWNLOAD_CUT);
+	}
+
 	if ( isRpm ){
 		//this is not an rpm we can't do any checking
 		logmsg("downloadfile:isRpm:file %s is an rpm going to verify\n", filename);
-		return verifyRpmPackage(filename);
+		if (verifyRpmPackage(filename) != 0)
+			return DOWNLOAD_FAILED;
+		else
+			return DOWNLOAD_OK;
 	}
 	else{
 		//verify 'normal' file
@@ -517,9 +1000,9 @@ downloadfile(CURL *curlhandle, char *url, char *filename, FILE * fp, char *realf
 		
 		if( check_md5(realfilename) == -1)
 			//return error
-			return -1;
+			return DOWNLOAD_FAILED;
 		else 
-			return 0;
+			return DOWNLOAD_OK;
 	}
 }
 
@@ -577,30 +1060,190 @@ int
 getlocal(char *filename, char *range)
 {
 	struct stat	buf;
+	char		path[PATH_MAX];
+	int		i;
 
-	if (stat(filename, &buf) == 0) {
-
-#ifdef	DEBUG
-		logmsg("getlocal:file (%s)\n", filename);
-#endif
-
+	/*
+	 * while the cache is on the ramdisk, the index knows what is in it
+	 */
+	switch (cache_find(filename, !prefetching)) {
+	case CACHE_HIT:
 		status = HTTP_OK;
 
-		if (outputfile(filename, range) != 0) {
-			logmsg("outputfile():failed:(%d)\n", errno);
-			return(-1);
+		if (outputfile(filename, range) == 0) {
+			return(0);
 		}
-	} else {
+
+		/*
+		 * it was thrown away or moved under us. look for it below.
+		 */
+		break;
+
+	case CACHE_MISS:
 		return(-1);
+
+	default:
+		break;
 	}
 
-	return(0);
-}
+	/*
+	 * while the cache is being moved to the disk, a file can go away
+	 * from the ramdisk between the lookup and the open. just look for
+	 * it again -- by then it will be on the disk.
+	 */
+	for (i = 0 ; i < 2 ; ++i) {
+		migrate_path(filename, path, sizeof(path), 0);
 
-char *fromip;
+		if (stat(path, &buf) != 0) {
+			continue;
+		}
+
+#ifdef	DEBUG
+		logmsg("getlocal:file (%s)\n", path);
+#endif
+
+		status = HTTP_OK;
+
+		if (outputfile(path, range) == 0) {
+			return(0);
+		}
+
+		logmsg("outputfile():failed:(%d)\n", errno);
+	}
+
+	return(-1);
+}
+
+char *fromip;
+
+/*
+ * fold the speed of the last transfer from 'ip' into its rate
+ */
+void
+peerrate(in_addr_t ip, CURL *curlhandle)
+{
+	peerrate_t	*p = &peerrates[ntohl(ip) % PEER_RATES];
+	double		speed, size;
+
+	if ((curl_easy_getinfo(curlhandle, CURLINFO_SIZE_DOWNLOAD, &size) !=
+			CURLE_OK) || (size < STALL_SAMPLE_BYTES)) {
+		return;
+	}
+
+	if (curl_easy_getinfo(curlhandle, CURLINFO_SPEED_DOWNLOAD, &speed) !=
+			CURLE_OK) {
+		return;
+	}
+
+	if ((p->ip != ip) || (p->rate == 0)) {
+		p->ip = ip;
+		p->rate = (uint32_t)speed;
+	} else {
+		p->rate = ((3 * (uint64_t)p->rate) + (uint32_t)speed) / 4;
+	}
+}
+
+/*
+ * give up on a transfer from 'ip' that has been moving slower than a
+ * fraction of its usual rate for STALL_SECS seconds
+ */
+void
+setstall(CURL *curlhandle, in_addr_t ip)
+{
+	peerrate_t	*p = &peerrates[ntohl(ip) % PEER_RATES];
+	long		limit = STALL_MIN_RATE;
+
+	if ((p->ip == ip) && ((p->rate / STALL_RATIO) > limit)) {
+		limit = p->rate / STALL_RATIO;
+	}
+
+	curl_easy_setopt(curlhandle, CURLOPT_LOW_SPEED_LIMIT, limit);
+	curl_easy_setopt(curlhandle, CURLOPT_LOW_SPEED_TIME, (long)STALL_SECS);
+}
+
+/*
+ * pass the byte range(s) of a file that is not cached here straight
+ * through from a peer to the client. this is used by the loader to read
+ * blocks of a big image (e.g., install.img) on demand, and by the
+ * installer to read package headers. the whole file is only downloaded
+ * (by the prefetcher) if it is in the installer's manifest, so a big image
+ * is never copied to the ramdisk.
+ */
+int
+getremoterange(char *filename, peer_t *peer, char *range, CURL *curlhandle)
+{
+	CURLcode	curlcode;
+	struct in_addr	in;
+	char		url[PATH_MAX];
+	int		retval;
+
+	in.s_addr = peer->ip;
+
+	if (makeurl("http://", filename, inet_ntoa(in), url, sizeof(url)) != 0){
+		logmsg("getremoterange:makeurl():failed:(%d)", errno);
+		return(-1);
+	}
+
+	if (fromip != NULL) {
+		free(fromip);
+	}
+	fromip = strdup(inet_ntoa(in));
+
+	status = HTTP_OK;
+	passthru = 1;
+	passthrubytes = 0;
+	strcpy(passthrulength, "0");
+	passthrurange[0] = '\0';
+	strcpy(passthrutype, "application/octet-stream");
+
+	curl_easy_setopt(curlhandle, CURLOPT_WRITEDATA, stdout);
+	curl_easy_setopt(curlhandle, CURLOPT_URL, url);
+	curl_easy_setopt(curlhandle, CURLOPT_RANGE, range);
+
+	if ((curlcode = curl_easy_perform(curlhandle)) != CURLE_OK) {
+		logmsg("getremoterange:curl_easy_perform():failed:(%d)\n",
+			curlcode);
+	}
+
+	curl_easy_setopt(curlhandle, CURLOPT_RANGE, NULL);
+	passthru = 0;
+
+	if ((curlcode == CURLE_OK) && (status == HTTP_PARTIAL_CONTENT)) {
+		retval = 0;
+	} else if (passthrubytes > 0) {
+		/*
+		 * part of the range has already been sent to the client, so
+		 * we can't try another peer. the client will see a short
+		 * read and ask again.
+		 */
+		logmsg("getremoterange:short transfer:url %s\n", url);
+		retval = 0;
+	} else {
+		retval = -1;
+	}
+
+	fflush(stdout);
+	return(retval);
+}
+
+/*
+ * throw away a partly downloaded file
+ */
+void
+dropremote(partial_t *part)
+{
+	if (part->tempfilename != NULL) {
+		unlink(part->tempfilename);
+		free(part->tempfilename);
+		part->tempfilename = NULL;
+	}
+
+	part->offset = 0;
+}
 
 int
-getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
+getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle,
+	partial_t *part)
 {
 #ifdef	TIMEIT
 	struct timeval		start_time, end_time;
@@ -610,10 +1253,11 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	struct in_addr	in;
 	struct stat	buf;
 	FILE		*file;
-	useconds_t	stall;
+	int		retval;
 	char		*tempfilename;
 	char		*dirfile, *basefile;
 	char		url[PATH_MAX];
+	char		localname[PATH_MAX];
 	char		*dir;
 	char		*ptr;
 
@@ -628,32 +1272,29 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 #endif
 
 	status = HTTP_OK;
+	peerbusy = 0;
 
 	/*
 	 * we know the file is not on the local hard disk (because getlocal()
 	 * is called before this function), so try to download the file
 	 * from a peer
 	 */
+	if (range != NULL) {
+		return(getremoterange(filename, peer, range, curlhandle));
+	}
 
 	/*
 	 * first, let's see if the file systems have been formatted. if
-	 * so, then copy over all the files that were downloaded in the
-	 * first part of the installation (e.g., stage2.img, product.img)
-	 * and set up a symbolic link from the ramdisk area to the disk.
+	 * so, a background process moves all the files that were downloaded
+	 * in the first part of the installation (e.g., stage2.img,
+	 * product.img) to the disk and then sets up a symbolic link from the
+	 * ramdisk area to the disk. from then on, new files go to the disk.
 	 */
-	if (stat("/mnt/sysimage", &buf) == 0) {
-		if (stat("/mnt/sysimage/install", &buf) != 0) {
-			if (stat("/install", &buf) == 0) 
-			{
-				system("/usr/bin/cp -R /install /mnt/sysimage");
-				system("/usr/bin/rm -rf /install");
-			}
-			else
-			{
-				mkdir("/mnt/sysimage/install", 0755);
-			}
-			symlink("/mnt/sysimage/install", "/install");
-		}
+	migrate_poll();
+	migrate_path(filename, localname, sizeof(localname), 1);
+
+	if (migrate_started()) {
+		cache_stop();
 	}
 
 #ifdef	TIMEIT
@@ -666,7 +1307,7 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	/*
 	 * make sure the destination directory exists
 	 */
-	if ((dir = strdup(filename)) != NULL) {
+	if ((dir = strdup(localname)) != NULL) {
 		if ((ptr = rindex(dir, '/')) != NULL) {
 			*ptr = '\0';
 			if (stat(dir, &buf) != 0) {
@@ -684,33 +1325,42 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	logmsg("getremote:svc time2: %lld usec\n", (e - s));
 #endif
 
-	if ((dirfile = strdup(filename)) == NULL) {
-		logmsg("getremote:strdup failed:errno (%d)\n", errno);
-		return(-1);
-	}
+	if (part->tempfilename == NULL) {
+		if ((dirfile = strdup(localname)) == NULL) {
+			logmsg("getremote:strdup failed:errno (%d)\n", errno);
+			return(-1);
+		}
 
-	if ((basefile = strdup(filename)) == NULL) {
-		logmsg("getremote:strdup failed:errno (%d)\n", errno);
-		return(-1);
-	}
+		if ((basefile = strdup(localname)) == NULL) {
+			logmsg("getremote:strdup failed:errno (%d)\n", errno);
+			free(dirfile);
+			return(-1);
+		}
+
+		if ((part->tempfilename = tempnam(dirname(dirfile),
+				basename(basefile))) == NULL) {
+			free(dirfile);
+			free(basefile);
+			logmsg("getremote:tempnam():failed\n");
+			return(-1);
+		}
 
-	if ((tempfilename = tempnam(dirname(dirfile), basename(basefile))) ==
-			NULL) {
 		free(dirfile);
 		free(basefile);
-		logmsg("getremote:tempnam():failed\n");
-		return(-1);
+
+		part->offset = 0;
 	}
 
-	free(dirfile);
-	free(basefile);
+	tempfilename = part->tempfilename;
 
 	/*
-	 * make a 'http://' url and get the file.
+	 * make a 'http://' url and get the file. if an earlier peer got
+	 * part of the file, ask this one for the rest.
 	 */
-	if ((file = fopen(tempfilename, "w")) == NULL) {
+	if ((file = fopen(tempfilename, (part->offset > 0 ? "a" : "w"))) ==
+			NULL) {
 		logmsg("getremote:fopen():failed\n");
-		free(tempfilename);
+		dropremote(part);
 		return(-1);
 	}
 
@@ -728,13 +1378,15 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	if ((curlcode = curl_easy_setopt(curlhandle, CURLOPT_WRITEDATA,
 			file)) != CURLE_OK) {
 		logmsg("getremote:curl_easy_setopt():failed:(%d)\n", curlcode);
-		free(tempfilename);
+		fclose(file);
+		dropremote(part);
 		return(-1);
 	}
 
 	if (makeurl("http://", filename, inet_ntoa(in), url, sizeof(url)) != 0){
 		logmsg("getremote:makeurl():failed:(%d)", errno);
-		free(tempfilename);
+		fclose(file);
+		dropremote(part);
 		return(-1);
 	}
 
@@ -772,37 +1424,38 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	logmsg("getremote:svc time4: %lld usec\n", (e - s));
 #endif
 
-	stall = 10000;
+	if (part->offset > 0) {
+		logmsg("getremote:resume %s at %lld from %s\n",
+			filename, (long long)part->offset, fromip);
+	}
+
+	retval = downloadfile(curlhandle, url, tempfilename, file, filename,
+		part->offset);
 
-	while (stall < 1000000) {
-		if (downloadfile(curlhandle, url, tempfilename, file, filename) < 0) {
-			status = HTTP_NOT_FOUND;
-		}
+	peerrate(peer->ip, curlhandle);
+
+	if (retval != DOWNLOAD_OK) {
+		status = HTTP_NOT_FOUND;
+	}
 #ifdef	DEBUG
-		logmsg("getremote:download status %d : stall %d\n",
-			status, stall);
+	logmsg("getremote:download status %d\n", status);
 #endif
 
-		if ((status >= HTTP_OK) && (status <= HTTP_MULTI_STATUS)) {
-			/*
-			 * success. break out of loop
-			 */
-			break;
-		} else {
-			logmsg("getremote:downloadfile:failed:url %s\n", url);
+	if ((status < HTTP_OK) || (status > HTTP_MULTI_STATUS)) {
+		logmsg("getremote:downloadfile:failed:url %s\n", url);
 
-			if (peer->state == DOWNLOADING) {
-				stall *= 10;
-				usleep(stall);	
-			} else {
-				/*
-				 * don't return on failure here. we still need
-				 * to do some cleanup
-				 */
-				status = HTTP_NOT_FOUND;
-				break;
-			}
+		/*
+		 * keep what we have if it is good, the next try picks up
+		 * from there
+		 */
+		if ((retval == DOWNLOAD_CUT) &&
+				(stat(tempfilename, &buf) == 0)) {
+			part->offset = buf.st_size;
+		} else {
+			part->offset = 0;
 		}
+
+		status = HTTP_NOT_FOUND;
 	}
 
 
@@ -821,26 +1474,29 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 		/*
 		 * now do an atomic move
 		 */
-		if (rename(tempfilename, filename) < 0) {
+		if (rename(tempfilename, localname) < 0) {
 			logmsg("getremote:rename():failed:(%d)\n", errno);
-			free(tempfilename);
+			dropremote(part);
 			return(-1);
 		}
+
+		free(part->tempfilename);
+		part->tempfilename = NULL;
+		part->offset = 0;
 		
-		if (outputfile(filename, range) != 0) {
+		if (outputfile(localname, range) != 0) {
 			logmsg("getremote:outputfile():failed:(%d)\n", errno);
-			free(tempfilename);
 			return(-1);
 		}
 	} else {
 		/*
-		 * on a failure, a zero-byte length file will be
-		 * left on the disk -- this is because of the fopen().
-		 * remove this zero-length file.
+		 * the next peer (or package server) gets to finish a file
+		 * that was cut short. anything else is thrown away.
 		 */
-		unlink(filename);
-		unlink(tempfilename);
-		free(tempfilename);
+		if (part->offset == 0) {
+			dropremote(part);
+		}
+
 		return(-1);	
 	}
 
@@ -851,7 +1507,6 @@ getremote(char *filename, peer_t *peer, char *range, CURL *curlhandle)
 	logmsg("getremote:svc time6: %lld usec\n", (e - s));
 #endif
 
-	free(tempfilename);
 	return(0);
 }
 
@@ -984,395 +1639,2252 @@ getprediction(uint64_t hash, tracker_info_t **info)
 	return(retval);
 }
 
+/*
+ * the tracker that 'hash' is registered with (when partitioned)
+ */
 int
-trackfile(int sockfd, char *filename, char *range, uint16_t num_trackers,
-	in_addr_t *trackers, uint16_t maxpeers, uint16_t num_pkg_servers,
-	in_addr_t *pkg_servers, CURL *curlhandle)
+owner(uint64_t hash, uint16_t num_trackers)
 {
-#ifdef	TIMEIT
-	struct timeval		start_time, end_time;
-	unsigned long long	s, e;
-#endif
-	CURLcode	curlcode;
-	uint64_t	hash;
-	uint16_t	i;
-	tracker_info_t	*tracker_info, *infoptr;
-	int		info_count;
-	char		success;
+	int	order[MAX_TRACKERS];
 
-#ifdef	TIMEIT
-	gettimeofday(&start_time, NULL);
-#endif
-
-	hash = hashit(filename);
+	ring_order(hash, num_trackers, order);
+	return(order[0]);
+}
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time1: %lld usec file (%s)\n", (e - s), filename);
-#endif
+int startcontrol();
 
-#ifdef	DEBUG
+/*
+ * hand a message to the control process. if the control process is gone
+ * (the tracker-client process that started it exited), start a new one,
+ * but no more than once every KEEPALIVE_INTERVAL seconds. returns 0 if
+ * the message was handed over.
+ */
+static int
+ctlwrite(ctlmsg_t *msg)
 {
-	int		j;
-	struct in_addr	in;
+	static time_t	lasttry = 0;
+	time_t		now;
 
-	for (j = 0 ; j < num_trackers ; ++j) {
-		in.s_addr = trackers[j];
-		logmsg("trackfile:trackers[%d] = (%s)\n", j, inet_ntoa(in));
+	if (ctlfd >= 0) {
+		if (write(ctlfd, msg, sizeof(*msg)) == sizeof(*msg)) {
+			return(0);
+		}
+
+		/*
+		 * EAGAIN means it is just behind
+		 */
+		if (errno != EPIPE) {
+			return(-1);
+		}
+
+		close(ctlfd);
+		ctlfd = -1;
 	}
 
-	for (j = 0 ; j < num_pkg_servers ; ++j) {
-		in.s_addr = pkg_servers[j];
-		logmsg("trackfile:pkg_servers[%d] = (%s)\n", j, inet_ntoa(in));
+	now = time(NULL);
+	if ((now - lasttry) < KEEPALIVE_INTERVAL) {
+		return(-1);
 	}
-}
-#endif
+	lasttry = now;
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time2: %lld usec file (%s)\n", (e - s), filename);
-#endif
+	if ((startcontrol() != 0) ||
+			(write(ctlfd, msg, sizeof(*msg)) != sizeof(*msg))) {
+		return(-1);
+	}
 
-	/*
-	 * see if there is a prediction for this file
-	 */
-	tracker_info = NULL;
-	info_count = getprediction(hash, &tracker_info);
+	return(0);
+}
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time3: %lld usec file (%s)\n", (e - s), filename);
-#endif
+/*
+ * send a REGISTER (of this host) or an UNREGISTER (of a bad peer, or of
+ * this host if 'peer' is 0) for 'hash'. the message goes to the control
+ * process, which batches it with the others. if the control process is
+ * gone, send it right here.
+ */
+void
+queuemsg(int sockfd, uint16_t num_trackers, in_addr_t *trackers, uint16_t op,
+	uint64_t hash, in_addr_t peer)
+{
+	ctlmsg_t	msg;
+	char		buf[sizeof(tracker_info_t) + sizeof(peer_t)];
+	tracker_info_t	*info = (tracker_info_t *)buf;
+	int		i;
 
-#ifdef	DEBUG
-	if (info_count == 0) {
-		logmsg("trackfile:pred miss (0x%016llx)\n", hash);
-	} else {
-		logmsg("trackfile:pred hit (0x%016llx)\n", hash);
-	}
-#endif
+	bzero(&msg, sizeof(msg));
+	msg.op = op;
+	msg.peer = peer;
+	msg.hash = hash;
 
-	if (info_count == 0) {
-		/*
-		 * no prediction. need to ask a tracker for peer info for
-		 * this file.
-		 */
-		for (i = 0 ; i < num_trackers; ++i) {
-#ifdef	DEBUG
-			struct in_addr	in;
+	if (ctlwrite(&msg) == 0) {
+		return;
+	}
 
-			in.s_addr = trackers[i];
-			logmsg("trackfile:sending lookup to tracker (%s)\n",
-				inet_ntoa(in));
-#endif
-			info_count = lookup(sockfd, &trackers[i], hash,
-				&tracker_info);
+	bzero(buf, sizeof(buf));
+	info->hash = hash;
 
-			if (info_count > 0) {
-				break;
-			}
+	for (i = 0 ; i < num_trackers; ++i) {
+		if (partitioned && (i != owner(hash, num_trackers))) {
+			continue;
+		}
 
-			/*
-			 * lookup() mallocs space for 'tracker_info', so need to
-			 * free it here since we'll call lookup() again in the
-			 * next iteration
-			 */
-			if (tracker_info != NULL) {
-				free(tracker_info);
-				tracker_info = NULL;
-			}
+		if (op == REGISTER) {
+			info->numpeers = 0;
+			register_hash(sockfd, &trackers[i], 1, info);
+		} else {
+			info->numpeers = (peer != 0 ? 1 : 0);
+			info->peers[0].ip = peer;
+			unregister_hash(sockfd, &trackers[i], 1, info);
 		}
 	}
+}
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time4: %lld usec file (%s)\n", (e - s), filename);
-#endif
+/*
+ * tell the control process about a file to prefetch (or not). these are
+ * only hints, so they are just dropped if the control process is gone.
+ */
+void
+ctlsend(uint16_t op, uint64_t hash, uint16_t last)
+{
+	ctlmsg_t	msg;
 
-#ifdef	DEBUG
-	logmsg("trackfile:info_count (%d)\n", info_count);
-#endif
+	bzero(&msg, sizeof(msg));
+	msg.op = op;
+	msg.last = last;
+	msg.hash = hash;
 
-	success = 0;
-	infoptr = tracker_info;
-	if ((info_count > 0) && (infoptr->hash == hash)) {
-		/*
-		 * write the prediction info to a file	
-		 */
-		save_prediction_info(tracker_info, info_count);
+	ctlwrite(&msg);
+}
 
-#ifdef	TIMEIT
-		gettimeofday(&end_time, NULL);
-		s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-		e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+/*
+ * send the next PREFETCH_WINDOW predicted files after 'hash' to the
+ * control process, so it can fetch them while the installer is busy
+ * installing this one
+ */
+void
+sendwindow(uint64_t hash)
+{
+	tracker_info_t	*p, *start;
+	uint64_t	window[PREFETCH_WINDOW];
+	int		totalsize;
+	int		i, n;
+
+	if ((predictions == NULL) || prefetching) {
+		return;
+	}
+
+	/*
+	 * the window starts after 'hash', or at the top if 'hash' was the
+	 * file the predictions were made for
+	 */
+	start = predictions;
+	for (p = predictions, totalsize = 0 ; totalsize < predictions_size ;
+			p = (tracker_info_t *)((char *)p + i)) {
+		i = sizeof(tracker_info_t) + (sizeof(p->peers[0]) * p->numpeers);
+		totalsize += i;
+
+		if (p->hash == hash) {
+			start = (tracker_info_t *)((char *)p + i);
+			break;
+		}
+	}
+
+	n = 0;
+	totalsize = (char *)start - (char *)predictions;
+	for (p = start ; (totalsize < predictions_size) &&
+			(n < PREFETCH_WINDOW) ;
+			p = (tracker_info_t *)((char *)p + i)) {
+		i = sizeof(tracker_info_t) + (sizeof(p->peers[0]) * p->numpeers);
+		totalsize += i;
+
+		window[n++] = p->hash;
+	}
+
+	for (i = 0 ; i < n ; ++i) {
+		ctlsend(PREDICT, window[i], (i == (n - 1)));
+	}
+}
+
+/*
+ * the name of the file that marks a prefetch of 'hash'
+ */
+static void
+prefetchmark(char *mark, size_t len, uint64_t hash)
+{
+	snprintf(mark, len, "%s.%016llx", PREFETCH_MARK,
+		(unsigned long long)hash);
+}
+
+/*
+ * the name of the file that holds the name of a file to fetch all of
+ */
+static void
+completename(char *file, size_t len, uint64_t hash)
+{
+	snprintf(file, len, "%s.%016llx", COMPLETE_NAME,
+		(unsigned long long)hash);
+}
+
+/*
+ * tell the control process to fetch all of 'filename'
+ */
+void
+sendcomplete(char *filename, uint64_t hash)
+{
+	FILE	*file;
+	char	name[PATH_MAX];
+	char	tmp[PATH_MAX];
+
+	completename(name, sizeof(name), hash);
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+
+	if ((file = fopen(tmp, "w")) == NULL) {
+		return;
+	}
+
+	fprintf(file, "%s\n", filename);
+
+	if ((fclose(file) != 0) || (rename(tmp, name) != 0)) {
+		unlink(tmp);
+		return;
+	}
+
+	ctlsend(COMPLETE, hash, 0);
+}
+
+/*
+ * if the control process is fetching this file right now, wait for it
+ * to finish instead of fetching the file a second time. returns 0 if the
+ * prefetch finished.
+ */
+int
+waitprefetch(uint64_t hash)
+{
+	struct stat	buf;
+	char		mark[PATH_MAX];
+	int		waited;
+
+	prefetchmark(mark, sizeof(mark), hash);
+
+	if (stat(mark, &buf) != 0) {
+		return(-1);
+	}
+
+	for (waited = 0 ; waited < HANDOFF_WAIT_MSEC ;
+			waited += HANDOFF_POLL_MSEC) {
+		usleep(HANDOFF_POLL_MSEC * 1000);
+
+		if (stat(mark, &buf) != 0) {
+			return(0);
+		}
+	}
+
+	return(-1);
+}
+
+/*
+ * add a span to this host's install timeline (see TIMELINE_FILE). the
+ * line goes out in one write, so the loader and the other tracker-client
+ * processes can append to the same file.
+ */
+void
+timeline(char *name, struct timeval *start, const char *fmt, ...)
+{
+	struct timeval	end;
+	va_list		ap;
+	char		line[512];
+	int		len;
+	int		fd;
+
+	gettimeofday(&end, NULL);
+
+	len = snprintf(line, sizeof(line), "%s %llu %llu ", name,
+		((unsigned long long)start->tv_sec * 1000000) + start->tv_usec,
+		((unsigned long long)end.tv_sec * 1000000) + end.tv_usec);
+
+	va_start(ap, fmt);
+	len += vsnprintf(&line[len], sizeof(line) - len, fmt, ap);
+	va_end(ap);
+
+	if (len > (int)sizeof(line) - 2) {
+		len = sizeof(line) - 2;
+	}
+	line[len++] = '\n';
+
+	if ((fd = open(TIMELINE_FILE, O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0) {
+		return;
+	}
+
+	write(fd, line, len);
+	close(fd);
+}
+
+/*
+ * move the DOWNLOADING peers behind the READY ones, keeping the order the
+ * tracker sent them in
+ */
+void
+sortpeers(tracker_info_t *info)
+{
+	peer_t	peers[MAX_SHUFFLE_PEERS];
+	int	i, n;
+
+	if (info->numpeers > MAX_SHUFFLE_PEERS) {
+		return;
+	}
+
+	n = 0;
+	for (i = 0 ; i < info->numpeers ; ++i) {
+		if (info->peers[i].state != DOWNLOADING) {
+			peers[n++] = info->peers[i];
+		}
+	}
+
+	for (i = 0 ; i < info->numpeers ; ++i) {
+		if (info->peers[i].state == DOWNLOADING) {
+			peers[n++] = info->peers[i];
+		}
+	}
+
+	memcpy(info->peers, peers, n * sizeof(peer_t));
+}
+
+/*
+ * ask the trackers for the peers of a file. with a partitioned tracker
+ * list, start with the tracker that owns the file. returns the number of
+ * hashes in 'info' (lookup() mallocs it).
+ */
+int
+asktrackers(int sockfd, uint64_t hash, uint32_t flags, uint16_t num_trackers,
+	in_addr_t *trackers, tracker_info_t **info, uint64_t *hints,
+	uint16_t *numhints)
+{
+	int	order[MAX_TRACKERS];
+	int	num_order;
+	int	info_count;
+	int	i;
+
+	info_count = 0;
+	*numhints = 0;
+	num_order = ring_order(hash, num_trackers, order);
+
+	for (i = 0 ; i < num_order; ++i) {
+#ifdef	DEBUG
+		struct in_addr	in;
+
+		in.s_addr = trackers[order[i]];
+		logmsg("asktrackers:sending lookup to tracker (%s)\n",
+			inet_ntoa(in));
+#endif
+		info_count = lookup(sockfd, &trackers[order[i]], hash, flags,
+			info, hints, numhints);
+
+		if (info_count > 0) {
+			break;
+		}
+
+		/*
+		 * lookup() mallocs space for 'info', so need to free it
+		 * here since we'll call lookup() again in the next iteration
+		 */
+		if (*info != NULL) {
+			free(*info);
+			*info = NULL;
+		}
+	}
+
+	return(info_count);
+}
+
+/*
+ * a peer that is still getting the file from a package server didn't
+ * have it for us. instead of asking the peer over and over, ask the
+ * tracker again (backing off, see HANDOFF_WAIT_MSEC) until the peer has
+ * registered the file or isn't listed anymore. returns 1 when the peer
+ * has the file.
+ */
+int
+handoff(int sockfd, uint64_t hash, uint32_t flags, in_addr_t ip,
+	uint16_t num_trackers, in_addr_t *trackers, int *waited)
+{
+	tracker_info_t	*info;
+	uint64_t	hints[HOT_HINTS];
+	uint16_t	numhints;
+	int		delay;
+	int		state;
+	int		i;
+
+	delay = HANDOFF_POLL_MSEC;
+
+	while (*waited < HANDOFF_WAIT_MSEC) {
+		delay = min(delay, HANDOFF_WAIT_MSEC - *waited);
+		usleep(delay * 1000);
+		*waited += delay;
+		delay *= 2;
+
+		info = NULL;
+		state = 0;
+
+		if ((asktrackers(sockfd, hash, flags, num_trackers, trackers,
+				&info, hints, &numhints) > 0) &&
+				(info->hash == hash)) {
+			for (i = 0 ; i < info->numpeers ; ++i) {
+				if (info->peers[i].ip == ip) {
+					state = info->peers[i].state;
+					break;
+				}
+			}
+		}
+
+		if (info != NULL) {
+			free(info);
+		}
+
+		logmsg("handoff:hash 0x%llx state %d waited %d\n", hash,
+			state, *waited);
+
+		if (state != DOWNLOADING) {
+			return(state == READY);
+		}
+	}
+
+	return(0);
+}
+
+int
+trackfile(int sockfd, char *filename, char *range, uint16_t num_trackers,
+	in_addr_t *trackers, uint16_t maxpeers, uint16_t num_pkg_servers,
+	in_addr_t *pkg_servers, CURL *curlhandle)
+{
+#ifdef	TIMEIT
+	struct timeval		start_time, end_time;
+	unsigned long long	s, e;
+#endif
+	CURLcode	curlcode;
+	uint64_t	hash;
+	uint16_t	i, j;
+	tracker_info_t	*tracker_info, *infoptr;
+	uint64_t	hints[HOT_HINTS];
+	uint16_t	numhints;
+	uint64_t	evicted[CACHE_EVICT_MAX];
+	int		numevicted;
+	partial_t	part;
+	uint32_t	flags;
+	int		info_count;
+	int		retval;
+	int		waited;
+	char		success;
+	struct timeval	span_start;
+	struct in_addr	from;
+	char		*source;
+	double		got;
+	off_t		bytes;
+	int		tries;
+
+#ifdef	TIMEIT
+	gettimeofday(&start_time, NULL);
+#endif
+	gettimeofday(&span_start, NULL);
+
+	hash = hashit(filename);
+
+	/*
+	 * for the timeline: where the file came from and how many bytes
+	 * it took (failed tries included)
+	 */
+	from.s_addr = 0;
+	source = "none";
+	bytes = 0;
+	tries = 0;
+	waited = 0;
+	prefetchyield = 0;
+
+	/*
+	 * a range is all we'll get, so we can't share the file afterwards
+	 */
+	flags = (range != NULL ? LOOKUP_NOCLAIM : 0);
+
+	part.tempfilename = NULL;
+	part.offset = 0;
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time1: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+#ifdef	DEBUG
+{
+	int		j;
+	struct in_addr	in;
+
+	for (j = 0 ; j < num_trackers ; ++j) {
+		in.s_addr = trackers[j];
+		logmsg("trackfile:trackers[%d] = (%s)\n", j, inet_ntoa(in));
+	}
+
+	for (j = 0 ; j < num_pkg_servers ; ++j) {
+		in.s_addr = pkg_servers[j];
+		logmsg("trackfile:pkg_servers[%d] = (%s)\n", j, inet_ntoa(in));
+	}
+}
+#endif
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time2: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+	/*
+	 * see if there is a prediction for this file
+	 */
+	tracker_info = NULL;
+	info_count = getprediction(hash, &tracker_info);
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time3: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+#ifdef	DEBUG
+	if (info_count == 0) {
+		logmsg("trackfile:pred miss (0x%016llx)\n", hash);
+	} else {
+		logmsg("trackfile:pred hit (0x%016llx)\n", hash);
+	}
+#endif
+
+	if (info_count == 0) {
+		/*
+		 * no prediction. need to ask a tracker for peer info for
+		 * this file.
+		 */
+		info_count = asktrackers(sockfd, hash, flags, num_trackers,
+			trackers, &tracker_info, hints, &numhints);
+
+		for (j = 0 ; j < numhints ; ++j) {
+			cache_hot(hints[j]);
+			ctlsend(PREFETCH, hints[j], 0);
+		}
+	}
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time4: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+#ifdef	DEBUG
+	logmsg("trackfile:info_count (%d)\n", info_count);
+#endif
+
+	success = 0;
+	infoptr = tracker_info;
+	if ((info_count > 0) && (infoptr->hash == hash)) {
+		/*
+		 * write the prediction info to a file	
+		 */
+		save_prediction_info(tracker_info, info_count);
+
+		/*
+		 * start fetching the files after this one
+		 */
+		sendwindow(hash);
+
+#ifdef	TIMEIT
+		gettimeofday(&end_time, NULL);
+		s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+		e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
 		logmsg("trackfile:svc time5: %lld usec file (%s)\n", (e - s),
 			filename);
 #endif
 
-#ifdef	DEBUG
-		logmsg("trackfile:hash (0x%llx) : numpeers (%d)\n",
-			infoptr->hash, infoptr->numpeers);
+#ifdef	DEBUG
+		logmsg("trackfile:hash (0x%llx) : numpeers (%d)\n",
+			infoptr->hash, infoptr->numpeers);
+
+		logmsg("trackfile:peers:\n");
+
+		for (i = 0 ; i < infoptr->numpeers; ++i) {
+			struct in_addr	in;
+
+			in.s_addr = infoptr->peers[i].ip;
+			logmsg("\t%s : %c %d\n", inet_ntoa(in),
+				(infoptr->peers[i].state == DOWNLOADING ?
+					'd' : 'r'), infoptr->peers[i].state);
+		}
+#endif
+
+#ifdef	TIMEIT
+		gettimeofday(&end_time, NULL);
+		s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+		e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+		logmsg("trackfile:svc time6: %lld usec file (%s)\n", (e - s),
+			filename);
+#endif
+
+		/*
+		 * try the peers that have the file before the ones that are
+		 * still getting it
+		 */
+		sortpeers(infoptr);
+
+		for (i = 0 ; i < infoptr->numpeers; ++i) {
+#ifdef	DEBUG
+			{
+			struct in_addr	in;
+			int		k;
+
+			in.s_addr = infoptr->peers[i].ip;
+
+			if (strncmp(inet_ntoa(in), "10.", 3)) {
+				for (k = 0 ; i < num_trackers; ++k) {
+					send_msg(sockfd, &trackers[k],
+						STOP_SERVER);
+				}
+
+				logmsg("trackfile:bogus IP (%s)\n",
+					inet_ntoa(in));
+				exit(-1);
+			}
+			}
+#endif
+			while (1) {
+				setstall(curlhandle, infoptr->peers[i].ip);
+
+				retval = getremote(filename, &infoptr->peers[i],
+					range, curlhandle, &part);
+
+				++tries;
+				if (curl_easy_getinfo(curlhandle,
+						CURLINFO_SIZE_DOWNLOAD, &got) ==
+						CURLE_OK) {
+					bytes += (off_t)got;
+				}
+
+				/*
+				 * the peer is still getting the file from a
+				 * package server. once the tracker says it
+				 * has it, get the file from it
+				 */
+				if ((retval == 0) || prefetchyield ||
+						(infoptr->peers[i].state !=
+						DOWNLOADING) || peerbusy ||
+						!handoff(sockfd, hash, flags,
+						infoptr->peers[i].ip,
+						num_trackers, trackers,
+						&waited)) {
+					break;
+				}
+
+				infoptr->peers[i].state = READY;
+			}
+
+			if (retval == 0) {
+				/*
+				 * successful download, exit this loop
+				 */
+				from.s_addr = infoptr->peers[i].ip;
+				source = "peer";
+				success = 1;
+				break;
+			} else if (prefetchyield) {
+				/*
+				 * we stopped it, the peer is fine
+				 */
+				break;
+			} else {
+				/*
+				 * mark the peer as 'bad'. we do this by
+				 * telling the tracker server to 'unregister'
+				 * this hash. a peer that is still downloading
+				 * the file drops off the tracker by itself
+				 * if it never gets it, and a busy peer is
+				 * just skipped this time.
+				 */
+
+				if ((infoptr->peers[i].state != DOWNLOADING) &&
+						!peerbusy) {
+					queuemsg(sockfd, num_trackers,
+						trackers, UNREGISTER, hash,
+						infoptr->peers[i].ip);
+				}
+			}
+		}
+	}
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time7: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+	if (!success && !prefetchyield) {
+		/*
+		 * unable to download the file from a peer, need to
+		 * get it from one of the package servers
+		 */
+
+		for (i = 0 ; i < num_pkg_servers ; ++i) {
+			peer_t	pkgpeer;
+
+			pkgpeer.ip = pkg_servers[i];
+			pkgpeer.state = READY;
+
+			setstall(curlhandle, pkgpeer.ip);
+
+			/*
+			 * if this is the last package server, then
+			 * disable the connection timeout and the stall
+			 * check -- this is our last hope of getting the
+			 * package.
+			 */
+			if (i == (num_pkg_servers - 1)) { 
+				if ((curlcode = curl_easy_setopt(curlhandle,
+					CURLOPT_CONNECTTIMEOUT, 0)) !=
+					CURLE_OK) {
+
+					logmsg("getremote:curl_easy_setopt():failed:(%d)\n", curlcode);
+				}
+
+				curl_easy_setopt(curlhandle,
+					CURLOPT_LOW_SPEED_LIMIT, 0L);
+			}
+
+			if (getremote(filename, &pkgpeer, range,
+					curlhandle, &part) == 0) {
+				from.s_addr = pkgpeer.ip;
+				source = "pkgserver";
+				success = 1;
+			}
+
+			++tries;
+			if (curl_easy_getinfo(curlhandle,
+					CURLINFO_SIZE_DOWNLOAD, &got) == CURLE_OK) {
+				bytes += (off_t)got;
+			}
+
+			/*
+			 * reset the connection timeout
+			 */
+			if (i == (num_pkg_servers - 1)) { 
+				if ((curlcode = curl_easy_setopt(curlhandle,
+					CURLOPT_CONNECTTIMEOUT, 2)) !=
+					CURLE_OK) {
+
+					logmsg("getremote:curl_easy_setopt():failed:(%d)\n", curlcode);
+				}
+			}
+
+			if (success || prefetchyield) {
+				break;
+			}
+		}
+	}
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time8: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+	/*
+	 * only a complete copy of the file can be shared with other peers
+	 */
+	if (success && (range == NULL)) {
+		queuemsg(sockfd, num_trackers, trackers, REGISTER, hash, 0);
+
+		/*
+		 * make room for it on the ramdisk. the files that are thrown
+		 * away can't be shared anymore.
+		 */
+		numevicted = cache_add(filename, !prefetching, evicted,
+			CACHE_EVICT_MAX);
+
+		for (j = 0 ; j < numevicted ; ++j) {
+			queuemsg(sockfd, num_trackers, trackers, UNREGISTER,
+				evicted[j], 0);
+		}
+	}
+
+	/*
+	 * nobody could finish it
+	 */
+	dropremote(&part);
+
+	/*
+	 * lookup() and getprediction() mallocs tracker_info
+	 */
+	if (tracker_info != NULL) {
+		free(tracker_info);
+	}	
+
+	timeline("trackfile", &span_start,
+		"file=%s source=%s peer=%s bytes=%lld tries=%d range=%s",
+		filename, source, (from.s_addr ? inet_ntoa(from) : "-"),
+		(long long)bytes, tries, (range ? "yes" : "no"));
+
+#ifdef	TIMEIT
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("trackfile:svc time: %lld usec file (%s)\n", (e - s), filename);
+#endif
+
+	if (success) {
+		return(0);
+	}
+
+	return(-1);
+}
+
+int
+doit(int sockfd, uint16_t num_trackers, in_addr_t *trackers, uint16_t maxpeers,
+	uint16_t num_pkg_servers, in_addr_t *pkg_servers, CURL *curlhandle)
+{
+	struct timeval		start_time;
+#ifdef	TIMEIT
+#endif
+	struct timeval		end_time;
+	unsigned long long	s, e;
+	char			*forminfo;
+	char			*range;
+	char			filename[PATH_MAX];
+
+	gettimeofday(&start_time, NULL);
+
+	bzero(filename, sizeof(filename));
+
+	if ((forminfo = getenv("QUERY_STRING")) == NULL) {
+		senderror(500, "No QUERY_STRING", errno);
+		return(0);
+	}
+
+	/*
+	 * the loader asks for our status to see if we are up (see
+	 * start_httpd()). that doesn't touch the cache or the trackers.
+	 */
+	if (strcmp(forminfo, "status") == 0) {
+		printf("HTTP/1.1 %d\n", HTTP_OK);
+		printf("Content-Type: text/plain\n");
+		printf("Content-Length: 0\n");
+		printf("\n");
+		fflush(stdout);
+		return(0);
+	}
+
+	if ((range = getenv("HTTP_RANGE")) != NULL) {
+		char	*ptr;
+
+		if ((ptr = strchr(range, '=')) != NULL) {
+			range = ptr + 1;
+		}
+	}
+
+	if (getargs(forminfo, filename) != 0) {
+		senderror(500, "getargs():failed", errno);
+		return(0);
+	}
+
+	
+	//let's unescape filename
+        char * filename_unescaped;
+	filename_unescaped = curl_easy_unescape(curlhandle, filename , 0, NULL );
+	//filename_unescaped will be equal or shorter to filename
+	strcpy(filename, filename_unescaped);
+	curl_free(filename_unescaped);
+
+	/*
+	 * the time is 'epoch' time
+	 */
+	logmsg("%d : doit:file %s\n", start_time.tv_sec, basename(filename));
+#ifdef	DEBUG
+	logmsg("doit:getting file (%s)\n", filename);
+#endif
+
+	/*
+	 * requests from our own prefetches don't hold back other prefetches
+	 */
+	prefetching = (getenv("HTTP_X_PREFETCH") != NULL);
+
+	/*
+	 * if the file is local, just read it off the disk, otherwise, ask
+	 * the tracker where the file is
+	 */
+	if (getlocal(filename, range) != 0) {
+		uint64_t	hash = hashit(filename);
+		int		priority = 0;
+
+		if (prefetching) {
+			/*
+			 * the prefetch is downloaded here, not in the
+			 * prefetcher. do it at a low CPU priority.
+			 */
+			prefetching_hash = hash;
+			priority = getpriority(PRIO_PROCESS, 0);
+			setpriority(PRIO_PROCESS, 0, 19);
+		}
+
+		if (range != NULL) {
+			/*
+			 * only the range is passed through from a peer, so a
+			 * small read (e.g., of a package header) doesn't wait
+			 * for the whole file. the whole file is fetched in the
+			 * background.
+			 */
+			if (!prefetching) {
+				sendcomplete(filename, hash);
+			}
+		} else if (!prefetching) {
+			cache_foreground(hash, 1);
+		}
+
+		if (prefetching || (range != NULL) ||
+				(waitprefetch(hash) != 0) ||
+				(getlocal(filename, range) != 0)) {
+			if (trackfile(sockfd, filename, range, num_trackers,
+					trackers, maxpeers, num_pkg_servers,
+					pkg_servers, curlhandle) != 0) {
+				senderror(404, "File not found", 0);
+			}
+		}
+
+		if (prefetching) {
+			if (prefetchyield) {
+				logmsg("doit:prefetch of %s stopped for the "
+					"installer\n", filename);
+			}
+
+			if (setpriority(PRIO_PROCESS, 0, priority) != 0) {
+				logmsg("doit:setpriority failed:errno (%d)\n",
+					errno);
+			}
+		} else if (range == NULL) {
+			cache_foreground(hash, 0);
+		}
+	}
+
+#ifdef	DEBUG
+	logmsg("doit:done:file (%s)\n\n", filename);
+#endif
+
+#ifdef	TIMEIT
+#endif
+	gettimeofday(&end_time, NULL);
+	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
+	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
+	logmsg("doit:svc time: %lld usec file %s from %s\n\n",
+		(e - s) - curltime, basename(filename), fromip);
+
+	return(0);
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	uint64_t	x = ((file_name_t *)a)->hash;
+	uint64_t	y = ((file_name_t *)b)->hash;
+
+	return(x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static unsigned long long now_msecs();
+static void startupload(upload_t *, tracker_header_t *, int);
+
+/*
+ * write MANIFEST_FILE from the kickstart file, once the loader has it.
+ * the repository metadata it is made from is fetched through the local
+ * web server, so it is done by a process of its own. it is tried no more
+ * than MANIFEST_TRIES times.
+ */
+void
+startmanifest()
+{
+	struct stat	buf;
+	int		s;
+
+	if (manifest_pid > 0) {
+		if (waitpid(manifest_pid, &s, WNOHANG) != manifest_pid) {
+			return;
+		}
+		manifest_pid = -1;
+	}
+
+	if ((manifest_tries >= MANIFEST_TRIES) ||
+			(stat(MANIFEST_FILE, &buf) == 0) ||
+			(stat(KICKSTART_FILE, &buf) != 0)) {
+		return;
+	}
+
+	++manifest_tries;
+
+	if ((manifest_pid = fork()) != 0) {
+		if (manifest_pid < 0) {
+			logmsg("startmanifest:fork failed:errno (%d)\n", errno);
+		}
+		return;
+	}
+
+	close(ctl_readfd);
+	close(ctl_lockfd);
+
+	_exit(makemanifest() == 0 ? 0 : 1);
+}
+
+/*
+ * read NAMES_FILE into 'file_names'. returns 0 if it was read.
+ */
+int
+readnames()
+{
+	FILE		*file;
+	file_name_t	*names, *more;
+	uint32_t	numnames, max;
+	char		buf[PATH_MAX];
+	char		*ptr;
+	int		i;
+
+	if ((file = fopen(NAMES_FILE, "r")) == NULL) {
+		return(-1);
+	}
+
+	names = NULL;
+	numnames = max = 0;
+
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		if ((ptr = strchr(buf, '\n')) != NULL) {
+			*ptr = '\0';
+		}
+
+		if (buf[0] == '\0') {
+			continue;
+		}
+
+		if (numnames == max) {
+			max = (max ? max * 2 : 4096);
+			if ((more = (file_name_t *)realloc(names,
+					max * sizeof(file_name_t))) == NULL) {
+				break;
+			}
+			names = more;
+		}
+
+		if ((names[numnames].name = strdup(buf)) == NULL) {
+			break;
+		}
+
+		names[numnames].hash = hashit(buf);
+		++numnames;
+	}
+
+	fclose(file);
+
+	qsort(names, numnames, sizeof(file_name_t), namecmp);
+
+	for (i = 0 ; i < file_numnames ; ++i) {
+		free(file_names[i].name);
+	}
+	if (file_names != NULL) {
+		free(file_names);
+	}
+
+	file_names = names;
+	file_numnames = numnames;
+
+	logmsg("readnames:%d files\n", numnames);
+	return(0);
+}
+
+/*
+ * read the installer's manifest and start sending it to the tracker(s),
+ * see manifestack() for the rest. returns 0 if it was read.
+ */
+int
+sendmanifest(int sockfd, uint16_t num_trackers, in_addr_t *trackers)
+{
+	FILE		*file;
+	uint64_t	*hashes;
+	uint32_t	numhashes;
+	char		buf[PATH_MAX];
+	char		*ptr;
+	int		i;
+
+	if ((file = fopen(MANIFEST_FILE, "r")) == NULL) {
+		return(-1);
+	}
+
+	if ((hashes = (uint64_t *)malloc(MANIFEST_MAX * sizeof(uint64_t)))
+			== NULL) {
+		fclose(file);
+		return(-1);
+	}
+
+	numhashes = 0;
+	while ((numhashes < MANIFEST_MAX) &&
+			(fgets(buf, sizeof(buf), file) != NULL)) {
+		if ((ptr = strchr(buf, '\n')) != NULL) {
+			*ptr = '\0';
+		}
+
+		if (buf[0] == '\0') {
+			continue;
+		}
+
+		hashes[numhashes++] = hashit(buf);
+	}
+
+	fclose(file);
+
+	if (manifest_hashes != NULL) {
+		free(manifest_hashes);
+	}
+
+	manifest_hashes = hashes;
+	manifest_numhashes = numhashes;
+
+	/*
+	 * a chunk of the last manifest that is still waiting for its ack
+	 * is dropped, its ack won't match anything
+	 */
+	for (i = 0 ; i < num_trackers ; ++i) {
+		startupload(&manifest_upload[i], (numhashes == 0) ? NULL :
+			(tracker_header_t *)manifest_chunk(sockfd,
+				&trackers[i], 0, numhashes, hashes), i);
+	}
+
+	logmsg("sendmanifest:sending %d files\n", numhashes);
+	return(0);
+}
+
+/*
+ * send the next chunk of the spans that were added to TIMELINE_FILE to
+ * a tracker, unless one is already waiting for its ack. timelineack()
+ * sends the chunk after that.
+ */
+void
+sendtimeline(int sockfd, in_addr_t *tracker)
+{
+	char		buf[TIMELINE_CHUNK];
+	char		*end;
+	ssize_t		len;
+	int		fd;
+
+	if (timeline_upload.msg != NULL) {
+		return;
+	}
+
+	if ((fd = open(TIMELINE_FILE, O_RDONLY)) < 0) {
+		return;
+	}
+
+	while ((len = pread(fd, buf, sizeof(buf), timeline_offset)) > 0) {
+		/*
+		 * only send whole lines
+		 */
+		for (end = &buf[len] ; (end > buf) && (end[-1] != '\n') ;
+				--end) {
+			;
+		}
+
+		if (end == buf) {
+			if (len < sizeof(buf)) {
+				break;
+			}
+
+			/*
+			 * a line that doesn't fit in a message. drop it.
+			 */
+			timeline_offset += len;
+			continue;
+		}
+
+		startupload(&timeline_upload,
+			(tracker_header_t *)timeline_chunk(sockfd, tracker,
+				timeline_offset, buf, end - buf), 0);
+		break;
+	}
+
+	close(fd);
+}
+
+static unsigned long long
+now_msecs()
+{
+	struct timeval	now;
+
+	gettimeofday(&now, NULL);
+	return((now.tv_sec * 1000ULL) + (now.tv_usec / 1000));
+}
+
+/*
+ * send a REGISTER batch to tracker 'i' and remember it until the tracker
+ * acks it. if too many batches are waiting for an ack, send this one
+ * without asking for one.
+ */
+void
+sendregister(int sockfd, in_addr_t *trackers, int i, uint32_t numhashes,
+	tracker_info_t *info)
+{
+	int	j;
+
+	for (j = 0 ; j < CTL_PENDING ; ++j) {
+		if (pending[j].msg == NULL) {
+			break;
+		}
+	}
+
+	if (j == CTL_PENDING) {
+		register_hash(sockfd, &trackers[i], numhashes, info);
+		return;
+	}
+
+	if ((pending[j].msg = register_hash_ack(sockfd, &trackers[i],
+			numhashes, info)) == NULL) {
+		return;
+	}
+
+	pending[j].tracker = i;
+	pending[j].tries = 1;
+	pending[j].sent = now_msecs();
+	pending[j].deadline = pending[j].sent + rto[i];
+}
+
+/*
+ * 'msg' is the next chunk to wait for an ack on tracker 'i'
+ */
+static void
+startupload(upload_t *up, tracker_header_t *msg, int i)
+{
+	if (up->msg != NULL) {
+		free(up->msg);
+	}
+
+	up->msg = msg;
+	up->tries = 1;
+	up->deadline = now_msecs() + rto[i];
+}
+
+/*
+ * send a chunk whose ack is late again, backing off each time. returns
+ * -1 (and forgets the chunk) after CTL_MAX_TRIES sends.
+ */
+static int
+resendupload(int sockfd, in_addr_t *tracker, upload_t *up, int i,
+	unsigned long long now)
+{
+	long	timeout;
+
+	if (up->tries == CTL_MAX_TRIES) {
+		free(up->msg);
+		up->msg = NULL;
+		return(-1);
+	}
+
+	/*
+	 * the tracker uses the time a timeline chunk was sent to move our
+	 * times onto its clock
+	 */
+	if (up->msg->op == TIMELINE) {
+		((tracker_timeline_t *)up->msg)->sent = now * 1000;
+	}
+
+	resend_msg(sockfd, tracker, up->msg);
+
+	timeout = rto[i] << up->tries;
+	if (timeout > CTL_RTO_MAX) {
+		timeout = CTL_RTO_MAX;
+	}
+
+	up->deadline = now + timeout;
+	++up->tries;
+	++retransmits;
+	return(0);
+}
+
+/*
+ * a tracker acked a chunk of the manifest, send it the next one
+ */
+void
+manifestack(int sockfd, uint16_t num_trackers, in_addr_t *trackers,
+	uint32_t seqno)
+{
+	tracker_manifest_t	*msg;
+	tracker_header_t	*next;
+	uint32_t		offset;
+	int			i;
+
+	for (i = 0 ; i < num_trackers ; ++i) {
+		msg = (tracker_manifest_t *)manifest_upload[i].msg;
+
+		if ((msg != NULL) && (msg->header.seqno == seqno)) {
+			break;
+		}
+	}
+
+	if (i == num_trackers) {
+		return;
+	}
+
+	offset = msg->offset + msg->numhashes;
+
+	if (offset >= manifest_numhashes) {
+		free(msg);
+		manifest_upload[i].msg = NULL;
+		return;
+	}
+
+	next = (tracker_header_t *)manifest_chunk(sockfd, &trackers[i],
+		offset, manifest_numhashes, manifest_hashes);
+	startupload(&manifest_upload[i], next, i);
+
+	if (next == NULL) {
+		manifest_mtime = 0;
+	}
+}
+
+/*
+ * the tracker acked a chunk of the timeline, send the next one
+ */
+void
+timelineack(int sockfd, in_addr_t *trackers, tracker_timeline_resp_t *resp)
+{
+	if ((timeline_upload.msg == NULL) ||
+			(timeline_upload.msg->seqno != resp->header.seqno)) {
+		return;
+	}
+
+	free(timeline_upload.msg);
+	timeline_upload.msg = NULL;
+
+	/*
+	 * the tracker didn't take the chunk. try again with the next
+	 * keepalive.
+	 */
+	if (resp->offset <= timeline_offset) {
+		return;
+	}
+
+	timeline_offset = resp->offset;
+	sendtimeline(sockfd, &trackers[0]);
+}
+
+/*
+ * read the acks that came in. the round trip time is only measured for
+ * batches that were sent once (we can't tell which send an ack is for).
+ */
+void
+readacks(int sockfd, uint16_t num_trackers, in_addr_t *trackers)
+{
+	union {
+		tracker_header_t	header;
+		tracker_register_resp_t	reg;
+		tracker_manifest_resp_t	manifest;
+		tracker_timeline_resp_t	timeline;
+	}			resp;
+	long			rtt;
+	int			i, j;
+
+	while (recv(sockfd, &resp, sizeof(resp), MSG_DONTWAIT) > 0) {
+		if (resp.header.op == MANIFEST) {
+			manifestack(sockfd, num_trackers, trackers,
+				resp.header.seqno);
+			continue;
+		}
+
+		if (resp.header.op == TIMELINE) {
+			timelineack(sockfd, trackers, &resp.timeline);
+			continue;
+		}
+
+		if (resp.header.op != REGISTER) {
+			continue;
+		}
+
+		for (j = 0 ; j < CTL_PENDING ; ++j) {
+			if ((pending[j].msg != NULL) &&
+				(pending[j].msg->header.seqno ==
+					resp.header.seqno)) {
+				break;
+			}
+		}
+
+		if (j == CTL_PENDING) {
+			/*
+			 * a second ack for a batch that was sent again
+			 */
+			continue;
+		}
+
+		i = pending[j].tracker;
+
+		if (pending[j].tries == 1) {
+			rtt = now_msecs() - pending[j].sent;
+
+			if (srtt[i] == 0) {
+				srtt[i] = rtt;
+				rttvar[i] = rtt / 2;
+			} else {
+				rttvar[i] = ((3 * rttvar[i]) +
+					labs(srtt[i] - rtt)) / 4;
+				srtt[i] = ((7 * srtt[i]) + rtt) / 8;
+			}
+
+			rto[i] = srtt[i] + (4 * rttvar[i]);
+			if (rto[i] < CTL_RTO_MIN) {
+				rto[i] = CTL_RTO_MIN;
+			} else if (rto[i] > CTL_RTO_MAX) {
+				rto[i] = CTL_RTO_MAX;
+			}
+		}
+
+		registered += pending[j].msg->numhashes;
+		free(pending[j].msg);
+		pending[j].msg = NULL;
+	}
+}
+
+/*
+ * tracker 'dead' never acked a REGISTER batch for the files it owns. send
+ * each file to the next tracker after it on the ring. returns the number
+ * of files that have no tracker left to go to.
+ */
+int
+failover(int sockfd, uint16_t num_trackers, in_addr_t *trackers, int dead,
+	tracker_register_t *msg)
+{
+	tracker_info_t	info[CTL_BATCH];
+	int		next[CTL_BATCH];
+	int		order[MAX_TRACKERS];
+	int		num_order;
+	int		lost = 0;
+	int		n, i, j, k;
+
+	for (j = 0 ; (j < msg->numhashes) && (j < CTL_BATCH) ; ++j) {
+		num_order = ring_order(msg->info[j].hash, num_trackers, order);
+
+		for (k = 0 ; k < num_order ; ++k) {
+			if (order[k] == dead) {
+				break;
+			}
+		}
+
+		if (k + 1 < num_order) {
+			next[j] = order[k + 1];
+		} else {
+			next[j] = -1;
+			++lost;
+		}
+	}
+
+	for (i = 0 ; i < num_trackers ; ++i) {
+		n = 0;
+
+		for (k = 0 ; k < j ; ++k) {
+			if (next[k] == i) {
+				bzero(&info[n], sizeof(info[n]));
+				info[n].hash = msg->info[k].hash;
+				++n;
+			}
+		}
+
+		if (n > 0) {
+			sendregister(sockfd, trackers, i, n, info);
+		}
+	}
+
+	return(lost);
+}
+
+/*
+ * send the batches (and manifest and timeline chunks) whose ack is late
+ * again, backing off each time. give up on a batch after CTL_MAX_TRIES
+ * sends (when partitioned, the files go to the next tracker on the ring
+ * instead). a manifest that didn't get through is sent again from the
+ * start with the next keepalive, the timeline from where the tracker
+ * left off. returns when the next batch is due (or 0 if none are
+ * waiting).
+ */
+unsigned long long
+retransmit(int sockfd, uint16_t num_trackers, in_addr_t *trackers,
+	unsigned long long now)
+{
+	unsigned long long	next = 0;
+	long			timeout;
+	int			i, j;
+
+	for (j = 0 ; j < CTL_PENDING ; ++j) {
+		if (pending[j].msg == NULL) {
+			continue;
+		}
+
+		i = pending[j].tracker;
+
+		if (pending[j].deadline <= now) {
+			if (pending[j].tries == CTL_MAX_TRIES) {
+				struct in_addr	in;
+
+				in.s_addr = trackers[i];
+				logmsg("retransmit:dropped %d hashes for tracker (%s)\n",
+					pending[j].msg->numhashes,
+					inet_ntoa(in));
+
+				if (partitioned) {
+					dropped += failover(sockfd,
+						num_trackers, trackers, i,
+						pending[j].msg);
+				} else {
+					dropped += pending[j].msg->numhashes;
+				}
+
+				free(pending[j].msg);
+				pending[j].msg = NULL;
+				continue;
+			}
+
+			resend_msg(sockfd, &trackers[i],
+				(tracker_header_t *)pending[j].msg);
+
+			timeout = rto[i] << pending[j].tries;
+			if (timeout > CTL_RTO_MAX) {
+				timeout = CTL_RTO_MAX;
+			}
+
+			pending[j].deadline = now + timeout;
+			++pending[j].tries;
+			++retransmits;
+		}
+
+		if ((next == 0) || (pending[j].deadline < next)) {
+			next = pending[j].deadline;
+		}
+	}
+
+	for (i = 0 ; i < num_trackers ; ++i) {
+		upload_t	*up = &manifest_upload[i];
+
+		if (up->msg == NULL) {
+			continue;
+		}
+
+		if ((up->deadline <= now) &&
+				(resendupload(sockfd, &trackers[i], up, i,
+					now) != 0)) {
+			struct in_addr	in;
+
+			in.s_addr = trackers[i];
+			logmsg("retransmit:no manifest ack from tracker (%s)\n",
+				inet_ntoa(in));
+			manifest_mtime = 0;
+			continue;
+		}
+
+		if ((next == 0) || (up->deadline < next)) {
+			next = up->deadline;
+		}
+	}
+
+	if (timeline_upload.msg != NULL) {
+		if (timeline_upload.deadline <= now) {
+			resendupload(sockfd, &trackers[0], &timeline_upload, 0,
+				now);
+		}
+
+		if ((timeline_upload.msg != NULL) && ((next == 0) ||
+				(timeline_upload.deadline < next))) {
+			next = timeline_upload.deadline;
+		}
+	}
+
+	return(next);
+}
+
+/*
+ * send everything that is queued up, one REGISTER and one UNREGISTER
+ * message per tracker. when partitioned, each tracker only gets the
+ * messages for the files it owns.
+ */
+void
+flushmsgs(int sockfd, uint16_t num_trackers, in_addr_t *trackers,
+	ctlmsg_t *msgs, int nmsgs)
+{
+	char		regbuf[CTL_BATCH * sizeof(tracker_info_t)];
+	char		unregbuf[CTL_BATCH *
+				(sizeof(tracker_info_t) + sizeof(peer_t))];
+	tracker_info_t	*info;
+	int		owners[CTL_BATCH];
+	int		numreg, numunreg;
+	int		reglen, unreglen;
+	int		i, j;
+
+	for (j = 0 ; j < nmsgs ; ++j) {
+		owners[j] = (partitioned ? owner(msgs[j].hash, num_trackers) :
+			-1);
+	}
+
+	for (i = 0 ; i < num_trackers ; ++i) {
+		bzero(regbuf, sizeof(regbuf));
+		bzero(unregbuf, sizeof(unregbuf));
+		numreg = numunreg = 0;
+		reglen = unreglen = 0;
+
+		for (j = 0 ; j < nmsgs ; ++j) {
+			if ((owners[j] != -1) && (owners[j] != i)) {
+				continue;
+			}
+
+			if (msgs[j].op == REGISTER) {
+				info = (tracker_info_t *)&regbuf[reglen];
+				info->hash = msgs[j].hash;
+				info->numpeers = 0;
+
+				reglen += sizeof(tracker_info_t);
+				++numreg;
+			} else {
+				info = (tracker_info_t *)&unregbuf[unreglen];
+				info->hash = msgs[j].hash;
+
+				/*
+				 * no peer means this host
+				 */
+				if (msgs[j].peer != 0) {
+					info->numpeers = 1;
+					info->peers[0].ip = msgs[j].peer;
+				} else {
+					info->numpeers = 0;
+				}
+
+				unreglen += sizeof(tracker_info_t) +
+					(info->numpeers * sizeof(peer_t));
+				++numunreg;
+			}
+		}
+
+		if (numreg > 0) {
+			sendregister(sockfd, trackers, i, numreg,
+				(tracker_info_t *)regbuf);
+		}
+
+		if (numunreg > 0) {
+			unregister_hash(sockfd, &trackers[i], numunreg,
+				(tracker_info_t *)unregbuf);
+		}
+	}
+}
+
+/*
+ * curl callback for a prefetch, we only want the file to end up in the
+ * cache
+ */
+static size_t
+discard(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	return(size * nmemb);
+}
+
+/*
+ * the prefetch process is done (or was killed)
+ */
+static void
+prefetchdone()
+{
+	char	mark[PATH_MAX];
+
+	prefetchmark(mark, sizeof(mark), prefetch_hash);
+	unlink(mark);
+
+	prefetch_pid = -1;
+}
+
+/*
+ * one of the prefetch queues (FROM_*)
+ */
+static uint64_t *
+prefetchqueue(int from, int **len, int *max)
+{
+	switch (from) {
+	case FROM_COMPLETE:
+		*len = &completelen;
+		*max = PREFETCH_WINDOW;
+		return(completeq);
+
+	case FROM_PREDICT:
+		*len = &predictlen;
+		*max = PREFETCH_WINDOW;
+		return(predictq);
+
+	default:
+		*len = &prefetchlen;
+		*max = PREFETCH_QUEUE;
+		return(prefetchq);
+	}
+}
+
+/*
+ * the prefetch that was running got out of the installer's way. put its
+ * file back at the head of its queue.
+ */
+static void
+prefetchrequeue()
+{
+	uint64_t	*queue;
+	int		*len;
+	int		max;
+
+	queue = prefetchqueue(prefetch_from, &len, &max);
+
+	if (*len < max) {
+		memmove(&queue[1], &queue[0], *len * sizeof(queue[0]));
+		queue[0] = prefetch_hash;
+		++(*len);
+	}
+}
+
+/*
+ * take a message for the prefetcher off the pipe
+ */
+void
+prefetchmsg(ctlmsg_t *msg)
+{
+	int	i, s;
+
+	switch (msg->op) {
+	case PREFETCH:
+		if (prefetchlen < PREFETCH_QUEUE) {
+			prefetchq[prefetchlen++] = msg->hash;
+		}
+		break;
+
+	case COMPLETE:
+		if ((prefetch_pid > 0) && (prefetch_hash == msg->hash)) {
+			break;
+		}
+
+		for (i = 0 ; i < completelen ; ++i) {
+			if (completeq[i] == msg->hash) {
+				break;
+			}
+		}
+
+		if ((i == completelen) && (completelen < PREFETCH_WINDOW)) {
+			completeq[completelen++] = msg->hash;
+		}
+		break;
+
+	case PREDICT:
+		if (newwindowlen < PREFETCH_WINDOW) {
+			newwindow[newwindowlen++] = msg->hash;
+		}
+
+		if (!msg->last) {
+			break;
+		}
+
+		/*
+		 * the predictions changed. a predicted file that is being
+		 * fetched, but isn't in the new window, is not needed soon
+		 * anymore.
+		 */
+		memcpy(predictq, newwindow, newwindowlen * sizeof(uint64_t));
+		predictlen = newwindowlen;
+		newwindowlen = 0;
+
+		if ((prefetch_pid > 0) && (prefetch_from == FROM_PREDICT)) {
+			for (i = 0 ; i < predictlen ; ++i) {
+				if (predictq[i] == prefetch_hash) {
+					break;
+				}
+			}
+
+			if (i == predictlen) {
+				kill(prefetch_pid, SIGTERM);
+				waitpid(prefetch_pid, &s, 0);
+				prefetchdone();
+			} else {
+				/*
+				 * already on its way
+				 */
+				--predictlen;
+				memmove(&predictq[i], &predictq[i + 1],
+					(predictlen - i) * sizeof(uint64_t));
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * the name of the file 'hash' from the queue 'from'. returns 0 if it is
+ * known.
+ */
+static int
+prefetchname(int from, uint64_t hash, char *name, size_t len)
+{
+	file_name_t	key, *found;
+	FILE		*file;
+	char		buf[PATH_MAX];
+	char		*ptr;
+
+	if (from == FROM_COMPLETE) {
+		completename(buf, sizeof(buf), hash);
+		if ((file = fopen(buf, "r")) != NULL) {
+			ptr = fgets(name, len, file);
+			fclose(file);
+
+			if (ptr != NULL) {
+				name[strcspn(name, "\n")] = '\0';
+				return(0);
+			}
+		}
+	}
+
+	key.hash = hash;
+	if ((found = (file_name_t *)bsearch(&key, file_names,
+			file_numnames, sizeof(file_name_t), namecmp)) == NULL) {
+		return(-1);
+	}
+
+	snprintf(name, len, "%s", found->name);
+	return(0);
+}
+
+/*
+ * start fetching the next file: the files the installer only read part
+ * of first, then the predicted files, then the hot files. the file is
+ * asked for through the local web server, just like the installer would
+ * ask for it, so it is cached and registered with the tracker(s) as
+ * usual. only one file is fetched at a time, at a low CPU priority, and
+ * only while the installer isn't waiting for a download of its own (the
+ * process that serves the prefetch stops when the installer starts
+ * waiting, see dobody()). hot files are fetched no faster than
+ * PREFETCH_RATE.
+ *
+ * while a file is being fetched, PREFETCH_MARK.<hash> exists, so a
+ * request for the same file waits for it (see waitprefetch()).
+ */
+void
+prefetch()
+{
+	struct stat		buf;
+	struct curl_slist	*headers;
+	CURL			*curlhandle;
+	uint64_t		*queue;
+	uint64_t		hash;
+	int			*len;
+	char			name[PATH_MAX];
+	char			url[PATH_MAX];
+	char			mark[PATH_MAX];
+	int			s, fd, max, found;
+
+	if (prefetch_pid > 0) {
+		if (waitpid(prefetch_pid, &s, WNOHANG) != prefetch_pid) {
+			return;
+		}
+
+		prefetchdone();
+
+		/*
+		 * it failed because it was stopped for the installer, try
+		 * it again later
+		 */
+		if ((!WIFEXITED(s) || (WEXITSTATUS(s) != 0)) &&
+				cache_waiting(prefetch_hash)) {
+			prefetchrequeue();
+		} else if (prefetch_from == FROM_COMPLETE) {
+			completename(mark, sizeof(mark), prefetch_hash);
+			unlink(mark);
+		}
+	}
+
+	if (cache_waiting(0)) {
+		return;
+	}
+
+	found = 0;
+	while (!found && ((completelen > 0) || (predictlen > 0) ||
+			(prefetchlen > 0))) {
+		if (completelen > 0) {
+			prefetch_from = FROM_COMPLETE;
+		} else if (predictlen > 0) {
+			prefetch_from = FROM_PREDICT;
+		} else {
+			prefetch_from = FROM_HOT;
+		}
+
+		queue = prefetchqueue(prefetch_from, &len, &max);
+
+		hash = queue[0];
+		--(*len);
+		memmove(&queue[0], &queue[1], *len * sizeof(queue[0]));
+
+		if (prefetchname(prefetch_from, hash, name, sizeof(name)) != 0) {
+			continue;
+		}
+
+		if (stat(name, &buf) == 0) {
+			/*
+			 * we already have it
+			 */
+			if (prefetch_from == FROM_COMPLETE) {
+				completename(mark, sizeof(mark), hash);
+				unlink(mark);
+			}
+			continue;
+		}
 
-		logmsg("trackfile:peers:\n");
+		found = 1;
+	}
 
-		for (i = 0 ; i < infoptr->numpeers; ++i) {
-			struct in_addr	in;
+	if (!found) {
+		return;
+	}
 
-			in.s_addr = infoptr->peers[i].ip;
-			logmsg("\t%s : %c %d\n", inet_ntoa(in),
-				(infoptr->peers[i].state == DOWNLOADING ?
-					'd' : 'r'), infoptr->peers[i].state);
+	snprintf(url, sizeof(url), "http://127.0.0.1%s", name);
+
+	prefetch_hash = hash;
+	prefetchmark(mark, sizeof(mark), prefetch_hash);
+	if ((fd = open(mark, O_WRONLY|O_CREAT, 0644)) >= 0) {
+		close(fd);
+	}
+
+	if ((prefetch_pid = fork()) != 0) {
+		if (prefetch_pid < 0) {
+			logmsg("prefetch:fork failed:errno (%d)\n", errno);
+			prefetchdone();
 		}
-#endif
+		return;
+	}
 
-#ifdef	TIMEIT
-		gettimeofday(&end_time, NULL);
-		s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-		e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-		logmsg("trackfile:svc time6: %lld usec file (%s)\n", (e - s),
-			filename);
-#endif
+	close(ctl_readfd);
+	close(ctl_lockfd);
 
-		for (i = 0 ; i < infoptr->numpeers; ++i) {
-#ifdef	DEBUG
-			{
-			struct in_addr	in;
-			int		k;
+	if ((curlhandle = curl_easy_init()) == NULL) {
+		_exit(1);
+	}
 
-			in.s_addr = infoptr->peers[i].ip;
+	headers = curl_slist_append(NULL, "X-Prefetch: 1");
 
-			if (strncmp(inet_ntoa(in), "10.", 3)) {
-				for (k = 0 ; i < num_trackers; ++k) {
-					send_msg(sockfd, &trackers[k],
-						STOP_SERVER);
-				}
+	curl_easy_setopt(curlhandle, CURLOPT_URL, url);
+	curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, discard);
+	curl_easy_setopt(curlhandle, CURLOPT_FAILONERROR, 1L);
 
-				logmsg("trackfile:bogus IP (%s)\n",
-					inet_ntoa(in));
-				exit(-1);
-			}
-			}
-#endif
-			if (getremote(filename, &infoptr->peers[i], range,
-					curlhandle) == 0) {
-				/*
-				 * successful download, exit this loop
-				 */
-				success = 1;
-				break;
-			} else {
-				/*
-				 * mark the peer as 'bad'. we do this by
-				 * telling the tracker server to 'unregister'
-				 * this hash.
-				 */
+	if (prefetch_from == FROM_HOT) {
+		curl_easy_setopt(curlhandle, CURLOPT_MAX_RECV_SPEED_LARGE,
+			(curl_off_t)PREFETCH_RATE);
+	}
+
+	if (curl_easy_perform(curlhandle) != CURLE_OK) {
+		_exit(1);
+	}
 
-				tracker_info_t	*info;
-				int		len;
-				int		j;
+	logmsg("prefetch:fetched %s\n", name);
+	_exit(0);
+}
+
+/*
+ * the control process. there is one for the node (see startcontrol()),
+ * it runs for as long as the tracker-client process 'parent' that started
+ * it (and so the web server that serves our files to the other peers) is
+ * running and:
+ *
+ *	- keeps this host's lease on the tracker(s) alive
+ *	- writes the installer's manifest (see startmanifest()), sends it, and
+ *	  sends it again if it changes
+ *	- ships this host's install timeline to the first tracker
+ *	- batches the REGISTER and UNREGISTER messages that come in on 'fd'.
+ *	  a batch is sent CTL_FLUSH_MSEC after its first message, or as soon
+ *	  as it has CTL_BATCH messages.
+ *	- sends REGISTER batches again until the tracker acks them
+ *	- fetches the files the installer is going to ask for next, and
+ *	  the hot files the trackers ask for (see prefetch())
+ */
+void
+control(pid_t parent, int fd, uint16_t num_trackers, in_addr_t *trackers)
+{
+	struct stat		buf;
+	struct timeval		timeout;
+	fd_set			fds;
+	ctlmsg_t		msgs[CTL_BATCH];
+	unsigned long long	now, next_keepalive, flush_at, wakeup;
+	unsigned long long	next_retransmit, deadline;
+	unsigned long long	last_registered = 0, last_dropped = 0;
+	int			maxfd;
+	ssize_t			len;
+	int			nmsgs = 0;
+	int			sockfd;
+	int			i, j;
+
+	if ((sockfd = init_tracker_comm(0)) < 0) {
+		logmsg("control:init_tracker_comm failed\n");
+		return;
+	}
+
+	for (i = 0 ; i < num_trackers ; ++i) {
+		srtt[i] = rttvar[i] = 0;
+		rto[i] = CTL_RTO_INIT;
+	}
 
-				len = sizeof(*info) + sizeof(peer_t);
+	next_keepalive = now_msecs();
+	flush_at = 0;
 
-				if ((info = (tracker_info_t *)malloc(len))
-						!= NULL) {
+	while (getppid() == parent) {
+		now = now_msecs();
 
-					bzero(info, len);
-					info->hash = hash;
-					info->numpeers = 1;
-					info->peers[0].ip =
-						infoptr->peers[i].ip;
+		if (now >= next_keepalive) {
+			for (i = 0 ; i < num_trackers ; ++i) {
+				send_msg(sockfd, &trackers[i], KEEPALIVE);
+			}
 
-					for (j = 0 ; j < num_trackers; ++j) {
-						unregister_hash(sockfd,
-							&trackers[j], 1, info);
-					}
+			startmanifest();
 
-					free(info);
+			if ((stat(NAMES_FILE, &buf) == 0) &&
+					(buf.st_mtime != names_mtime)) {
+				if (readnames() == 0) {
+					names_mtime = buf.st_mtime;
 				}
 			}
-		}
-	}
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time7: %lld usec file (%s)\n", (e - s), filename);
-#endif
+			if ((stat(MANIFEST_FILE, &buf) == 0) &&
+					(buf.st_mtime != manifest_mtime)) {
+				if (sendmanifest(sockfd, num_trackers,
+						trackers) == 0) {
+					manifest_mtime = buf.st_mtime;
+				}
+			}
 
-	if (!success) {
-		/*
-		 * unable to download the file from a peer, need to
-		 * get it from one of the package servers
-		 */
+			if (num_trackers > 0) {
+				sendtimeline(sockfd, &trackers[0]);
+			}
 
-		for (i = 0 ; i < num_pkg_servers ; ++i) {
-			peer_t	pkgpeer;
+			if ((registered != last_registered) ||
+					(dropped != last_dropped)) {
+				logmsg("control:registered %llu retransmits %llu dropped %llu\n",
+					registered, retransmits, dropped);
+				last_registered = registered;
+				last_dropped = dropped;
+			}
 
-			pkgpeer.ip = pkg_servers[i];
-			pkgpeer.state = READY;
+			next_keepalive = now + (KEEPALIVE_INTERVAL * 1000);
+		}
 
+		if ((nmsgs > 0) && (now >= flush_at)) {
+			flushmsgs(sockfd, num_trackers, trackers, msgs, nmsgs);
+			nmsgs = 0;
+		}
+
+		readacks(sockfd, num_trackers, trackers);
+		next_retransmit = retransmit(sockfd, num_trackers, trackers,
+			now);
+		prefetch();
+
+		wakeup = next_keepalive;
+		if ((nmsgs > 0) && (flush_at < wakeup)) {
+			wakeup = flush_at;
+		}
+		if ((next_retransmit != 0) && (next_retransmit < wakeup)) {
+			wakeup = next_retransmit;
+		}
+		if (((prefetch_pid > 0) || (completelen > 0) ||
+				(predictlen > 0) || (prefetchlen > 0)) &&
+				(now + 1000 < wakeup)) {
 			/*
-			 * if this is the last package server, then
-			 * disable the connection timeout -- this is our
-			 * last hope of getting the package.
+			 * look for the end of the prefetch (or for the
+			 * installer to stop waiting) once a second
 			 */
-			if (i == (num_pkg_servers - 1)) { 
-				if ((curlcode = curl_easy_setopt(curlhandle,
-					CURLOPT_CONNECTTIMEOUT, 0)) !=
-					CURLE_OK) {
+			wakeup = now + 1000;
+		}
 
-					logmsg("getremote:curl_easy_setopt():failed:(%d)\n", curlcode);
-				}
-			}
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+		if (wakeup > now) {
+			timeout.tv_sec = (wakeup - now) / 1000;
+			timeout.tv_usec = ((wakeup - now) % 1000) * 1000;
+		}
 
-			if (getremote(filename, &pkgpeer, range,
-					curlhandle) == 0) {
-				success = 1;
-			}
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		FD_SET(sockfd, &fds);
+		maxfd = (fd > sockfd ? fd : sockfd);
+
+		if (select(maxfd + 1, &fds, NULL, NULL, &timeout) <= 0) {
+			continue;
+		}
 
+		if (!FD_ISSET(fd, &fds)) {
 			/*
-			 * reset the connection timeout
+			 * just acks, readacks() gets them at the top of
+			 * the loop
 			 */
-			if (i == (num_pkg_servers - 1)) { 
-				if ((curlcode = curl_easy_setopt(curlhandle,
-					CURLOPT_CONNECTTIMEOUT, 2)) !=
-					CURLE_OK) {
+			continue;
+		}
 
-					logmsg("getremote:curl_easy_setopt():failed:(%d)\n", curlcode);
-				}
-			}
+		/*
+		 * the FIFO only ever holds whole messages (they are smaller
+		 * than PIPE_BUF, so a write from any process is atomic)
+		 */
+		len = read(fd, &msgs[nmsgs],
+			(CTL_BATCH - nmsgs) * sizeof(ctlmsg_t));
 
-			if (success) {
-				break;
+		if (len <= 0) {
+			continue;
+		}
+
+		/*
+		 * messages for the prefetcher are handled right away,
+		 * everything else is batched
+		 */
+		len /= sizeof(ctlmsg_t);
+		for (i = nmsgs, j = nmsgs ; i < nmsgs + len ; ++i) {
+			if ((msgs[i].op == REGISTER) ||
+					(msgs[i].op == UNREGISTER)) {
+				msgs[j++] = msgs[i];
+			} else {
+				prefetchmsg(&msgs[i]);
 			}
 		}
-	}
+		len = j - nmsgs;
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time8: %lld usec file (%s)\n", (e - s), filename);
-#endif
+		if (len == 0) {
+			continue;
+		}
 
-	if (success) {
-		tracker_info_t	info[1];
+		if (nmsgs == 0) {
+			flush_at = now_msecs() + CTL_FLUSH_MSEC;
+		}
+
+		nmsgs += len;
 
-		bzero(info, sizeof(info));
+		if (nmsgs == CTL_BATCH) {
+			flushmsgs(sockfd, num_trackers, trackers, msgs, nmsgs);
+			nmsgs = 0;
+		}
+	}
 
-		info[0].hash = hash;
-		info[0].numpeers = 0;
+	/*
+	 * the other tracker-client processes may have handed us more
+	 * messages. send them too, the next control process won't see them.
+	 */
+	while ((len = read(fd, &msgs[nmsgs],
+			(CTL_BATCH - nmsgs) * sizeof(ctlmsg_t))) > 0) {
+		len /= sizeof(ctlmsg_t);
+		for (i = nmsgs, j = nmsgs ; i < nmsgs + len ; ++i) {
+			if ((msgs[i].op == REGISTER) ||
+					(msgs[i].op == UNREGISTER)) {
+				msgs[j++] = msgs[i];
+			}
+		}
+		nmsgs = j;
 
-		for (i = 0 ; i < num_trackers; ++i) {
-			register_hash(sockfd, &trackers[i], 1, info);
+		if (nmsgs == CTL_BATCH) {
+			flushmsgs(sockfd, num_trackers, trackers, msgs, nmsgs);
+			nmsgs = 0;
 		}
 	}
 
+	if (nmsgs > 0) {
+		flushmsgs(sockfd, num_trackers, trackers, msgs, nmsgs);
+	}
+
 	/*
-	 * lookup() and getprediction() mallocs tracker_info
+	 * the control process that takes over starts with nothing pending,
+	 * so the batches that are still waiting for an ack get up to
+	 * CTL_RTO_MAX to get one
 	 */
-	if (tracker_info != NULL) {
-		free(tracker_info);
-	}	
+	deadline = now_msecs() + CTL_RTO_MAX;
+	while (now_msecs() < deadline) {
+		for (j = 0 ; j < CTL_PENDING ; ++j) {
+			if (pending[j].msg != NULL) {
+				break;
+			}
+		}
 
-#ifdef	TIMEIT
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("trackfile:svc time: %lld usec file (%s)\n", (e - s), filename);
-#endif
+		if (j == CTL_PENDING) {
+			break;
+		}
 
-	if (success) {
-		return(0);
+		usleep(CTL_RTO_MIN * 1000);
+		readacks(sockfd, num_trackers, trackers);
+		retransmit(sockfd, num_trackers, trackers, now_msecs());
 	}
 
-	return(-1);
+	close(sockfd);
 }
 
+/*
+ * start the control process, unless another tracker-client process has
+ * already started it, and open CONTROL_FIFO to it. the first process to
+ * lock CONTROL_MARKER starts it, and the control process inherits the
+ * lock and holds it until it exits. then the next process that can't
+ * hand over a message takes over (see ctlwrite()). returns 0 if 'ctlfd'
+ * is open.
+ */
 int
-doit(int sockfd, uint16_t num_trackers, in_addr_t *trackers, uint16_t maxpeers,
-	uint16_t num_pkg_servers, in_addr_t *pkg_servers, CURL *curlhandle)
+startcontrol()
 {
-	struct timeval		start_time;
-#ifdef	TIMEIT
-#endif
-	struct timeval		end_time;
-	unsigned long long	s, e;
-	char			*forminfo;
-	char			*range;
-	char			filename[PATH_MAX];
+	pid_t	parent;
+	pid_t	pid;
+	int	lockfd, fd;
 
-	gettimeofday(&start_time, NULL);
+	if ((lockfd = open(CONTROL_MARKER, O_RDWR|O_CREAT, 0644)) < 0) {
+		logmsg("startcontrol:open of %s failed:errno (%d)\n",
+			CONTROL_MARKER, errno);
+		return(-1);
+	}
 
-	bzero(filename, sizeof(filename));
+	if (flock(lockfd, LOCK_EX|LOCK_NB) == 0) {
+		/*
+		 * the control process opens the FIFO for reading and
+		 * writing, so it stays open while the other processes come
+		 * and go
+		 */
+		if (((mkfifo(CONTROL_FIFO, 0600) != 0) && (errno != EEXIST)) ||
+				((fd = open(CONTROL_FIFO, O_RDWR|O_NONBLOCK))
+					< 0)) {
+			logmsg("startcontrol:%s failed:errno (%d)\n",
+				CONTROL_FIFO, errno);
+			close(lockfd);
+			return(-1);
+		}
 
-	if ((forminfo = getenv("QUERY_STRING")) == NULL) {
-		senderror(500, "No QUERY_STRING", errno);
-		return(0);
-	}
+		parent = getpid();
 
-	if ((range = getenv("HTTP_RANGE")) != NULL) {
-		char	*ptr;
+		if ((pid = fork()) == 0) {
+			ctl_readfd = fd;
+			ctl_lockfd = lockfd;
+			control(parent, fd, ctl_num_trackers, ctl_trackers);
+			_exit(0);
+		}
 
-		if ((ptr = strchr(range, '=')) != NULL) {
-			range = ptr + 1;
+		close(fd);
+
+		if (pid < 0) {
+			logmsg("startcontrol:fork failed:errno (%d)\n", errno);
+			close(lockfd);
+			return(-1);
 		}
-	}
 
-	if (getargs(forminfo, filename) != 0) {
-		senderror(500, "getargs():failed", errno);
-		return(0);
+		logmsg("startcontrol:started control process (%d)\n",
+			(int)pid);
 	}
 
-	
-	//let's unescape filename
-        char * filename_unescaped;
-	filename_unescaped = curl_easy_unescape(curlhandle, filename , 0, NULL );
-	//filename_unescaped will be equal or shorter to filename
-	strcpy(filename, filename_unescaped);
-	curl_free(filename_unescaped);
-
-	/*
-	 * the time is 'epoch' time
-	 */
-	logmsg("%d : doit:file %s\n", start_time.tv_sec, basename(filename));
-#ifdef	DEBUG
-	logmsg("doit:getting file (%s)\n", filename);
-#endif
+	close(lockfd);
 
 	/*
-	 * if the file is local, just read it off the disk, otherwise, ask
-	 * the tracker where the file is
+	 * fails (ENXIO) if the control process another tracker-client
+	 * process started hasn't opened the FIFO yet. the messages are
+	 * sent straight to the trackers until the next try.
 	 */
-	if (getlocal(filename, range) != 0) {
-		if (trackfile(sockfd, filename, range, num_trackers, trackers,
-				maxpeers, num_pkg_servers, pkg_servers,
-				curlhandle) != 0) {
-			senderror(404, "File not found", 0);
-		}
+	if ((ctlfd = open(CONTROL_FIFO, O_WRONLY|O_NONBLOCK)) < 0) {
+		return(-1);
 	}
 
-#ifdef	DEBUG
-	logmsg("doit:done:file (%s)\n\n", filename);
-#endif
-
-#ifdef	TIMEIT
-#endif
-	gettimeofday(&end_time, NULL);
-	s = (start_time.tv_sec * 1000000) + start_time.tv_usec;
-	e = (end_time.tv_sec * 1000000) + end_time.tv_usec;
-	logmsg("doit:svc time: %lld usec file %s from %s\n\n",
-		(e - s) - curltime, basename(filename), fromip);
-
 	return(0);
 }
 
@@ -1390,6 +3902,7 @@ main()
 	int		sockfd;
 	char		trackers_url[PATH_MAX];
 	char		pkg_servers_url[PATH_MAX];
+	char		trackermode[PATH_MAX];
 	char		buf[PATH_MAX];
 
 	if ((sockfd = init_tracker_comm(0)) < 0) {
@@ -1411,6 +3924,11 @@ main()
 	fgets(buf, sizeof(buf), file);
 	sscanf(buf, "var.pkgservers = \"%[^\"]", pkg_servers_url);
 
+	trackermode[0] = '\0';
+	if (fgets(buf, sizeof(buf), file) != NULL) {
+		sscanf(buf, "var.trackermode = \"%[^\"]", trackermode);
+	}
+
 	fclose(file);
 
 	fprintf(stderr, "main:trackers_url (%s)\n", trackers_url);
@@ -1422,6 +3940,27 @@ main()
 		return(-1);
 	}
 
+	if ((strcmp(trackermode, "partition") == 0) && (num_trackers > 1)) {
+		ring_init(num_trackers, trackers);
+		partitioned = 1;
+
+		logmsg("main:files are partitioned over %d trackers\n",
+			num_trackers);
+	}
+
+	/*
+	 * start the control process (or find the one another tracker-client
+	 * process started). it renews our lease on the tracker(s) and sends
+	 * our REGISTER and UNREGISTER messages in batches. if it can't be
+	 * reached, the messages are sent one at a time.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	ctl_num_trackers = num_trackers;
+	memcpy(ctl_trackers, trackers, num_trackers * sizeof(in_addr_t));
+
+	startcontrol();
+
 	/*
 	 * initialize curl
 	 */
@@ -13,6 +13,186 @@
 #define MAX_SHUFFLE_PEERS	64
 #define	MAX_PEERS 	PEERS_PER_PREDICTION		
 
+/*
+ * with 'var.trackermode = "partition"' in /tmp/rocks.conf, tracker-client
+ * spreads the files over the trackers with a consistent hash ring (see
+ * ring_init() in client.c) instead of telling every tracker about every
+ * file. each tracker is put on the ring TRACKER_VNODES times.
+ */
+#define	TRACKER_VNODES		64
+
+/*
+ * a peer's registrations are dropped if the tracker doesn't hear from
+ * that peer for LEASE_TTL seconds. a running tracker-client sends a
+ * KEEPALIVE every KEEPALIVE_INTERVAL seconds.
+ */
+#define	LEASE_TTL		15
+#define	KEEPALIVE_INTERVAL	5
+
+/*
+ * tracker-client sends its REGISTER and UNREGISTER messages in batches.
+ * a batch goes out CTL_FLUSH_MSEC after its first message was queued, or
+ * as soon as it has CTL_BATCH messages.
+ */
+#define	CTL_FLUSH_MSEC		200
+#define	CTL_BATCH		128
+
+/*
+ * lighttpd runs several tracker-client processes, but a node has only one
+ * control process (the one that batches the messages, keeps the lease
+ * alive and prefetches). it holds a lock on CONTROL_MARKER for as long as
+ * it runs, and all the tracker-client processes hand it their messages
+ * through CONTROL_FIFO.
+ */
+#define	CONTROL_MARKER		"/tmp/tracker-control"
+#define	CONTROL_FIFO		"/tmp/tracker-control.fifo"
+
+/*
+ * a REGISTER batch that asks for an ack (REGISTER_ACK) is sent again if
+ * the ack doesn't come back within the retransmit timeout. the timeout
+ * follows the round trip time to each tracker, between CTL_RTO_MIN and
+ * CTL_RTO_MAX msecs. a batch is dropped after CTL_MAX_TRIES sends.
+ */
+#define	CTL_RTO_INIT		250
+#define	CTL_RTO_MIN		50
+#define	CTL_RTO_MAX		2000
+#define	CTL_MAX_TRIES		5
+#define	CTL_PENDING		64
+
+/*
+ * when nobody has a file yet, the first host that asks for it is told to
+ * get it from a package server and is listed as a DOWNLOADING peer for it
+ * for INFLIGHT_TTL seconds (or until it registers the file). a host that
+ * only wants part of the file (LOOKUP_NOCLAIM) never registers it, so it
+ * isn't listed. other hosts that are sent to a DOWNLOADING peer and can't
+ * get the file from it ask the tracker again, HANDOFF_POLL_MSEC later and
+ * then twice as long each time, until the peer has registered the file,
+ * has been dropped or HANDOFF_WAIT_MSEC have gone by.
+ */
+#define	INFLIGHT_TTL		30
+#define	HANDOFF_WAIT_MSEC	10000
+#define	HANDOFF_POLL_MSEC	250
+
+/*
+ * a download is given up on when it moves less than 1/STALL_RATIO of the
+ * host's usual rate (and never less than STALL_MIN_RATE bytes a second)
+ * for STALL_SECS seconds. the next peer or package server is then asked
+ * for the rest of the file. a rate is only measured on transfers of at
+ * least STALL_SAMPLE_BYTES, and the rates of PEER_RATES hosts are kept.
+ */
+#define	STALL_RATIO		8
+#define	STALL_MIN_RATE		(32 * 1024)
+#define	STALL_SECS		5
+#define	STALL_SAMPLE_BYTES	(256 * 1024)
+#define	PEER_RATES		256
+
+/*
+ * hot files. the tracker counts the LOOKUPs for each hash and halves the
+ * counts every HOT_DECAY_SECS seconds. a hash with at least HOT_MIN_DEMAND
+ * LOOKUPs and more than HOT_RATIO LOOKUPs per READY peer is 'hot'. a host
+ * that was handed out as a peer no more than HOT_IDLE_LOAD times (also
+ * halved every HOT_DECAY_SECS seconds) is sent up to HOT_HINTS hot files
+ * it doesn't have with a LOOKUP response, at most once every
+ * HOT_HINT_SECS seconds. tracker-client fetches them in the background,
+ * one at a time and no faster than PREFETCH_RATE bytes a second.
+ */
+#define	HOT_DECAY_SECS		10
+#define	HOT_MIN_DEMAND		8
+#define	HOT_RATIO		4
+#define	HOT_IDLE_LOAD		16
+#define	HOT_HINTS		4
+#define	HOT_HINT_SECS		5
+#define	HOT_LIST		32
+#define	PREFETCH_RATE		(4 * 1024 * 1024)
+#define	PREFETCH_QUEUE		64
+
+/*
+ * tracker-client also fetches the next PREFETCH_WINDOW files the tracker
+ * predicted, while the installer is busy installing the last one. it
+ * stops (and waits) while the installer is waiting for a download of its
+ * own, for at most PREFETCH_HOLDOFF_MSEC. PREFETCH_MARK.<hash> exists
+ * while a file is being prefetched. COMPLETE_NAME.<hash> holds the name
+ * of a file the installer only read part of, until all of it is fetched.
+ */
+#define	PREFETCH_WINDOW		4
+#define	PREFETCH_HOLDOFF_MSEC	30000
+#define	PREFETCH_MARK		"/tmp/tracker-prefetch"
+#define	COMPLETE_NAME		"/tmp/tracker-complete"
+
+/*
+ * the ramdisk /install cache (see cache.c) may use CACHE_RAM_PERCENT of
+ * the free memory plus what it already holds, but never less than
+ * CACHE_MIN_BYTES. a file stays hot for CACHE_HOT_SECS seconds after the
+ * tracker last hinted it. at most CACHE_EVICT_MAX files are thrown away
+ * for one download.
+ */
+#define	CACHE_RAM_PERCENT	50
+#define	CACHE_MIN_BYTES		(64 * 1024 * 1024)
+#define	CACHE_HOT_SECS		60
+#define	CACHE_EVICT_MAX		32
+
+#define	CACHE_UNKNOWN		0
+#define	CACHE_HIT		1
+#define	CACHE_MISS		2
+
+/*
+ * size of the tracker server's socket receive buffer
+ */
+#define	TRACKER_RCVBUF		(4 * 1024 * 1024)
+
+/*
+ * the host -> switch/rack/coop snapshot (see topology.c and
+ * export-topology)
+ */
+#define	TOPOLOGY_FILE		"/var/lib/tracker/topology"
+
+#define	TOPO_SAME_SWITCH	0
+#define	TOPO_SAME_RACK		1
+#define	TOPO_FAR		2
+
+/*
+ * MANIFEST_FILE lists the files the installer is going to ask for, in
+ * order, one file name per line. the control process of tracker-client
+ * writes it (see makemanifest() in manifest.c) from the %packages section
+ * of the kickstart file, under a temporary name that is then renamed into
+ * place. it uploads the manifest to the tracker(s) MANIFEST_CHUNK hashes
+ * per message, and from then on a LOOKUP returns peer info for the next
+ * MANIFEST_PREDICTIONS files in the manifest.
+ *
+ * the kickstart file doesn't list the dependencies, so the manifest is a
+ * close guess of the order. a LOOKUP for a file that isn't in it gets the
+ * hashid-order window.
+ */
+#define	MANIFEST_FILE		"/tmp/tracker-manifest"
+#define	KICKSTART_FILE		"/tmp/ks.cfg"
+
+/*
+ * every file in the repository the manifest is made from, one file name
+ * per line. makemanifest() writes it along with MANIFEST_FILE, and the
+ * control process uses it to get the names of the files the tracker(s)
+ * only send the hash of.
+ */
+#define	NAMES_FILE		"/tmp/tracker-names"
+#define	MANIFEST_TRIES		5
+#define	MANIFEST_CHUNK		1024
+#define	MANIFEST_PREDICTIONS	32
+#define	MANIFEST_MAX		(64 * 1024)
+
+/*
+ * install timeline. the loader and tracker-client append one line per
+ * span (bringing the network up, fetching the kickstart file and the
+ * images, each file tracker-client fetches) to TIMELINE_FILE:
+ *
+ *	<name> <start usec> <end usec> [<key>=<value> ...]
+ *
+ * the control process ships the new lines to the first tracker (the
+ * frontend) every KEEPALIVE_INTERVAL seconds, at most TIMELINE_CHUNK bytes
+ * per message, and the tracker merges them into CLUSTER_TIMELINE_FILE.
+ */
+#define	TIMELINE_FILE		"/tmp/tracker-timeline"
+#define	TIMELINE_CHUNK		1200
+#define	CLUSTER_TIMELINE_FILE	"/tmp/tracker-timeline.csv"
+
 /*
  * don't know why this isn't in a standard include file
  */
@@ -42,6 +222,9 @@ typedef struct {
 #define	PEER_DONE	4
 #define	STOP_SERVER	5
 #define	DUMP_TABLES	6
+#define	KEEPALIVE	7
+#define	MANIFEST	8
+#define	TIMELINE	9
 
 /*
  * tracker 'states'
@@ -55,8 +238,17 @@ typedef struct {
 typedef struct {
 	tracker_header_t	header;
 	uint64_t		hash;
+	uint32_t		flags;
+	char			pad[4];		/* align on 64-bit boundary */
 } tracker_lookup_req_t;
 
+/*
+ * the requestor won't fetch and register the whole file (it wants a range
+ * of it), so don't list it as a DOWNLOADING peer. a request without the
+ * flags field has no flags set.
+ */
+#define	LOOKUP_NOCLAIM	0x0001
+
 typedef struct {
 	uint64_t	hash;
 	uint16_t	numpeers;
@@ -77,10 +269,15 @@ typedef struct {
 	peer_t		*peers;
 } hash_info_t;
 
+/*
+ * 'numhints' hashes (uint64_t) follow the last info entry. they are hot
+ * files the tracker would like this host to fetch ahead of time.
+ */
 typedef struct {
 	tracker_header_t	header;
 	uint32_t		numhashes;
-	char			pad[4];		/* 64-bit alignment */
+	uint16_t		numhints;
+	char			pad[2];		/* 64-bit alignment */
 	tracker_info_t		info[0];
 } tracker_lookup_resp_t;
 
@@ -96,11 +293,20 @@ typedef struct {
 typedef struct {
 	tracker_header_t	header;
 	uint32_t		numhashes;
-	char			pad[4];		/* 64-bit alignment */
+	uint32_t		flags;		/* also 64-bit alignment */
 	tracker_info_t		info[0];
 } tracker_register_t;
 
-/* there is no response to a 'register' message */
+/*
+ * there is no response to a 'register' message, unless the REGISTER_ACK
+ * flag is set. then the tracker sends back a tracker_register_resp_t with
+ * the same seqno.
+ */
+#define	REGISTER_ACK	0x0001
+
+typedef struct {
+	tracker_header_t	header;
+} tracker_register_resp_t;
 
 /*
  * UNREGISTER messages
@@ -121,6 +327,69 @@ typedef struct {
 	tracker_header_t	header;
 } tracker_unregister_resp_t;
 
+/*
+ * MANIFEST messages
+ */
+
+/*
+ * 'offset' is the index of hashes[0] in the whole manifest. a message
+ * with an offset of 0 starts a new manifest.
+ */
+typedef struct {
+	tracker_header_t	header;
+	uint32_t		offset;
+	uint32_t		numhashes;
+	uint64_t		hashes[0];
+} tracker_manifest_t;
+
+typedef struct {
+	tracker_header_t	header;
+} tracker_manifest_resp_t;
+
+/*
+ * TIMELINE messages
+ */
+
+/*
+ * 'offset' is where 'lines' starts in the host's TIMELINE_FILE, so a
+ * chunk that is sent twice is only written once. 'sent' is the host's
+ * clock (usecs) when the message went out; the tracker uses it to move
+ * the host's times onto its own clock. the ack's 'offset' is where the
+ * tracker wants the next chunk to start.
+ */
+typedef struct {
+	tracker_header_t	header;
+	uint64_t		sent;
+	uint32_t		offset;
+	uint32_t		length;
+	char			lines[0];
+} tracker_timeline_t;
+
+typedef struct {
+	tracker_header_t	header;
+	uint32_t		offset;
+	char			pad[4];		/* 64-bit alignment */
+} tracker_timeline_resp_t;
+
+/*
+ * DUMP_TABLES messages
+ */
+
+/*
+ * the tracker takes a snapshot of its tables and writes it out as CSV
+ * from a child process, so it never stops answering requests. if 'port'
+ * is set, the snapshot is sent over a TCP connection to that port on the
+ * host that asked for it, otherwise it is written to SNAPSHOT_FILE. a
+ * plain tracker_header_t (no port) is still accepted.
+ */
+#define	SNAPSHOT_FILE		"/tmp/tracker-snapshot.csv"
+
+typedef struct {
+	tracker_header_t	header;
+	uint16_t		port;		/* network byte order */
+	char			pad[6];		/* 64-bit alignment */
+} tracker_dump_req_t;
+
 /*
  * hash table to hold the order in which files are requested
  */
@@ -159,6 +428,19 @@ typedef struct {
 	char			*coop;
 } peer_timestamp_t;
 
+/*
+ * timer wheel (timer.c)
+ */
+#define	TIMER_TICK_MSEC		250
+
+typedef struct tracker_timer {
+	struct tracker_timer	*next;
+	struct tracker_timer	*prev;
+	unsigned long long	expires;	/* in ticks */
+	void			(*func)(void *);
+	void			*arg;
+} tracker_timer_t;
+
 /*
  * prototypes
  */
@@ -168,3 +450,15 @@ extern ssize_t tracker_recv(int, void *, size_t, struct sockaddr *,
 	socklen_t *, struct timeval *);
 extern int init_tracker_comm(int);
 extern void dumpbuf(char *, int);
+
+extern void timer_init();
+extern int timer_pending(tracker_timer_t *);
+extern void timer_add(tracker_timer_t *, unsigned int);
+extern void timer_del(tracker_timer_t *);
+extern void timer_run();
+extern void timer_next(struct timeval *);
+
+extern void topology_init(char *);
+extern int topology_distance(in_addr_t, in_addr_t);
+extern int topology_group(in_addr_t);
+extern char *topology_coop(in_addr_t);